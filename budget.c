@@ -0,0 +1,193 @@
+#include "common.h"
+
+/** Memory budget shared by concurrent wrappers.
+    The pool is a small file of fixed-size slots, one per process
+    holding a reservation: its pid and the amount of MiB it holds.
+    The file is only read and written under flock().
+    Slots of processes which have died are free again, so a crashed
+    or killed wrapper doesn't leak its share of the budget.
+    A holder is recognized by its pid and start time, so a slot isn't
+    kept by an unrelated process which got the same pid. Without /proc
+    the start time is unknown and such a slot stays taken until that
+    process exits.
+**/
+
+struct budget_slot {
+        int pid;                /* 0 if free */
+        unsigned int mb;
+        unsigned long long start; /* See proc_start_time, 0 if unknown */
+};
+
+/* Longest pause between two attempts */
+#define BUDGET_MAX_NAP_MS 200L
+
+/* Start time of @pid in clock ticks since boot:
+   field 22 of /proc/<pid>/stat. Returns 0 if unknown. */
+static unsigned long long proc_start_time(int pid)
+{
+        char path[64], buf[1024], *chp;
+        long len;
+        int fd, field;
+
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+                return 0ULL;
+
+        len = safe_read(fd, buf, sizeof(buf) - 1UL);
+        close(fd);
+
+        if (len <= 0L)
+                return 0ULL;
+        buf[len] = '\0';
+
+        /* Field 2 is the command name in parentheses:
+           it may contain blanks and parentheses itself */
+        if ((chp = strrchr(buf, ')')) == NULL)
+                return 0ULL;
+
+        for (field = 3; field <= 22; field++) {
+                if ((chp = strchr(chp + 1, ' ')) == NULL)
+                        return 0ULL;
+        }
+
+        return strtoull(chp + 1, NULL, 10);
+}
+
+static int is_alive(const struct budget_slot *slot)
+{
+        unsigned long long start;
+
+        if (slot->pid <= 0 ||
+            (kill((pid_t) slot->pid, 0) < 0 && errno != EPERM))
+                return 0;
+
+        /* The pid may have been reused since */
+        start = proc_start_time(slot->pid);
+
+        return start == 0ULL || slot->start == 0ULL || start == slot->start;
+}
+
+/* Under the lock: grabs a slot for @mb if the live holders leave room.
+   A reservation exceeding the whole budget is granted
+   only to a process which is alone in the pool. */
+static long try_reserve(int fd,
+                        unsigned long limit_mb,
+                        unsigned long mb)
+{
+        struct budget_slot slot_mem;
+        unsigned long used = 0UL;
+        long i, free_slot = -1L;
+        long n;
+
+        for (i = 0L;
+             (n = pread(fd, &slot_mem, sizeof(slot_mem),
+                        (off_t) i * (off_t) sizeof(slot_mem))) ==
+                     (long) sizeof(slot_mem);
+             i++) {
+                if (is_alive(&slot_mem))
+                        used += slot_mem.mb;
+                else if (free_slot < 0L)
+                        free_slot = i;
+        }
+
+        if (n < 0L)
+                return -1L;
+
+        if (used != 0UL && (used > limit_mb || mb > limit_mb - used))
+                return -1L;
+
+        if (free_slot < 0L)
+                free_slot = i;
+
+        slot_mem.pid = (int) getpid();
+        slot_mem.mb = mb > UINT_MAX ? UINT_MAX : (unsigned int) mb;
+        slot_mem.start = proc_start_time(slot_mem.pid);
+
+        if (pwrite(fd, &slot_mem, sizeof(slot_mem),
+                   (off_t) free_slot * (off_t) sizeof(slot_mem)) !=
+            (long) sizeof(slot_mem))
+                return -1L;
+
+        return free_slot;
+}
+
+int budget_reserve(budget_t *budget,
+                   const char *path,
+                   unsigned long limit_mb,
+                   unsigned long mb,
+                   long timeout_ms)
+{
+        struct timespec nap_mem;
+        long nap_ms = 1L, slot;
+
+        budget->fd = -1;
+        budget->slot = -1L;
+
+        /* No pool, no accounting: that's no reason to fail */
+        if ((budget->fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0600)) < 0)
+                return 0;
+
+        for (;;) {
+                if (flock(budget->fd, LOCK_EX) < 0) {
+                        close(budget->fd);
+                        budget->fd = -1;
+                        return 0;
+                }
+
+                slot = try_reserve(budget->fd, limit_mb, mb);
+                flock(budget->fd, LOCK_UN);
+
+                if (slot >= 0L) {
+                        budget->slot = slot;
+                        return 0;
+                }
+
+                if (timeout_ms <= 0L)
+                        break;
+
+                /* Holders release in no particular order:
+                   poll with a growing pause */
+                if (nap_ms > timeout_ms)
+                        nap_ms = timeout_ms;
+
+                nap_mem.tv_sec = nap_ms / 1000L;
+                nap_mem.tv_nsec = (nap_ms % 1000L) * 1000000L;
+                nanosleep(&nap_mem, NULL);
+
+                timeout_ms -= nap_ms;
+                if ((nap_ms *= 2L) > BUDGET_MAX_NAP_MS)
+                        nap_ms = BUDGET_MAX_NAP_MS;
+        }
+
+        close(budget->fd);
+        budget->fd = -1;
+
+        return -1;
+}
+
+void budget_release(budget_t *budget)
+{
+        struct budget_slot slot_mem;
+        const off_t off = (off_t) budget->slot * (off_t) sizeof(slot_mem);
+
+        if (budget->fd < 0)
+                return;
+
+        /* The slot is ours unless the pool file was replaced */
+        if (budget->slot >= 0L &&
+            flock(budget->fd, LOCK_EX) == 0) {
+                if (pread(budget->fd, &slot_mem, sizeof(slot_mem), off) ==
+                    (long) sizeof(slot_mem) &&
+                    slot_mem.pid == (int) getpid()) {
+                        memset(&slot_mem, 0, sizeof(slot_mem));
+                        pwrite(budget->fd, &slot_mem, sizeof(slot_mem), off);
+                }
+
+                flock(budget->fd, LOCK_UN);
+        }
+
+        close(budget->fd);
+        budget->fd = -1;
+        budget->slot = -1L;
+}
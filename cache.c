@@ -0,0 +1,488 @@
+#include "common.h"
+
+/** Local content-addressed cache.
+    Each entry is a file named after 64-bit key of its contents.
+    Entries are immutable: they are published read-only with rename(),
+    so many wrappers may use the same directory at once.
+**/
+
+char *cache_entry_path(const char *dir,
+                       unsigned long long key,
+                       const char *suffix)
+{
+        static const char hex_digits[16] = "0123456789abcdef";
+        unsigned long dirlen, sfxlen;
+        char *path, *last;
+        int shift;
+
+        dirlen = strlen(dir);
+        sfxlen = strlen(suffix);
+
+        last = path = xmalloc(dirlen + 1UL + 16UL + sfxlen + 1UL);
+        memcpy(last, dir, dirlen), last += dirlen;
+        *last = '/',               last += 1;
+        for (shift = 60; shift >= 0; shift -= 4)
+                *last++ = hex_digits[(key >> shift) & 0xfULL];
+        memcpy(last, suffix, sfxlen + 1UL); /* Includes '\0' */
+
+        return path;
+}
+
+/* Creates a file named "<path>.XXXXXX" with a unique suffix.
+   Its freshly allocated name is returned via @tmp_p. */
+static int open_tmp(const char *path,
+                    char **tmp_p)
+{
+        char *tmp;
+        mode_t mask;
+        int fd;
+
+        tmp = xmalloc(strlen(path) + sizeof(".XXXXXX"));
+        strcpy(tmp, path);
+        strcat(tmp, ".XXXXXX");
+
+        if ((fd = mkostemp(tmp, O_CLOEXEC)) < 0) {
+                xfree(tmp);
+                return -1;
+        }
+
+        /* Same mode as open() would give */
+        mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0644 & ~mask);
+
+        *tmp_p = tmp;
+        return fd;
+}
+
+/* Publishes @hdr followed by @data as cache entry @key.
+   Returns path of the entry or NULL on failure. */
+static char *publish(const char *dir,
+                     unsigned long long key,
+                     const char *suffix,
+                     const char *hdr,
+                     unsigned long hsize,
+                     const char *data,
+                     unsigned long size)
+{
+        char *path, *tmp;
+        int fd;
+
+        if (size == 0UL || size > (unsigned long) LONG_MAX ||
+            hsize > (unsigned long) LONG_MAX)
+                return NULL;
+
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+                return NULL;
+
+        path = cache_entry_path(dir, key, suffix);
+
+        if ((fd = open_tmp(path, &tmp)) < 0) {
+                xfree(path);
+                return NULL;
+        }
+
+        if ((hsize > 0UL &&
+             safe_write(fd, hdr, hsize) != (long) hsize) ||
+            safe_write(fd, data, size) != (long) size) {
+                close(fd);
+                unlink(tmp);
+                goto fail;
+        }
+
+        /* Entries may be hard-linked into build trees:
+           writing to such a file must not alter the cache */
+        if (fchmod(fd, 0444) < 0 ||
+            close(fd) < 0 ||
+            rename(tmp, path) < 0) {
+                unlink(tmp);
+                goto fail;
+        }
+
+        xfree(tmp);
+        return path;
+
+fail:
+        xfree(tmp);
+        xfree(path);
+        return NULL;
+}
+
+/* Publishes @data as cache entry @key.
+   Returns path of the entry or NULL on failure. */
+char *cache_store(const char *dir,
+                  unsigned long long key,
+                  const char *suffix,
+                  const char *data,
+                  unsigned long size)
+{
+        return publish(dir, key, suffix, NULL, 0UL, data, size);
+}
+
+/* Returns path of the entry if it exists, NULL otherwise */
+char *cache_lookup(const char *dir,
+                   unsigned long long key,
+                   const char *suffix)
+{
+        char *path;
+
+        path = cache_entry_path(dir, key, suffix);
+
+        if (access(path, R_OK) == 0)
+                return path;
+
+        xfree(path);
+        return NULL;
+}
+
+/* Copies @src to the freshly created file @dfd.
+   Reflink is tried first: it shares data blocks on CoW filesystems. */
+static int copy_file(const char *src,
+                     int dfd)
+{
+        void *base;
+        unsigned long size;
+        int sfd, rc = -1;
+
+        if ((sfd = open(src, O_RDONLY)) < 0)
+                return -1;
+
+        if (ioctl(dfd, FICLONE, sfd) == 0) {
+                rc = 0;
+        } else if (create_file_mapping(src, &base, &size) == 0) {
+                if (safe_write(dfd, base, size) == (long) size)
+                        rc = 0;
+                delete_file_mapping(base, size);
+        }
+
+        close(sfd);
+        return rc;
+}
+
+/* Hard-links @path to a fresh "<dest>.XXXXXX".
+   Returns the freshly allocated name or NULL on failure. */
+static char *link_tmp(const char *path,
+                      const char *dest)
+{
+        static const char letters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                      "abcdefghijklmnopqrstuvwxyz"
+                                      "0123456789";
+        static unsigned long long counter;
+        struct timespec ts_mem;
+        unsigned long long seed;
+        unsigned long len;
+        char *tmp, *suffix;
+        int tries, i;
+
+        len = strlen(dest);
+        tmp = xmalloc(len + sizeof(".XXXXXX"));
+        memcpy(tmp, dest, len);
+        suffix = tmp + len;
+        *suffix++ = '.';
+        suffix[6] = '\0';
+
+        for (tries = 0; tries < 100; tries++) {
+                memset(&ts_mem, 0, sizeof(ts_mem));
+                clock_gettime(CLOCK_REALTIME, &ts_mem);
+
+                seed = hash_buf(&ts_mem, sizeof(ts_mem), ++counter);
+                seed = hash_buf(&seed, sizeof(seed),
+                                (unsigned long long) getpid());
+
+                for (i = 0; i < 6; i++, seed /= sizeof(letters) - 1UL)
+                        suffix[i] = letters[seed % (sizeof(letters) - 1UL)];
+
+                if (link(path, tmp) == 0)
+                        return tmp;
+
+                if (errno != EEXIST)
+                        break;
+        }
+
+        xfree(tmp);
+        return NULL;
+}
+
+/* Puts a copy of cache entry @path at @dest replacing
+   whatever is there atomically.
+   Hard link is used if @may_link is set and @dest is on the same
+   filesystem. Otherwise the entry is reflinked or copied. */
+int cache_install(const char *path,
+                  const char *dest,
+                  int may_link)
+{
+        struct stat tst_mem, dst_mem;
+        char *tmp;
+        int fd, rc;
+
+        if (may_link && (tmp = link_tmp(path, dest)) != NULL) {
+                memset(&tst_mem, 0, sizeof(tst_mem));
+                memset(&dst_mem, 0, sizeof(dst_mem));
+
+                /* rename() would do nothing if @dest is a link
+                   to the same entry already */
+                if (stat(tmp, &tst_mem) == 0 &&
+                    stat(dest, &dst_mem) == 0 &&
+                    tst_mem.st_dev == dst_mem.st_dev &&
+                    tst_mem.st_ino == dst_mem.st_ino) {
+                        unlink(tmp);
+                        xfree(tmp);
+                        return 0;
+                }
+
+                goto publish;
+        }
+
+        if ((fd = open_tmp(dest, &tmp)) < 0)
+                return -1;
+
+        rc = copy_file(path, fd);
+        if (close(fd) < 0)
+                rc = -1;
+
+        if (rc < 0) {
+                unlink(tmp);
+                xfree(tmp);
+                return -1;
+        }
+
+publish:
+        if ((rc = rename(tmp, dest)) < 0)
+                unlink(tmp);
+
+        xfree(tmp);
+        return rc;
+}
+
+/** Direct mode of the preprocessor.
+    The entry holds preprocessed text preceded by a manifest:
+    the list of files it was made from with their sizes and mtimes.
+    The text is reused as long as none of the files has changed.
+    Files which were looked for and not found aren't listed.
+        "GCC-WRAPPER-CPP 1\n"
+        <number of files> "\n"
+        { <size> " " <mtime sec> " " <mtime nsec> " " <path length> " " <path> "\n" }
+        <preprocessed text>
+**/
+
+static const char cpp_magic[] = "GCC-WRAPPER-CPP 1\n";
+
+/* Pseudo files like <built-in> or <command-line> are skipped */
+static int is_real_file(const char *filename)
+{
+        return *filename != '\0' && *filename != '<';
+}
+
+/* Collects distinct filenames of all linemarkers to @names */
+static void collect_files(const char *const data,
+                          unsigned long size,
+                          name_table_t *names)
+{
+        const char *chp = data, *const limit = data + size, *nxt;
+        unsigned long nr_nl = 0UL;
+
+        for (; chp < limit; chp = nxt) {
+                linemarker_t lm_mem;
+
+                /* Only lines starting with '#' may be linemarkers */
+                if ((chp = scan_plain(chp, limit, &nr_nl)) >= limit)
+                        break;
+
+                /* The marker's file is added to @names if it's new */
+                memset(&lm_mem, 0, sizeof(lm_mem));
+                if (chp == data || chp[-1] == '\n')
+                        (void) read_linemarker_id(chp, limit, names, &lm_mem, &nxt);
+
+                nxt = memchr(chp, '\n', (unsigned long) (limit - chp));
+                nxt = (nxt == NULL) ? limit : nxt + 1;
+        }
+}
+
+/* Text expanding these macros differs from one run to the next */
+static int uses_time_macros(const char *path)
+{
+        static const char *const macros[] = {
+                "__TIME__",
+                "__DATE__",
+                "__TIMESTAMP__",
+                NULL,
+        };
+        const char *const *macro;
+        void *base;
+        unsigned long size;
+        int found = 0;
+
+        /* Empty files expand nothing */
+        if (create_file_mapping(path, &base, &size) < 0)
+                return access(path, R_OK) < 0;
+
+        for (macro = macros; !found && *macro != NULL; macro++)
+                found = memmem(base, size, *macro, strlen(*macro)) != NULL;
+
+        delete_file_mapping(base, size);
+
+        return found;
+}
+
+/* Files modified at or after @since are unreliable:
+   they may have changed while the preprocessor was reading them.
+   Neither are files using __TIME__, __DATE__ or __TIMESTAMP__. */
+int cpp_cache_store(const char *dir,
+                    unsigned long long key,
+                    const char *data,
+                    unsigned long size,
+                    time_t since)
+{
+        name_table_t names_mem, *const names = &names_mem;
+        dbuf_t hdr_mem, *const hdr = &hdr_mem;
+        const char *name;
+        char *path = NULL;
+        unsigned long id, count = 0UL;
+
+        name_table_init(names);
+        dbuf_init(hdr);
+
+        collect_files(data, size, names);
+
+        for (id = 0UL; id < name_table_size(names); id++) {
+                if (is_real_file(name_table_get(names, id)))
+                        count++;
+        }
+
+        if (dbuf_printf(hdr, "%s%lu\n", cpp_magic, count) < 0)
+                goto out;
+
+        for (id = 0UL; id < name_table_size(names); id++) {
+                struct stat st_mem;
+
+                if (!is_real_file(name = name_table_get(names, id)))
+                        continue;
+
+                memset(&st_mem, 0, sizeof(st_mem));
+                if (stat(name, &st_mem) < 0 ||
+                    !S_ISREG(st_mem.st_mode) ||
+                    st_mem.st_mtime >= since ||
+                    uses_time_macros(name))
+                        goto out;
+
+                if (dbuf_printf(hdr, "%lu %ld %ld %lu %s\n",
+                                (unsigned long) st_mem.st_size,
+                                (long) st_mem.st_mtim.tv_sec,
+                                (long) st_mem.st_mtim.tv_nsec,
+                                (unsigned long) strlen(name),
+                                name) < 0)
+                        goto out;
+        }
+
+        path = publish(dir, key, ".cpp",
+                       hdr->base, (unsigned long) (hdr->pos - hdr->base),
+                       data, size);
+
+out:
+        name_table_free(names);
+        dbuf_free(hdr);
+
+        if (path == NULL)
+                return -1;
+
+        xfree(path);
+        return 0;
+}
+
+/* Parses unsigned number followed by @sep */
+static int parse_field(const char **chpp,
+                       const char *const limit,
+                       char sep,
+                       unsigned long *valp)
+{
+        const char *chp = *chpp;
+        unsigned long val = 0UL, old_val;
+
+        if (chp >= limit || *chp < '0' || *chp > '9')
+                return -1;
+
+        for (; chp < limit && '0' <= *chp && *chp <= '9'; chp++) {
+                old_val = val;
+                val = val * 10UL + (unsigned long) (*chp - '0');
+                if (val < old_val)
+                        return -1;
+        }
+
+        if (chp >= limit || *chp != sep)
+                return -1;
+
+        *valp = val;
+        *chpp = chp + 1;
+        return 0;
+}
+
+/* On success provides a heap copy of the preprocessed text
+   (padded text) */
+int cpp_cache_lookup(const char *dir,
+                     unsigned long long key,
+                     char **obuf_p,
+                     unsigned long *osize_p)
+{
+        char *path, name_mem[PATH_MAX];
+        void *base;
+        const char *chp, *limit;
+        unsigned long size, count, i;
+        int rc = -1;
+
+        path = cache_entry_path(dir, key, ".cpp");
+
+        if (create_file_mapping(path, &base, &size) < 0) {
+                xfree(path);
+                return -1;
+        }
+
+        chp = base;
+        limit = chp + size;
+
+        if (size < sizeof(cpp_magic) - 1UL ||
+            memcmp(chp, cpp_magic, sizeof(cpp_magic) - 1UL) != 0)
+                goto out;
+        chp += sizeof(cpp_magic) - 1UL;
+
+        if (parse_field(&chp, limit, '\n', &count) < 0)
+                goto out;
+
+        for (i = 0UL; i < count; i++) {
+                unsigned long fsize, sec, nsec, namelen;
+                struct stat st_mem;
+
+                if (parse_field(&chp, limit, ' ', &fsize) < 0 ||
+                    parse_field(&chp, limit, ' ', &sec) < 0 ||
+                    parse_field(&chp, limit, ' ', &nsec) < 0 ||
+                    parse_field(&chp, limit, ' ', &namelen) < 0 ||
+                    namelen >= sizeof(name_mem) ||
+                    (unsigned long) (limit - chp) <= namelen ||
+                    chp[namelen] != '\n')
+                        goto out;
+
+                memcpy(name_mem, chp, namelen);
+                name_mem[namelen] = '\0';
+                chp += namelen + 1UL;
+
+                memset(&st_mem, 0, sizeof(st_mem));
+                if (stat(name_mem, &st_mem) < 0 ||
+                    (unsigned long) st_mem.st_size != fsize ||
+                    (unsigned long) st_mem.st_mtim.tv_sec != sec ||
+                    (unsigned long) st_mem.st_mtim.tv_nsec != nsec)
+                        goto out;
+        }
+
+        if (chp >= limit)
+                goto out;
+
+        *osize_p = (unsigned long) (limit - chp);
+        *obuf_p = text_alloc(*osize_p);
+        memcpy(*obuf_p, chp, *osize_p);
+        rc = 0;
+
+out:
+        delete_file_mapping(base, size);
+        xfree(path);
+
+        return rc;
+}
@@ -37,6 +37,11 @@
 	EDOM		33
 	ERANGE		34
  */
+/* memfd_create, accept4, vmsplice, POSIX_SPAWN_SETSID */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
@@ -45,14 +50,33 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/file.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
 #include <unistd.h>
 #include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 
 /* util.c */
@@ -62,9 +86,50 @@ void *xrealloc(void *ptr, unsigned long size);
 void xfree(void *ptr);
 char *xstrdup(const char *s);
 
+/* Padded text.
+   Parsers of preprocessed text don't check bounds at every byte:
+   @size bytes of text are followed by TEXT_PADDING readable bytes,
+   the first of which is NUL. Output of run_cmd, create_file_mapping
+   and buffers made by the routines below are padded text. */
+#define TEXT_PADDING 64UL
+
+char *text_alloc(unsigned long size);
+
+/* Objects living as long as the invocation (or a call) are
+   bump-allocated from chunks and released all at once, or
+   everything past a checkpoint. */
+struct arena_chunk;
+
+typedef struct {
+        struct arena_chunk *chunk; /* The newest one */
+        char *pos, *end;           /* Free room */
+        char *buf, *buf_end;       /* Initial buffer given by the user */
+} arena_t;
+
+typedef struct {
+        struct arena_chunk *chunk;
+        char *pos;
+} arena_mark_t;
+
+void arena_init(arena_t *arena,
+                char *buf,
+                unsigned long size);
+void *arena_alloc(arena_t *arena,
+                  unsigned long size);
+char *arena_strdup(arena_t *arena,
+                   const char *s);
+arena_mark_t arena_checkpoint(const arena_t *arena);
+void arena_reset(arena_t *arena,
+                 arena_mark_t mark);
+void arena_free(arena_t *arena);
+
 
 long safe_read(int fd, char *buf, unsigned long size);
 long safe_write(int fd, const char *buf, unsigned long size);
+int map_padded_text(int fd,
+                    unsigned long size,
+                    int prot,
+                    void **basep);
 int create_file_mapping(const char *path,
                         void **basep,
                         unsigned long *sizep);
@@ -76,6 +141,9 @@ char *locate_file(const char *name);
 typedef struct {
         char *base, *pos;
         unsigned long capacity;
+        unsigned long max_step; /* See dbuf_set_growth */
+        unsigned long spill_size; /* See dbuf_set_spill */
+        int fd;                 /* See dbuf_map_file, otherwise -1 */
         union {
                 char internal_buf[sizeof(void *) << 4UL];
                 unsigned long align_ul;
@@ -84,12 +152,65 @@ typedef struct {
 } dbuf_t;
 
 void dbuf_init(dbuf_t *dbuf);
+void dbuf_set_growth(dbuf_t *dbuf, unsigned long max_step);
+/* Once the content needs more than @spill_size bytes (0 is no limit),
+   it is moved to an unlinked temporary file mapped as by dbuf_map_file.
+   The file is the caller's then: dbuf_free leaves @dbuf->fd open. */
+void dbuf_set_spill(dbuf_t *dbuf, unsigned long spill_size);
 char *dbuf_alloc(dbuf_t *dbuf, unsigned long size);
+int dbuf_reserve(dbuf_t *dbuf, unsigned long size);
+int dbuf_append(dbuf_t *dbuf, const void *data, unsigned long size);
+void dbuf_shrink_to_fit(dbuf_t *dbuf);
+void dbuf_steal(dbuf_t *dst, dbuf_t *src);
+int dbuf_map_file(dbuf_t *dbuf, int fd, unsigned long capacity);
+int dbuf_unmap_file(dbuf_t *dbuf);
 int dbuf_putc(dbuf_t *dbuf, int c);
 int dbuf_printf(dbuf_t *dbuf, const char *fmt, ...);
+char *dbuf_detach(dbuf_t *dbuf, unsigned long *sizep);
+int dbuf_terminate(dbuf_t *dbuf);
+char *dbuf_detach_text(dbuf_t *dbuf, unsigned long *sizep);
 void dbuf_free(dbuf_t *dbuf);
 
 
+unsigned long long hash_buf(const void *data,
+                            unsigned long size,
+                            unsigned long long seed);
+
+/* Scanning kernels.
+   Variants for different instruction sets are chosen once at startup
+   (X_SCAN_KERNELS=scalar|sse2|avx2|avx512 forces one of them). */
+typedef struct {
+        const char *name;
+        /* The first '#' and number of '\n' before it */
+        const char *(*scan_plain)(const char *chp,
+                                  const char *const limit,
+                                  unsigned long *nr_nl_p);
+        /* The first byte adjust_style doesn't copy as is */
+        const char *(*scan_special)(const char *chp,
+                                    const char *const limit);
+        /* Position after the first '*' '/' pair or NULL */
+        const char *(*scan_comment_end)(const char *chp,
+                                        const char *const limit);
+        /* The first @quote, '\\' or '\n' */
+        const char *(*scan_quote)(const char *chp,
+                                  const char *const limit,
+                                  char quote);
+} scan_kernels_t;
+
+/* NULL-terminated, scalar first. Only variants the CPU supports. */
+const scan_kernels_t *const *scan_kernel_variants(void);
+const char *scan_plain(const char *chp,
+                       const char *const limit,
+                       unsigned long *nr_nl_p);
+const char *scan_special(const char *chp,
+                         const char *const limit);
+const char *scan_comment_end(const char *chp,
+                             const char *const limit);
+const char *scan_quote(const char *chp,
+                       const char *const limit,
+                       char quote);
+
+
 void print_error_msg(int fd,
                      int error_kind,
                      const char *fmt,
@@ -106,6 +227,8 @@ typedef struct {
                 IO_TO   = 1, /* Feed child with @ibuf content */
                 IO_FROM = 2, /* Extract child's output to @obuf_p */
                 IO_BOTH = IO_FROM | IO_TO, /* Full control of the child */
+                IO_TO_FD   = 4, /* Child's stdin is @ifd (instead of IO_TO) */
+                IO_FROM_FD = 8, /* Child's stdout is @ofd (instead of IO_FROM) */
         } flags;
         char **obuf_p; /* The pointer to allocated buffer of data
                           written by child to stdout */
@@ -113,31 +236,192 @@ typedef struct {
         char *ibuf; /* Buffer of data
                        the child process may read from its STDIN. */
         unsigned long isize; /* It's size */
+        int ifd; /* Typically a file: the child reads it
+                    from its current offset, shared with us */
+        int ofd;
+        unsigned long spill_size; /* IO_FROM: output past this size goes
+                                     to an unlinked temporary file instead
+                                     of the heap (0: never, see dbuf_set_spill) */
+        int *ofd_p; /* Required with @spill_size: set to that file or -1.
+                       For a file *@obuf_p is NULL, *@osize_p is its size. */
+        enum {
+                SPAWN_DEFAULT = 0, /* SPAWN_POSIX unless X_SPAWN_FORK is set */
+                SPAWN_FORK    = 1, /* fork() + execve() */
+                SPAWN_POSIX   = 2, /* posix_spawn(): no page table copying */
+        } spawn;
 } child_ctx_t;
 
 int run_cmd(const child_ctx_t *ctx);
 
+/* Lower level interface used when several children
+   must be driven at the same time. */
+typedef struct {
+        pid_t pid;
+        int in_fd; /* Our end of child's stdin (IO_TO) or -1 */
+        int out_fd; /* Our end of child's stdout (IO_FROM) or -1 */
+} child_t;
+
+/* Only @argv, @flags and @spawn of @ctx are used. */
+int start_cmd(const child_ctx_t *ctx, child_t *child);
+/* Closes remaining pipes and reaps the child.
+   Returns 0 only if the child has exited with zero code. */
+int wait_cmd(child_t *child);
+void kill_cmd(child_t *child, int sig);
+/* Collects output of @src to @obuf (like IO_FROM)
+   and feeds @dst (may be NULL) with the collected bytes
+   starting at offset @fed_p. Waits until at least one of the pipes
+   is ready. @dst's stdin is never closed here unless
+   the consumer has gone away. */
+int pump_cmd(child_t *src,
+             child_t *dst,
+             dbuf_t *obuf,
+             unsigned long *fed_p);
+
+typedef struct {
+        child_t *child;
+        char *ibuf;             /* Fed to child->in_fd, advanced as written */
+        unsigned long isize;
+        dbuf_t *obuf;           /* Collects child->out_fd (if open) */
+        int status;             /* Set by drive_cmds: see wait_cmd */
+} child_io_t;
+
+/* Feeds and drains all the children of @ios (see start_cmd)
+   until their pipes are closed, then reaps them.
+   With X_IO_URING set and supported by the kernel, I/O on all
+   the pipes and exits of the children (via pidfd) are kept in flight
+   in an io_uring; otherwise poll() is used.
+   Returns -1 on I/O failure, all the children are killed then. */
+int drive_cmds(child_io_t *ios, unsigned long nr_ios);
+
+
+/* cache.c */
+
+char *cache_entry_path(const char *dir,
+                       unsigned long long key,
+                       const char *suffix);
+char *cache_store(const char *dir,
+                  unsigned long long key,
+                  const char *suffix,
+                  const char *data,
+                  unsigned long size);
+char *cache_lookup(const char *dir,
+                   unsigned long long key,
+                   const char *suffix);
+int cache_install(const char *path,
+                  const char *dest,
+                  int may_link);
+int cpp_cache_store(const char *dir,
+                    unsigned long long key,
+                    const char *data,
+                    unsigned long size,
+                    time_t since);
+int cpp_cache_lookup(const char *dir,
+                     unsigned long long key,
+                     char **obuf_p,
+                     unsigned long *osize_p);
+
+
+/* budget.c */
+
+typedef struct {
+        int fd;                 /* The pool file or -1 */
+        long slot;
+} budget_t;
+
+/* Takes @mb out of @limit_mb shared by all the processes using
+   the pool file @path, waiting up to @timeout_ms for others
+   to give theirs back. Returns -1 if the budget stays exhausted.
+   If the pool file can't be used, nothing is accounted and 0 is returned. */
+int budget_reserve(budget_t *budget,
+                   const char *path,
+                   unsigned long limit_mb,
+                   unsigned long mb,
+                   long timeout_ms);
+/* May be called for a failed reservation too */
+void budget_release(budget_t *budget);
+
+
+/* server.c */
+
+typedef struct {
+        int type;
+        const char *i_file;
+        const char *o_file;
+        const char *data;
+        unsigned long size;
+} server_job_t;
+
+/* Runs in a worker process with the client's working directory */
+typedef void (*server_handler_t)(const server_job_t *job);
+
+int server_submit(const char *sock_path,
+                  const server_job_t *job);
+int server_run(const char *sock_path,
+               server_handler_t handler);
+
 
 /* parse.c */
 
 typedef struct {
         unsigned long linenum;
-        char *filename;
+        char *filename;         /* Set by read_linemarker, must be freed
+                                   unless it's in the arena */
+        unsigned long file_id;  /* Set by read_linemarker_id */
         unsigned long info;
 } linemarker_t;
 
+struct name_entry;
+
+typedef struct {
+        struct name_entry *entries; /* Indexed by id */
+        unsigned long nr_entries;
+        unsigned long max_entries;
+        unsigned long *slots;       /* Hash table of (id + 1), 0 is free */
+        unsigned long nr_slots;
+        arena_t strings;            /* Filenames of the entries */
+} name_table_t;
+
+void name_table_init(name_table_t *names);
+void name_table_free(name_table_t *names);
+const char *name_table_get(const name_table_t *names,
+                           unsigned long id);
+unsigned long name_table_size(const name_table_t *names);
+
 int is_eol(const char *chp, const char *const limit);
 int is_ws(char ch);
+/* The filename is allocated in @arena (may be NULL) */
 int read_linemarker(const char *chp,
                     const char *const limit,
+                    arena_t *arena,
                     linemarker_t *lm,
                     const char **nxtp);
+/* Filenames are interned in @names: no allocation per linemarker */
+int read_linemarker_id(const char *chp,
+                       const char *const limit,
+                       name_table_t *names,
+                       linemarker_t *lm,
+                       const char **nxtp);
 dbuf_t *process_linemarkers(const char *const data,
                             unsigned long size);
+/* Same as above, but the output is appended to @buffer
+   (see dbuf_map_file). Return -1 on failure. */
+int process_linemarkers_into(dbuf_t *buffer,
+                             const char *const data,
+                             unsigned long size);
 /* adjust_style may alter @data!
    Generally, after usage, 
-   input buffer should be freed */
+   input buffer should be freed.
+   @data must be padded text, as well as input of the routines above */
 dbuf_t *adjust_style(char *const data,
                      unsigned long size);
+/* adjust_style(process_linemarkers(...)) in a single pass:
+   the intermediate text is never held in full. Unlike the two
+   separate calls, rogue linemarkers strip at most 64 preceding lines.
+   @data is left intact. */
+dbuf_t *process_and_adjust(const char *const data,
+                           unsigned long size);
+int process_and_adjust_into(dbuf_t *buffer,
+                            const char *const data,
+                            unsigned long size);
 
 #endif
@@ -1,29 +1,42 @@
 #include "common.h"
 
+/* Strings and the vector live in @arena until the wrapper exits.
+   Arguments of the wrapper itself are never copied. */
 typedef struct {
         char **argv;
         unsigned long argc;
+        unsigned long max_argc;
         char *i_file;
         char *o_file;
         int mode;
+        arena_t *arena;
 } comm_info_t;
 
+/* Room for the arguments push_cc_argv adds and NULL */
+#define ARGV_SPARE 8UL
+
 static int init_arg_data(int argc,
-                         const char *const argv[],
+                         char *const argv[],
+                         arena_t *arena,
                          comm_info_t *ci)
 {
         comm_info_t ci_mem;
-        const char *const *cur = argv + 1;
-        const char *const *const end = argv + argc;
+        char *const *cur = argv + 1;
+        char *const *const end = argv + argc;
+        arena_mark_t mark;
+
+        mark = arena_checkpoint(arena);
 
         memset(&ci_mem, 0, sizeof(ci_mem));
+        ci_mem.arena = arena;
+        ci_mem.max_argc = (unsigned long) argc + ARGV_SPARE;
+        ci_mem.argv = arena_alloc(arena, sizeof(char *) * ci_mem.max_argc);
         /* Placeholder for executable path. */
-        ci_mem.argv = xmalloc(sizeof(char *));
         ci_mem.argc = 1UL;
         ci_mem.argv[0] = NULL;
 
         for (; cur < end; cur++) {
-                const char *sval = *cur;
+                char *sval = *cur;
 
                 if (sval[0] == '-') {
                         if (sval[1] == 'o') {
@@ -38,7 +51,7 @@ static int init_arg_data(int argc,
                                         sval += 2;
                                 }
 
-                                ci_mem.o_file = xstrdup(sval);
+                                ci_mem.o_file = sval;
                                 continue;
                         }
 
@@ -53,9 +66,7 @@ static int init_arg_data(int argc,
                         }
                 }
 
-                ci_mem.argv = xrealloc(ci_mem.argv,
-                                       sizeof(char *) * ++ci_mem.argc);
-                ci_mem.argv[ci_mem.argc - 1UL] = xstrdup(sval);
+                ci_mem.argv[ci_mem.argc++] = sval;
         }
 
         if (ci_mem.mode == '\0' || ci_mem.mode == 'E' ||
@@ -65,10 +76,7 @@ static int init_arg_data(int argc,
         *ci = ci_mem;
         return 0;
  fail:
-        while (ci_mem.argc--)
-                xfree(ci_mem.argv[ci_mem.argc]);
-        xfree(ci_mem.argv);
-        xfree(ci_mem.o_file);
+        arena_reset(arena, mark);
 
         return -1;
 }
@@ -84,16 +92,15 @@ static int fini_arg_data(comm_info_t *ci,
         memset(&lm_mem, 0, sizeof(lm_mem));
         if (read_linemarker(buf,
                             buf + size,
+                            ci->arena,
                             &lm_mem,
                             &unused) < 0 ||
             lm_mem.filename == NULL)
                 return -1;
         (void) unused;
 
-        if (strcmp(lm_mem.filename, "<stdin>") == 0) {
-                xfree(lm_mem.filename);
-                lm_mem.filename = xstrdup("-");
-        }
+        if (strcmp(lm_mem.filename, "<stdin>") == 0)
+                lm_mem.filename = arena_strdup(ci->arena, "-");
 
         /* We need to ensure that input file exists within original ARGV
            verbatim */
@@ -110,19 +117,15 @@ static int fini_arg_data(comm_info_t *ci,
                 }
         }
 
-        if (slot == NULL) {
-                xfree(lm_mem.filename);
+        if (slot == NULL)
                 return -1;
-        }
 
-        xfree(*slot);
         for (cur = slot + 1;
              cur < ci->argv + ci->argc;
              cur++) {
                 *(cur - 1) = *cur;
         }
-        ci->argv = xrealloc(ci->argv,
-                            sizeof(char *) * --ci->argc);
+        ci->argc--;
         ci->i_file = lm_mem.filename;
 
         return 0;
@@ -189,6 +192,22 @@ static char *mangle_filename(const char *i_file,
         return res;
 }
 
+/* Makes room for @nr more elements of @ci->argv */
+static void reserve_argv(comm_info_t *ci,
+                         unsigned long nr)
+{
+        char **argv;
+
+        if (nr <= ci->max_argc - ci->argc)
+                return;
+
+        /* The old vector stays in the arena */
+        ci->max_argc = (ci->argc + nr) * 2UL;
+        argv = arena_alloc(ci->arena, sizeof(char *) * ci->max_argc);
+        memcpy(argv, ci->argv, sizeof(char *) * ci->argc);
+        ci->argv = argv;
+}
+
 static void extend_argv(comm_info_t *ci,
                         ...)
 {
@@ -197,9 +216,8 @@ static void extend_argv(comm_info_t *ci,
 
         va_start(ap, ci);
         while ((s = va_arg(ap, const char *)) != NULL) {
-                ci->argv = xrealloc(ci->argv,
-                                    sizeof(char *) * ++ci->argc);
-                ci->argv[ci->argc - 1UL] = xstrdup(s);
+                reserve_argv(ci, 1UL);
+                ci->argv[ci->argc++] = arena_strdup(ci->arena, s);
         }
         va_end(ap);
 }
@@ -211,49 +229,126 @@ enum source_type {
         SRC_T_CPLUS,
 };
 
-static void doit_i(const char *i_file,
-                   const char *o_file,
-                   enum source_type type,
-                   const char *const data,
-                   unsigned long size)
+/* Produces contents of the file written by doit_i in @buffer.
+   Returns -1 if there is nothing to write. */
+static int format_i(dbuf_t *buffer,
+                    enum source_type type,
+                    const char *const data,
+                    unsigned long size)
 {
-        dbuf_t *buffer;
-        long buffer_sz;
-        char *mangled_nm;
-        int fd;
+        int rc;
 
         /* Something goes wrong on processing linemarkers?
-           Skip. */
-        if ((buffer = process_linemarkers(data, size)) == NULL)
-                return;
+           Skip. C files need some style adjustments as well:
+           both are done in a single pass. */
+        if (type == SRC_T_C)
+                rc = process_and_adjust_into(buffer, data, size);
+        else
+                rc = process_linemarkers_into(buffer, data, size);
 
         /* Nothing to write */
-        if ((buffer_sz = buffer->pos - buffer->base) <= 0L) {
-                dbuf_free(buffer); xfree(buffer);
-                return;
+        if (rc < 0 || buffer->pos == buffer->base)
+                return -1;
+
+        return 0;
+}
+
+/* With X_MMAP_I_FILES set, .pp files are formatted right into
+   a shared mapping of a file in the directory of @path, so the text
+   isn't held both on the heap and in the page cache. The file has
+   no name (or a temporary one) until it's complete: readers never
+   see it partially written. */
+static int open_i_tmp(const char *path,
+                      char **tmp_path_p)
+{
+        const char *slash;
+        char *dir, *tmp_path;
+        unsigned long dirlen;
+        mode_t mask;
+        int fd;
+
+        *tmp_path_p = NULL;
+
+        if ((slash = strrchr(path, '/')) == NULL) {
+                dir = xstrdup(".");
+        } else {
+                dirlen = (slash == path) ? 1UL : (unsigned long) (slash - path);
+                dir = xmalloc(dirlen + 1UL);
+                memcpy(dir, path, dirlen);
+                dir[dirlen] = '\0';
         }
 
-        /* C files need some style adjustments... */
-        if (type == SRC_T_C) {
-                dbuf_t *tmp;
+        fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+        xfree(dir);
 
-                tmp = adjust_style(buffer->base,
-                                   (unsigned long) buffer_sz);
-                dbuf_free(buffer); xfree(buffer);
-                buffer = tmp; tmp = NULL;
+        if (fd >= 0)
+                return fd;
 
-                /* Have we got nothing to write? */
-                if ((buffer_sz = buffer->pos - buffer->base) <= 0L) {
-                        dbuf_free(buffer); xfree(buffer);
-                        return;
-                }
+        /* File systems without O_TMPFILE */
+        tmp_path = xmalloc(strlen(path) + sizeof(".XXXXXX"));
+        strcpy(tmp_path, path);
+        strcat(tmp_path, ".XXXXXX");
+
+        if ((fd = mkostemp(tmp_path, O_CLOEXEC)) < 0) {
+                xfree(tmp_path);
+                return -1;
         }
 
+        /* Same mode as open() would give */
+        mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0644 & ~mask);
+
+        *tmp_path_p = tmp_path;
+        return fd;
+}
+
+/* Gives the complete file its name.
+   Like O_EXCL, existing files are never replaced. */
+static int link_i_tmp(int fd,
+                      const char *tmp_path,
+                      const char *path)
+{
+        char proc_path[64];
+
+        if (tmp_path != NULL)
+                return link(tmp_path, path);
+
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+
+        return linkat(AT_FDCWD, proc_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+}
+
+/* Result of the expensive part of doit_i */
+typedef struct {
+        dbuf_t *buffer; /* Formatted data or NULL */
+        char *entry; /* Cache entry holding the same data or NULL */
+        int fd; /* File @buffer is mapped from (see open_i_tmp) or -1 */
+        char *tmp_path; /* Name of that file unless it's unnamed */
+        budget_t budget; /* Held while @buffer exists (see reserve_i) */
+} i_data_t;
+
+static void write_i(const char *i_file,
+                    const char *o_file,
+                    i_data_t *id)
+{
+        dbuf_t *buffer = id->buffer;
+        long buffer_sz = buffer->pos - buffer->base;
+        char *mangled_nm;
+        int fd;
+
         mangled_nm = mangle_filename(i_file, o_file);
 
-        if ((fd = open(mangled_nm,
-                       O_CREAT | O_WRONLY | O_EXCL,
-                       0644)) >= 0) {
+        if (id->fd >= 0) {
+                if (dbuf_unmap_file(buffer) < 0 ||
+                    (link_i_tmp(id->fd, id->tmp_path, mangled_nm) < 0 &&
+                     errno != EEXIST))
+                        print_error_msg(-1, 0,
+                                        "GCC-WRAPPER: Failed to write %s",
+                                        mangled_nm);
+        } else if ((fd = open(mangled_nm,
+                              O_CREAT | O_WRONLY | O_EXCL,
+                              0644)) >= 0) {
                 if (safe_write(fd,
                                buffer->base,
                                (unsigned long) buffer_sz) != buffer_sz) {
@@ -266,84 +361,302 @@ static void doit_i(const char *i_file,
         }
 
         xfree(mangled_nm);
-        dbuf_free(buffer); xfree(buffer);
 }
 
-static int doit(comm_info_t *ci,
-                const char *cc,
-                const char *cpp)
+/* Proceed only if both input and output
+   paths designate real file */
+static int may_write_i(const char *i_file,
+                       const char *o_file)
 {
-        struct ext_entry {
-                char *ext;
-                unsigned long extlen;
-                char *optval;
-                enum source_type type;
-        };
-        static const struct ext_entry ext_mapping[] = {
-                { ".c",   sizeof(".c") - 1UL,   "cpp-output",     SRC_T_C },
-                { ".i",   sizeof(".i") - 1UL,   "cpp-output",     SRC_T_C },
-                { ".s",   sizeof(".s") - 1UL,   "assembler",      SRC_T_ASM },
-                { ".S",   sizeof(".S") - 1UL,   "assembler",      SRC_T_ASM },
-                { ".sx",  sizeof(".sx") - 1UL,  "assembler",      SRC_T_ASM },
-                { ".cc",  sizeof(".cc") - 1UL,  "c++-cpp-output", SRC_T_CPLUS },
-                { ".ii",  sizeof(".ii") - 1UL,  "c++-cpp-output", SRC_T_CPLUS },
-                { ".cp",  sizeof(".cp") - 1UL,  "c++-cpp-output", SRC_T_CPLUS },
-                { ".cxx", sizeof(".cxx") - 1UL, "c++-cpp-output", SRC_T_CPLUS },
-                { ".cpp", sizeof(".cpp") - 1UL, "c++-cpp-output", SRC_T_CPLUS },
-                { ".CPP", sizeof(".CPP") - 1UL, "c++-cpp-output", SRC_T_CPLUS },
-                { ".c++", sizeof(".c++") - 1UL, "c++-cpp-output", SRC_T_CPLUS },
-                { ".C",   sizeof(".C") - 1UL,   "c++-cpp-output", SRC_T_CPLUS },
-                { NULL,   0UL,                  NULL,             SRC_T_UNK },
-        };
-        const struct ext_entry *entry = ext_mapping;
-        char *obuf = NULL;
-        unsigned long osize = 0UL;
-        child_ctx_t ctx_mem;
-        int is_success;
-        char mode_buf[3] = { '-', '\0', '\0' };
-        unsigned long pathlen;
+        struct stat ist_mem, ost_mem;
 
-        ci->argv[0] = xstrdup(cpp);
-        extend_argv(ci, "-o-", NULL);
-        ci->argv = xrealloc(ci->argv,
-                            sizeof(char *) * (ci->argc + 1UL));
-        ci->argv[ci->argc] = NULL;
+        memset(&ist_mem, 0, sizeof(ist_mem));
+        memset(&ost_mem, 0, sizeof(ost_mem));
 
-        memset(&ctx_mem, 0, sizeof(ctx_mem));
-        ctx_mem.argv = ci->argv;
-        ctx_mem.flags = IO_FROM;
-        ctx_mem.obuf_p = &obuf;
-        ctx_mem.osize_p = &osize;
+        return (stat(i_file, &ist_mem) == 0 &&
+                S_ISREG(ist_mem.st_mode) &&
+                stat(o_file, &ost_mem) == 0 &&
+                S_ISREG(ost_mem.st_mode));
+}
+
+/* Must change whenever format_i produces different output
+   for the same input: cached .pp files are keyed with it. */
+static const char pp_cache_salt[] = "gcc-wrapper .pp v2";
+
+static void discard_i(i_data_t *id)
+{
+        if (id->buffer != NULL) {
+                dbuf_free(id->buffer); xfree(id->buffer);
+                id->buffer = NULL;
+        }
+
+        if (id->fd >= 0) {
+                close(id->fd); id->fd = -1;
+        }
+
+        if (id->tmp_path != NULL) {
+                unlink(id->tmp_path);
+                xfree(id->tmp_path); id->tmp_path = NULL;
+        }
+
+        xfree(id->entry); id->entry = NULL;
+
+        budget_release(&id->budget);
+}
+
+/* X_MEM_BUDGET_MB caps the memory all the wrappers of the user
+   may spend on formatting at once: the text and its formatted copy.
+   Returns -1 if the budget stays exhausted for X_MEM_BUDGET_WAIT
+   seconds (10 by default): the file is skipped then. */
+static int reserve_i(budget_t *budget,
+                     unsigned long size)
+{
+        const char *val, *dir;
+        char path[PATH_MAX];
+        unsigned long limit_mb, mb;
+        long timeout_ms = 10000L;
 
-        is_success = run_cmd(&ctx_mem) == 0 && obuf != NULL;
+        budget->fd = -1;
+        budget->slot = -1L;
 
-        xfree(ci->argv[0]); ci->argv[0] = NULL;
-        xfree(ci->argv[--ci->argc]);
-        ci->argv = xrealloc(ci->argv,
-                            sizeof(char *) * ci->argc);
+        if ((val = getenv("X_MEM_BUDGET_MB")) == NULL || *val == '\0' ||
+            (limit_mb = strtoul(val, NULL, 10)) == 0UL)
+                return 0;
 
-        if (!is_success)
+        if ((val = getenv("X_MEM_BUDGET_WAIT")) != NULL && *val != '\0')
+                timeout_ms = strtol(val, NULL, 10) * 1000L;
+
+        if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0')
+                dir = "/tmp";
+
+        snprintf(path, sizeof(path), "%s/gcc-wrapper-budget2.%u",
+                 dir, (unsigned int) getuid());
+
+        mb = (size >> 19UL) + 1UL;
+
+        return budget_reserve(budget, path, limit_mb, mb, timeout_ms);
+}
+
+/* Output is about as long as the input: that's the initial size
+   of the file. Failures leave @id->buffer on the heap. */
+static void map_i(i_data_t *id,
+                  const char *i_file,
+                  const char *o_file,
+                  unsigned long size)
+{
+        char *mangled_nm;
+
+        mangled_nm = mangle_filename(i_file, o_file);
+
+        if ((id->fd = open_i_tmp(mangled_nm, &id->tmp_path)) >= 0 &&
+            dbuf_map_file(id->buffer, id->fd, size) < 0) {
+                close(id->fd); id->fd = -1;
+
+                if (id->tmp_path != NULL) {
+                        unlink(id->tmp_path);
+                        xfree(id->tmp_path); id->tmp_path = NULL;
+                }
+        }
+
+        xfree(mangled_nm);
+}
+
+/* Formats @data to @id->buffer.
+   On failure @id->buffer is NULL. */
+static int fill_i(i_data_t *id,
+                  const char *i_file,
+                  const char *o_file,
+                  enum source_type type,
+                  const char *const data,
+                  unsigned long size)
+{
+        if (reserve_i(&id->budget, size) < 0) {
+                print_error_msg(-1, 0,
+                                "GCC-WRAPPER: Memory budget is exhausted, "
+                                "skipping .pp file for %s",
+                                i_file);
                 return -1;
+        }
 
-        if (fini_arg_data(ci,
-                          obuf,
-                          osize) < 0) {
-                /* Couldn't happen for correct invocations of GCC */
-                xfree(obuf);
+        id->buffer = xmalloc(sizeof(*id->buffer));
+        dbuf_init(id->buffer);
+
+        if (getenv("X_MMAP_I_FILES") != NULL)
+                map_i(id, i_file, o_file, size);
+
+        if (format_i(id->buffer, type, data, size) < 0) {
+                discard_i(id);
                 return -1;
         }
 
-        pathlen = strlen(ci->i_file);
+        return 0;
+}
+
+static void prepare_i(i_data_t *id,
+                      const char *i_file,
+                      const char *o_file,
+                      enum source_type type,
+                      const char *const data,
+                      unsigned long size)
+{
+        const char *dir;
+        unsigned long long key = 0ULL;
+
+        id->buffer = NULL;
+        id->entry = NULL;
+        id->fd = -1;
+        id->tmp_path = NULL;
+        id->budget.fd = -1;
+        id->budget.slot = -1L;
+
+        if ((dir = getenv("X_PP_CACHE_DIR")) != NULL && *dir != '\0') {
+                key = hash_buf(pp_cache_salt,
+                               sizeof(pp_cache_salt) - 1UL,
+                               (unsigned long long) type);
+                key = hash_buf(data, size, key);
+
+                /* Unchanged TU? Nothing to do */
+                if ((id->entry = cache_lookup(dir, key, ".pp")) != NULL)
+                        return;
+        } else {
+                dir = NULL;
+        }
+
+        if (fill_i(id, i_file, o_file, type, data, size) < 0)
+                return;
+
+        if (dir != NULL)
+                id->entry = cache_store(dir,
+                                        key,
+                                        ".pp",
+                                        id->buffer->base,
+                                        (unsigned long) (id->buffer->pos -
+                                                         id->buffer->base));
+}
+
+/* Consumes @id. @data is formatted again if @id holds
+   only a cache entry which can't be installed. */
+static void commit_i(const char *i_file,
+                     const char *o_file,
+                     i_data_t *id,
+                     enum source_type type,
+                     const char *const data,
+                     unsigned long size)
+{
+        if (id->entry != NULL) {
+                char *mangled_nm;
+                int rc;
+
+                /* Cached files replace stale ones */
+                mangled_nm = mangle_filename(i_file, o_file);
+                rc = cache_install(id->entry, mangled_nm, 1);
+                xfree(mangled_nm);
+
+                if (rc == 0) {
+                        discard_i(id);
+                        return;
+                }
+
+                /* The entry may have been removed meanwhile */
+                if (id->buffer == NULL &&
+                    fill_i(id, i_file, o_file, type, data, size) < 0) {
+                        print_error_msg(-1, 0,
+                                        "GCC-WRAPPER: Failed to install "
+                                        "cached .pp file for %s",
+                                        i_file);
+                        discard_i(id);
+                        return;
+                }
+        }
+
+        if (id->buffer != NULL)
+                write_i(i_file, o_file, id);
+
+        discard_i(id);
+}
+
+static void doit_i(const char *i_file,
+                   const char *o_file,
+                   enum source_type type,
+                   const char *const data,
+                   unsigned long size)
+{
+        i_data_t id_mem;
+
+        prepare_i(&id_mem, i_file, o_file, type, data, size);
+        commit_i(i_file, o_file, &id_mem, type, data, size);
+}
+
+struct ext_entry {
+        char *ext;
+        unsigned long extlen;
+        char *optval;
+        enum source_type type;
+};
+
+static const struct ext_entry ext_mapping[] = {
+        { ".c",   sizeof(".c") - 1UL,   "cpp-output",     SRC_T_C },
+        { ".i",   sizeof(".i") - 1UL,   "cpp-output",     SRC_T_C },
+        { ".s",   sizeof(".s") - 1UL,   "assembler",      SRC_T_ASM },
+        { ".S",   sizeof(".S") - 1UL,   "assembler",      SRC_T_ASM },
+        { ".sx",  sizeof(".sx") - 1UL,  "assembler",      SRC_T_ASM },
+        { ".cc",  sizeof(".cc") - 1UL,  "c++-cpp-output", SRC_T_CPLUS },
+        { ".ii",  sizeof(".ii") - 1UL,  "c++-cpp-output", SRC_T_CPLUS },
+        { ".cp",  sizeof(".cp") - 1UL,  "c++-cpp-output", SRC_T_CPLUS },
+        { ".cxx", sizeof(".cxx") - 1UL, "c++-cpp-output", SRC_T_CPLUS },
+        { ".cpp", sizeof(".cpp") - 1UL, "c++-cpp-output", SRC_T_CPLUS },
+        { ".CPP", sizeof(".CPP") - 1UL, "c++-cpp-output", SRC_T_CPLUS },
+        { ".c++", sizeof(".c++") - 1UL, "c++-cpp-output", SRC_T_CPLUS },
+        { ".C",   sizeof(".C") - 1UL,   "c++-cpp-output", SRC_T_CPLUS },
+        { NULL,   0UL,                  NULL,             SRC_T_UNK },
+};
+
+/* Returns terminating entry for unknown suffixes */
+static const struct ext_entry *lookup_ext_entry(const char *path)
+{
+        const struct ext_entry *entry = ext_mapping;
+        unsigned long pathlen;
+
+        pathlen = strlen(path);
         while (entry->ext != NULL) {
                 if (entry->extlen <= pathlen &&
-                    strcmp(ci->i_file + (pathlen - entry->extlen),
+                    strcmp(path + (pathlen - entry->extlen),
                            entry->ext) == 0)
                         break;
                 entry++;
         }
 
+        return entry;
+}
+
+/* Turns @ci->argv to the preprocessor command line.
+   Must be followed by pop_cpp_argv. */
+static void push_cpp_argv(comm_info_t *ci,
+                          const char *cpp)
+{
+        ci->argv[0] = (char *) cpp;
+        extend_argv(ci, "-o-", NULL);
+        reserve_argv(ci, 1UL);
+        ci->argv[ci->argc] = NULL;
+}
+
+static void pop_cpp_argv(comm_info_t *ci)
+{
+        ci->argv[0] = NULL;
+        ci->argv[--ci->argc] = NULL;
+}
+
+/* Turns @ci->argv to the command line of the compiler
+   reading preprocessed code from stdin.
+   Must be followed by pop_cc_argv. */
+static void push_cc_argv(comm_info_t *ci,
+                         const char *cc,
+                         const struct ext_entry *entry)
+{
+        char mode_buf[3] = { '-', '\0', '\0' };
+
         mode_buf[1] = ci->mode;
-        ci->argv[0] = xstrdup(cc);
+        ci->argv[0] = (char *) cc;
         if (entry->ext != NULL) {
                 extend_argv(ci,
                             "-x",
@@ -357,111 +670,885 @@ static int doit(comm_info_t *ci,
                     ci->o_file,
                     "-",
                     NULL);
-        ci->argv = xrealloc(ci->argv,
-                            sizeof(char *) * (ci->argc + 1UL));
+        reserve_argv(ci, 1UL);
         ci->argv[ci->argc] = NULL;
+}
+
+static void pop_cc_argv(comm_info_t *ci)
+{
+        ci->argv[0] = NULL;
+}
+
+/* doit_i may run in a separate process
+   while the compiler is busy with the same data. */
+typedef struct {
+        pid_t pid;
+        int go_fd; /* Write end of the pipe telling the helper
+                      whether compilation has succeeded */
+} helper_t;
+
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+
+/* Detached helper must not compete with real compilation jobs */
+static void lower_priority(void)
+{
+        /* See ioprio_set(2) */
+        static const int ioprio_who_process = 1;
+        static const int ioprio_idle = 3 << 13;
+        struct sched_param sp_mem;
+        int fd;
+
+        memset(&sp_mem, 0, sizeof(sp_mem));
+        sched_setscheduler(0, SCHED_IDLE, &sp_mem);
+        syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_idle);
+
+        /* Make's output pipes must not wait for us */
+        if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+                dup2(fd, STDIN_FILENO);
+                dup2(fd, STDOUT_FILENO);
+                dup2(fd, STDERR_FILENO);
+                if (fd > STDERR_FILENO)
+                        close(fd);
+        }
+}
+
+/* The helper formats @data right away but writes the result
+   only if release_helper reports successful compilation.
+   On failure @helper->pid is -1 and the caller has to
+   call doit_i itself. */
+static void start_helper(helper_t *helper,
+                         const char *i_file,
+                         const char *o_file,
+                         enum source_type type,
+                         const char *const data,
+                         unsigned long size)
+{
+        int go_fds[2] = { -1, -1 };
+        pid_t helper_id;
+
+        helper->pid = -1;
+        helper->go_fd = -1;
+
+        if (pipe(go_fds) < 0)
+                return;
+
+        /* Children started later must not inherit the pipe */
+        fcntl(go_fds[1], F_SETFD, FD_CLOEXEC);
+
+        if ((helper_id = fork()) < 0) {
+                close(go_fds[0]);
+                close(go_fds[1]);
+                return;
+        }
+
+        if (helper_id == 0) {
+                i_data_t id_mem;
+                char go = '\0';
+
+                close(go_fds[1]);
+
+                if (getenv("X_DETACH_I_FILES") != NULL)
+                        lower_priority();
+
+                prepare_i(&id_mem, i_file, o_file, type, data, size);
+
+                if (safe_read(go_fds[0], &go, 1UL) == 1L && go == 'y' &&
+                    may_write_i(i_file, o_file))
+                        commit_i(i_file, o_file, &id_mem, type, data, size);
+                else
+                        discard_i(&id_mem);
+
+                _exit(0);
+        }
+
+        close(go_fds[0]);
+
+        helper->pid = helper_id;
+        helper->go_fd = go_fds[1];
+}
+
+/* Unless X_DETACH_I_FILES is set, waits for the helper to finish */
+static void release_helper(helper_t *helper,
+                           int is_success)
+{
+        int ignored;
+
+        if (helper->pid <= 0)
+                return;
+
+        if (is_success)
+                safe_write(helper->go_fd, "y", 1UL);
+        close(helper->go_fd);
+        helper->go_fd = -1;
+
+        if (getenv("X_DETACH_I_FILES") == NULL)
+                waitpid(helper->pid, &ignored, 0);
+
+        helper->pid = -1;
+}
+
+/* Must change whenever cached objects may become invalid
+   for reasons not covered by obj_cache_key. */
+static const char obj_cache_salt[] = "gcc-wrapper .o v1";
+
+/* Compiler options producing files other than @o_file
+   (or needing them) can't be served from the object cache */
+static int is_cacheable(const comm_info_t *ci)
+{
+        static const char *const prefixes[] = {
+                "-save-temps",
+                "-fdump-",
+                "-ftest-coverage",
+                "-fprofile-",
+                "--coverage",
+                "-gsplit-dwarf",
+                "-fstack-usage",
+                "-fcallgraph-info",
+                "-Wa,",
+                "-aux-info",
+                NULL,
+        };
+        const char *const *prefix;
+        unsigned long i;
+
+        if (strcmp(ci->o_file, "-") == 0)
+                return 0;
+
+        for (i = 1UL; i < ci->argc; i++) {
+                /* Response files: the key would cover only their names */
+                if (ci->argv[i][0] == '@')
+                        return 0;
+
+                for (prefix = prefixes; *prefix != NULL; prefix++) {
+                        if (strncmp(ci->argv[i],
+                                    *prefix,
+                                    strlen(*prefix)) == 0)
+                                return 0;
+                }
+        }
+
+        return 1;
+}
+
+/* The key covers everything the compiler's output depends on:
+   the compiler itself (and the variables telling it where cc1
+   and as are), its options, working directory (it gets
+   to debugging info) and the preprocessed text. */
+static int obj_cache_key(const comm_info_t *ci,
+                         const char *cc,
+                         const struct ext_entry *entry,
+                         const char *obuf,
+                         unsigned long osize,
+                         unsigned long long *keyp)
+{
+        static const char *const env_vars[] = {
+                "GCC_EXEC_PREFIX",
+                "COMPILER_PATH",
+                NULL,
+        };
+        const char *const *var;
+        struct stat st_mem;
+        char cwd_mem[PATH_MAX];
+        unsigned long long key;
+        unsigned long i;
+
+        memset(&st_mem, 0, sizeof(st_mem));
+        if (stat(cc, &st_mem) < 0 ||
+            getcwd(cwd_mem, sizeof(cwd_mem)) == NULL)
+                return -1;
+
+        key = hash_buf(obj_cache_salt, sizeof(obj_cache_salt) - 1UL, 0ULL);
+        key = hash_buf(cc, strlen(cc) + 1UL, key);
+        key = hash_buf(&st_mem.st_size, sizeof(st_mem.st_size), key);
+        key = hash_buf(&st_mem.st_mtime, sizeof(st_mem.st_mtime), key);
+        key = hash_buf(cwd_mem, strlen(cwd_mem) + 1UL, key);
+        for (var = env_vars; *var != NULL; var++) {
+                const char *val = getenv(*var);
+
+                /* Unset and empty variables differ */
+                if (val != NULL)
+                        key = hash_buf(val, strlen(val) + 1UL, key);
+                else
+                        key = hash_buf("", 0UL, key);
+        }
+        key = hash_buf(&ci->mode, sizeof(ci->mode), key);
+        if (entry->optval != NULL)
+                key = hash_buf(entry->optval, strlen(entry->optval) + 1UL, key);
+        for (i = 1UL; i < ci->argc; i++)
+                key = hash_buf(ci->argv[i], strlen(ci->argv[i]) + 1UL, key);
+        key = hash_buf(obuf, osize, key);
+
+        *keyp = key;
+        return 0;
+}
+
+/* Complete preprocessed text: padded text on the heap or
+   a mapping of a file: the memfd the preprocessor wrote (X_MEMFD)
+   or the temporary file its output has spilled to (X_SPILL_MB). */
+typedef struct {
+        char *base;
+        unsigned long size;
+        int fd; /* The file or -1. Longer than @size only after
+                   run_pipelined, which has fed the compiler already. */
+} pp_text_t;
+
+static void pp_text_free(pp_text_t *text)
+{
+        if (text->fd >= 0) {
+                delete_file_mapping(text->base, text->size);
+                close(text->fd); text->fd = -1;
+        } else {
+                xfree(text->base);
+        }
+
+        text->base = NULL;
+        text->size = 0UL;
+}
+
+/* Size of the preprocessor's output kept on the heap
+   before it spills to a file, 0 if unlimited */
+static unsigned long pp_spill_size(void)
+{
+        const char *val = getenv("X_SPILL_MB");
+        unsigned long mb;
+
+        if (val == NULL || *val == '\0' ||
+            (mb = strtoul(val, NULL, 10)) == 0UL ||
+            mb > (ULONG_MAX >> 21UL))
+                return 0UL;
+
+        return mb << 20UL;
+}
+
+/* The output of the preprocessor in @fd becomes @text */
+static int map_pp_text(int fd,
+                       pp_text_t *text)
+{
+        struct stat st_mem;
+        void *base;
+
+        memset(&st_mem, 0, sizeof(st_mem));
+        if (fstat(fd, &st_mem) < 0 || st_mem.st_size <= 0L ||
+            map_padded_text(fd, (unsigned long) st_mem.st_size,
+                            PROT_READ | PROT_WRITE, &base) < 0)
+                return -1;
+
+        text->base = base;
+        text->size = (unsigned long) st_mem.st_size;
+        text->fd = fd;
+
+        return 0;
+}
+
+/* Feeds the compiler with complete preprocessed text.
+   A memfd is the compiler's stdin as is: it reads the text
+   from the same pages at its own pace, no pipe in between.
+   If X_OBJ_CACHE_DIR is set, the result may be taken from the cache
+   without running the compiler at all. */
+static int compile(comm_info_t *ci,
+                   const char *cc,
+                   const struct ext_entry *entry,
+                   const pp_text_t *text)
+{
+        const char *dir;
+        unsigned long long key = 0ULL;
+        child_ctx_t ctx_mem;
+        int is_success;
+
+        if ((dir = getenv("X_OBJ_CACHE_DIR")) != NULL && *dir != '\0' &&
+            is_cacheable(ci) &&
+            obj_cache_key(ci, cc, entry, text->base, text->size, &key) == 0) {
+                char *path;
+
+                /* Objects are copied: make compares timestamps */
+                if ((path = cache_lookup(dir, key, ".o")) != NULL) {
+                        is_success = cache_install(path, ci->o_file, 0) == 0;
+                        xfree(path);
+
+                        if (is_success)
+                                return 0;
+                }
+        } else {
+                dir = NULL;
+        }
+
+        push_cc_argv(ci, cc, entry);
 
         memset(&ctx_mem, 0, sizeof(ctx_mem));
         ctx_mem.argv = ci->argv;
-        ctx_mem.flags = IO_TO;
-        ctx_mem.ibuf = obuf;
-        ctx_mem.isize = osize;
+        if (text->fd >= 0 && lseek(text->fd, 0L, SEEK_SET) == 0L) {
+                ctx_mem.flags = IO_TO_FD;
+                ctx_mem.ifd = text->fd;
+        } else {
+                ctx_mem.flags = IO_TO;
+                ctx_mem.ibuf = text->base;
+                ctx_mem.isize = text->size;
+        }
 
         is_success = run_cmd(&ctx_mem) == 0;
 
-        xfree(ci->argv[0]); ci->argv[0] = NULL;
-        ci->argv = xrealloc(ci->argv,
-                            sizeof(char *) * ci->argc);
-
-        if (is_success) {
-                struct stat ist_mem, ost_mem;
-
-                /* Proceed only if both input and output
-                   paths designate real file */
-                memset(&ist_mem, 0, sizeof(ist_mem));
-                memset(&ost_mem, 0, sizeof(ost_mem));
-                if (stat(ci->i_file, &ist_mem) == 0 &&
-                    S_ISREG(ist_mem.st_mode) &&
-                    stat(ci->o_file, &ost_mem) == 0 &&
-                    S_ISREG(ost_mem.st_mode)) {
-                        doit_i(ci->i_file,
-                               ci->o_file,
-                               entry->type,
-                               obuf,
-                               osize);
+        pop_cc_argv(ci);
+
+        if (is_success && dir != NULL) {
+                void *base;
+                unsigned long size;
+
+                if (create_file_mapping(ci->o_file, &base, &size) == 0) {
+                        xfree(cache_store(dir, key, ".o", base, size));
+                        delete_file_mapping(base, size);
                 }
         }
 
-        xfree(ci->i_file); ci->i_file = NULL;
-        xfree(obuf);
+        return is_success ? 0 : -1;
+}
+
+/* Must change whenever cached preprocessor's output may become invalid
+   for reasons not covered by cpp_cache_key. */
+static const char cpp_cache_salt[] = "gcc-wrapper .cpp v1";
+
+/* The preprocessor's output is reused if it was produced by the same
+   preprocessor with the same options and environment in the same
+   directory. Included files are checked by cpp_cache_lookup.
+   Input from stdin, response files (only their names would be hashed)
+   and options making dependency files (which the preprocessor
+   wouldn't write on a hit) are not supported.
+   Lookups which found nothing aren't recorded: a header added
+   to an earlier include directory, shadowing the one in the manifest,
+   or a changed __has_include result goes unnoticed until an included
+   file changes or the cache is cleaned. */
+static int cpp_cache_key(const comm_info_t *ci,
+                         const char *cpp,
+                         unsigned long long *keyp)
+{
+        static const char *const env_vars[] = {
+                "CPATH",
+                "C_INCLUDE_PATH",
+                "CPLUS_INCLUDE_PATH",
+                "OBJC_INCLUDE_PATH",
+                "GCC_EXEC_PREFIX",
+                "COMPILER_PATH",
+                "SOURCE_DATE_EPOCH",
+                "LANG",
+                "LC_ALL",
+                "LC_CTYPE",
+                NULL,
+        };
+        const char *const *var;
+        struct stat st_mem;
+        char cwd_mem[PATH_MAX];
+        unsigned long long key;
+        unsigned long i;
+
+        for (i = 1UL; i < ci->argc; i++) {
+                if (strcmp(ci->argv[i], "-") == 0 ||
+                    ci->argv[i][0] == '@' ||
+                    strncmp(ci->argv[i], "-M", 2UL) == 0 ||
+                    strncmp(ci->argv[i], "-Wp,", 4UL) == 0)
+                        return -1;
+        }
+
+        memset(&st_mem, 0, sizeof(st_mem));
+        if (stat(cpp, &st_mem) < 0 ||
+            getcwd(cwd_mem, sizeof(cwd_mem)) == NULL)
+                return -1;
+
+        key = hash_buf(cpp_cache_salt, sizeof(cpp_cache_salt) - 1UL, 0ULL);
+        key = hash_buf(cpp, strlen(cpp) + 1UL, key);
+        key = hash_buf(&st_mem.st_size, sizeof(st_mem.st_size), key);
+        key = hash_buf(&st_mem.st_mtime, sizeof(st_mem.st_mtime), key);
+        key = hash_buf(cwd_mem, strlen(cwd_mem) + 1UL, key);
+        for (var = env_vars; *var != NULL; var++) {
+                const char *val = getenv(*var);
+
+                /* Unset and empty variables differ */
+                if (val != NULL)
+                        key = hash_buf(val, strlen(val) + 1UL, key);
+                else
+                        key = hash_buf("", 0UL, key);
+        }
+        for (i = 1UL; i < ci->argc; i++)
+                key = hash_buf(ci->argv[i], strlen(ci->argv[i]) + 1UL, key);
+
+        *keyp = key;
+        return 0;
+}
+
+/* Runs the compiler on the complete preprocessed text @text
+   which is consumed on failure */
+static int finish_sequential(comm_info_t *ci,
+                             const char *cc,
+                             pp_text_t *text,
+                             const struct ext_entry **entry_p,
+                             helper_t *helper)
+{
+        const struct ext_entry *entry;
+
+        if (fini_arg_data(ci,
+                          text->base,
+                          text->size) < 0) {
+                /* Couldn't happen for correct invocations of GCC */
+                pp_text_free(text);
+                return -1;
+        }
+
+        entry = lookup_ext_entry(ci->i_file);
+
+        if (helper != NULL)
+                start_helper(helper,
+                             ci->i_file,
+                             ci->o_file,
+                             entry->type,
+                             text->base,
+                             text->size);
+
+        if (compile(ci, cc, entry, text) < 0) {
+                pp_text_free(text);
+                return -1;
+        }
+
+        *entry_p = entry;
+
+        return 0;
+}
+
+/* Runs the preprocessor to completion and only then the compiler.
+   With X_MEMFD set, the preprocessor writes to a memfd which
+   is mapped for doit_i and given to the compiler as its stdin:
+   the text is never copied to the heap nor pushed through pipes.
+   A spilled output (see pp_spill_size) is used the same way. */
+static int run_sequential(comm_info_t *ci,
+                          const char *cc,
+                          const char *cpp,
+                          pp_text_t *text,
+                          const struct ext_entry **entry_p,
+                          helper_t *helper)
+{
+        pp_text_t text_mem = { NULL, 0UL, -1 };
+        child_ctx_t ctx_mem;
+        int is_success, fd = -1;
+
+        if (getenv("X_MEMFD") != NULL)
+                fd = memfd_create("gcc-wrapper-cpp", MFD_CLOEXEC);
+
+        push_cpp_argv(ci, cpp);
+
+        memset(&ctx_mem, 0, sizeof(ctx_mem));
+        ctx_mem.argv = ci->argv;
+        if (fd >= 0) {
+                ctx_mem.flags = IO_FROM_FD;
+                ctx_mem.ofd = fd;
+        } else {
+                ctx_mem.flags = IO_FROM;
+                ctx_mem.obuf_p = &text_mem.base;
+                ctx_mem.osize_p = &text_mem.size;
+                /* Sets @fd if the output is too large for the heap */
+                ctx_mem.spill_size = pp_spill_size();
+                ctx_mem.ofd_p = &fd;
+        }
+
+        is_success = run_cmd(&ctx_mem) == 0;
+
+        pop_cpp_argv(ci);
+
+        if (fd >= 0 && !(is_success && map_pp_text(fd, &text_mem) == 0)) {
+                close(fd);
+                return -1;
+        }
+
+        if (!is_success || text_mem.base == NULL ||
+            finish_sequential(ci, cc, &text_mem, entry_p, helper) < 0)
+                return -1;
+
+        *text = text_mem;
+
+        return 0;
+}
+
+/* Feeds the compiler with preprocessor's output as soon as it appears.
+   A copy of the output is kept in @text for doit_i. */
+static int run_pipelined(comm_info_t *ci,
+                         const char *cc,
+                         const char *cpp,
+                         pp_text_t *text,
+                         const struct ext_entry **entry_p,
+                         helper_t *helper)
+{
+        const struct ext_entry *entry;
+        dbuf_t obuf_mem, *const obuf = &obuf_mem;
+        unsigned long fed = 0UL;
+        child_ctx_t ctx_mem;
+        child_t cpp_child, cc_child;
+        void *base;
+        int rc, fd;
+
+        cpp_child.pid = cc_child.pid = -1;
+        cpp_child.in_fd = cpp_child.out_fd = -1;
+        cc_child.in_fd = cc_child.out_fd = -1;
+        dbuf_init(obuf);
+        dbuf_set_spill(obuf, pp_spill_size());
+
+        push_cpp_argv(ci, cpp);
+
+        memset(&ctx_mem, 0, sizeof(ctx_mem));
+        ctx_mem.argv = ci->argv;
+        ctx_mem.flags = IO_FROM;
+
+        rc = start_cmd(&ctx_mem, &cpp_child);
+
+        /* The child has its own copy of ARGV after execve */
+        pop_cpp_argv(ci);
+
+        if (rc < 0)
+                return -1;
+
+        /* Command line of the compiler depends on the input file
+           which is known from the very first linemarker only. */
+        while (cpp_child.out_fd >= 0 &&
+               memchr(obuf->base, '\n',
+                      (unsigned long) (obuf->pos - obuf->base)) == NULL) {
+                if (pump_cmd(&cpp_child, NULL, obuf, NULL) < 0)
+                        goto fail;
+        }
+
+        if (obuf->pos == obuf->base ||
+            fini_arg_data(ci,
+                          obuf->base,
+                          (unsigned long) (obuf->pos - obuf->base)) < 0)
+                goto fail;
+
+        entry = lookup_ext_entry(ci->i_file);
+        push_cc_argv(ci, cc, entry);
+
+        memset(&ctx_mem, 0, sizeof(ctx_mem));
+        ctx_mem.argv = ci->argv;
+        ctx_mem.flags = IO_TO;
+
+        rc = start_cmd(&ctx_mem, &cc_child);
+
+        pop_cc_argv(ci);
+
+        if (rc < 0)
+                goto fail;
+
+        while (cpp_child.out_fd >= 0 ||
+               (cc_child.in_fd >= 0 &&
+                fed < (unsigned long) (obuf->pos - obuf->base))) {
+                if (pump_cmd(&cpp_child, &cc_child, obuf, &fed) < 0)
+                        goto fail;
+        }
+
+        /* The compiler must not see EOF on its stdin
+           unless the preprocessor has succeeded:
+           truncated input may still compile. */
+        if (wait_cmd(&cpp_child) < 0)
+                goto fail;
+
+        /* Everything is fed. The helper must not inherit the pipe. */
+        if (cc_child.in_fd >= 0) {
+                close(cc_child.in_fd);
+                cc_child.in_fd = -1;
+        }
+
+        /* The helper parses the text: it must be padded */
+        if (helper != NULL && dbuf_terminate(obuf) == 0)
+                start_helper(helper,
+                             ci->i_file,
+                             ci->o_file,
+                             entry->type,
+                             obuf->base,
+                             (unsigned long) (obuf->pos - obuf->base));
+
+        if (wait_cmd(&cc_child) < 0)
+                goto fail;
+
+        if (obuf->fd >= 0) {
+                /* Spilled. The file isn't cut to the output:
+                   the helper may still read its padding. */
+                fd = obuf->fd;
+                text->size = (unsigned long) (obuf->pos - obuf->base);
+                dbuf_free(obuf);
+
+                if (map_padded_text(fd, text->size,
+                                    PROT_READ | PROT_WRITE, &base) < 0) {
+                        close(fd);
+                        return -1;
+                }
+
+                text->base = base;
+                text->fd = fd;
+        } else {
+                text->base = dbuf_detach_text(obuf, &text->size);
+                text->fd = -1;
+        }
+
+        *entry_p = entry;
+
+        return 0;
+
+fail:
+        /* SIGTERM lets the compiler driver remove
+           its temporary and partial output files */
+        kill_cmd(&cc_child, SIGTERM);
+        kill_cmd(&cpp_child, SIGKILL);
+        if (obuf->fd >= 0)
+                close(obuf->fd);
+        dbuf_free(obuf);
+
+        return -1;
+}
+
+/* Hands the preprocessed text over to the server */
+static int submit_i(const char *server,
+                    const comm_info_t *ci,
+                    const struct ext_entry *entry,
+                    const pp_text_t *text)
+{
+        server_job_t job_mem;
+
+        memset(&job_mem, 0, sizeof(job_mem));
+        job_mem.type = entry->type;
+        job_mem.i_file = ci->i_file;
+        job_mem.o_file = ci->o_file;
+        job_mem.data = text->base;
+        job_mem.size = text->size;
+
+        return server_submit(server, &job_mem);
+}
+
+/* Runs in a worker of the server */
+static void serve_i(const server_job_t *job)
+{
+        if (may_write_i(job->i_file, job->o_file))
+                doit_i(job->i_file,
+                       job->o_file,
+                       (enum source_type) job->type,
+                       job->data,
+                       job->size);
+}
+
+static int doit(comm_info_t *ci,
+                const char *cc,
+                const char *cpp)
+{
+        const struct ext_entry *entry = NULL;
+        const char *cpp_dir, *server;
+        unsigned long long cpp_key = 0ULL;
+        pp_text_t text_mem = { NULL, 0UL, -1 };
+        helper_t helper_mem, *helper = &helper_mem;
+        int is_success;
+
+        helper_mem.pid = -1;
+        helper_mem.go_fd = -1;
+
+        /* The server does the helper's job after the compiler is done */
+        if ((server = getenv("X_SERVER")) != NULL && *server != '\0')
+                helper = NULL;
+        else
+                server = NULL;
+
+        if ((cpp_dir = getenv("X_CPP_CACHE_DIR")) == NULL || *cpp_dir == '\0' ||
+            cpp_cache_key(ci, cpp, &cpp_key) < 0)
+                cpp_dir = NULL;
+
+        if (cpp_dir != NULL &&
+            cpp_cache_lookup(cpp_dir, cpp_key,
+                             &text_mem.base, &text_mem.size) == 0) {
+                /* Consumes @text_mem on failure */
+                is_success = finish_sequential(ci, cc,
+                                               &text_mem, &entry,
+                                               helper) == 0;
+        } else {
+                /* Files changed from now on aren't trusted by the cache */
+                time_t since = time(NULL);
+
+                /* Object cache needs complete preprocessed text
+                   before the compiler may be started */
+                if (getenv("X_PIPELINE") != NULL &&
+                    getenv("X_OBJ_CACHE_DIR") == NULL)
+                        is_success = run_pipelined(ci, cc, cpp,
+                                                   &text_mem, &entry,
+                                                   helper) == 0;
+                else
+                        is_success = run_sequential(ci, cc, cpp,
+                                                    &text_mem, &entry,
+                                                    helper) == 0;
+
+                if (is_success && cpp_dir != NULL)
+                        cpp_cache_store(cpp_dir, cpp_key,
+                                        text_mem.base, text_mem.size, since);
+        }
+
+        if (helper_mem.pid > 0) {
+                release_helper(&helper_mem, is_success);
+        } else if (is_success &&
+                   (server == NULL ||
+                    submit_i(server, ci, entry, &text_mem) < 0) &&
+                   may_write_i(ci->i_file, ci->o_file)) {
+                doit_i(ci->i_file,
+                       ci->o_file,
+                       entry->type,
+                       text_mem.base,
+                       text_mem.size);
+        }
+
+        ci->i_file = NULL;
+        pp_text_free(&text_mem);
 
         return is_success ? 0 : -1;
 }
 
+/* Must change whenever the format of ".path" entries changes */
+static const char path_cache_salt[] = "gcc-wrapper .path v1";
+
+/* Relative (or empty, i.e. ".") segments make the result of
+   locate_file depend on the working directory */
+static int is_absolute_path_env(const char *path_env)
+{
+        const char *s;
+
+        for (s = path_env; ; s++) {
+                if (*s != '/')
+                        return 0;
+                if ((s = strchr(s, ':')) == NULL)
+                        return 1;
+        }
+}
+
+/* locate_file with results kept in X_PATH_CACHE_DIR.
+   The key is the value of PATH and @name: a hit costs one read
+   and one access() instead of a walk over PATH.
+   A hit is trusted while the file stays executable: a compiler
+   installed later into an earlier PATH directory isn't noticed.
+   PATH with relative segments is never cached. */
+static char *locate_cached(const char *name)
+{
+        const char *dir, *path_env;
+        char *path, *entry, buf[PATH_MAX];
+        unsigned long long key;
+        long len;
+        int fd;
+
+        if ((dir = getenv("X_PATH_CACHE_DIR")) == NULL || *dir == '\0' ||
+            (path_env = getenv("PATH")) == NULL ||
+            !is_absolute_path_env(path_env) ||
+            strchr(name, '/') != NULL)
+                return locate_file(name);
+
+        key = hash_buf(path_cache_salt, sizeof(path_cache_salt) - 1UL, 0ULL);
+        key = hash_buf(path_env, strlen(path_env) + 1UL, key);
+        key = hash_buf(name, strlen(name) + 1UL, key);
+
+        entry = cache_entry_path(dir, key, ".path");
+
+        if ((fd = open(entry, O_RDONLY | O_CLOEXEC)) >= 0) {
+                len = safe_read(fd, buf, sizeof(buf) - 1UL);
+                close(fd);
+
+                if (len > 0L) {
+                        buf[len] = '\0';
+                        if (access(buf, X_OK) == 0) {
+                                xfree(entry);
+                                return xstrdup(buf);
+                        }
+                }
+        }
+
+        xfree(entry);
+
+        if ((path = locate_file(name)) != NULL)
+                xfree(cache_store(dir, key, ".path", path, strlen(path)));
+
+        return path;
+}
+
+/* Nothing is done besides running the compiler:
+   the wrapper is replaced with it, so its exit status is preserved. */
+static int passthrough(const char *cc,
+                       char *argv[])
+{
+        extern char **environ;
+        char *located_cc;
+
+        if ((located_cc = locate_cached(cc)) == NULL) {
+                print_error_msg(-1,
+                                0,
+                                "Failed to locate %s",
+                                cc);
+                return ESRCH;
+        }
+
+        argv[0] = located_cc;
+        execve(located_cc, argv, environ);
+
+        print_error_msg(errno,
+                        0,
+                        "In %s\nAt \"execve\"",
+                        __func__);
+        xfree(located_cc);
+
+        return ECHILD;
+}
+
 int main(int argc, char *argv[])
 {
         const char *cc, *cpp;
         char *located_cc, *located_cpp;
         comm_info_t ci_mem;
+        arena_t arena_mem;
+        /* Fits usual command lines */
+        char arena_buf[16384];
         int ret_code;
 
+        /* Started by server_submit */
+        if (argc == 3 && strcmp(argv[1], "--x-server") == 0)
+                return (server_run(argv[2], serve_i) == 0) ? 0 : EINVAL;
+
         if ((cc = getenv("REAL_CC")) == NULL)
                 cc = "gcc";
 
         if ((cpp = getenv("REAL_CPP")) == NULL)
                 cpp = "cpp";
 
-        if ((located_cc = locate_file(cc)) == NULL) {
+        arena_init(&arena_mem, arena_buf, sizeof(arena_buf));
+
+        /* Linking, -E, etc. */
+        if (getenv("X_NO_I_FILES") != NULL ||
+            init_arg_data(argc,
+                          argv,
+                          &arena_mem,
+                          &ci_mem) < 0)
+                return passthrough(cc, argv);
+
+        if ((located_cc = locate_cached(cc)) == NULL) {
                 print_error_msg(-1,
                                 0,
                                 "Failed to locate %s",
                                 cc);
-                return ESRCH;
+                ret_code = ESRCH;
+                goto out;
         }
 
-        if ((located_cpp = locate_file(cpp)) == NULL) {
+        if ((located_cpp = locate_cached(cpp)) == NULL) {
                 print_error_msg(-1,
                                 0,
                                 "Failed to locate %s",
                                 cpp);
                 xfree(located_cc);
-                return ESRCH;
-        }
-
-        if (getenv("X_NO_I_FILES") != NULL ||
-            init_arg_data(argc,
-                          (const char *const *) argv,
-                          &ci_mem) < 0) {
-                child_ctx_t ctx_mem;
-
-                memset(&ctx_mem, 0, sizeof(ctx_mem));
-                ctx_mem.argv = xmalloc((unsigned long) (argc + 1) *
-                                       sizeof(char *));
-                ctx_mem.argv[0] = located_cc;
-                memcpy(&ctx_mem.argv[1],
-                       &argv[1],
-                       (unsigned long) argc * sizeof(char *));
-                ctx_mem.flags = IO_NONE;
-
-                ret_code = run_cmd(&ctx_mem);
-
-                xfree(ctx_mem.argv);
-                xfree(located_cc);
-                xfree(located_cpp);
-
-                return (ret_code == 0) ? 0 : ECHILD;
+                ret_code = ESRCH;
+                goto out;
         }
 
         ret_code = doit(&ci_mem,
                         located_cc,
                         located_cpp);
+        ret_code = (ret_code == 0) ? 0 : EINVAL;
 
-        while (ci_mem.argc--)
-                xfree(ci_mem.argv[ci_mem.argc]);
-        xfree(ci_mem.argv);
-        xfree(ci_mem.o_file);
         xfree(located_cc);
         xfree(located_cpp);
+out:
+        arena_free(&arena_mem);
 
-        return (ret_code == 0) ? 0 : EINVAL;
+        return ret_code;
 }
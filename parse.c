@@ -16,6 +16,48 @@ int is_ws(char ch)
                 ch == '\r' || ch == '\t' || ch == '\v');
 }
 
+/* Input is padded text (see TEXT_PADDING): loops stop at a byte
+   they don't expect anyway, the sentinel included. Bounds are
+   checked only where NUL might be that sentinel. */
+static int is_end(const char *chp, const char *const limit)
+{
+        return *chp == '\0' && chp >= limit;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* Number of leading decimal digits in @word (8 if all of them are) */
+static unsigned int swar_nr_digits(unsigned long long word)
+{
+        static const unsigned long long h = 0x8080808080808080ULL;
+        static const unsigned long long l = 0x0101010101010101ULL;
+        unsigned long long low7, ge_0, le_9, non_digit;
+
+        /* High bit of a byte in @ge_0 (@le_9) is set iff the byte
+           is >= '0' (<= '9'). Setting high bits first keeps borrows
+           inside bytes. Non-ASCII bytes are never digits. */
+        low7 = word & ~h;
+        ge_0 = ((low7 | h) - l * (unsigned long long) '0') & h;
+        le_9 = ((l * (unsigned long long) '9' | h) - low7) & h;
+        non_digit = ~(ge_0 & le_9 & ~word) & h;
+
+        return (non_digit == 0ULL) ? 8U :
+               (unsigned int) __builtin_ctzll(non_digit) / 8U;
+}
+
+/* Value of the first @nr_digits (1..7) digits of @word */
+static unsigned long swar_digits_value(unsigned long long word,
+                                       unsigned int nr_digits)
+{
+        /* Missing leading digits become zero bytes, i.e. '0' & 0xf */
+        word <<= (8U - nr_digits) * 8U;
+        word = ((word & 0x0f0f0f0f0f0f0f0fULL) * 2561ULL) >> 8;
+        word = ((word & 0x00ff00ff00ff00ffULL) * 6553601ULL) >> 16;
+        word = ((word & 0x0000ffff0000ffffULL) * 42949672960001ULL) >> 32;
+
+        return (unsigned long) word;
+}
+#endif
+
 static int parse_ul(const char *chp,
                     const char *const limit,
                     unsigned long *valp,
@@ -23,9 +65,30 @@ static int parse_ul(const char *chp,
 {
         unsigned long old_val, val = 0UL;
 
-        for (;
-             !is_eol(chp, limit) && '0' <= *chp && *chp <= '9';
-             chp++) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        /* Numbers of linemarkers are short: up to 7 digits
+           are converted at once without branching per digit.
+           The padding makes 8 bytes readable anywhere. */
+        {
+                unsigned long long word;
+                unsigned int nr_digits;
+
+                memcpy(&word, chp, sizeof(word));
+                nr_digits = swar_nr_digits(word);
+
+                if (nr_digits > 0U && nr_digits < 8U) {
+                        chp += nr_digits;
+                        if (*chp != '\n' && !is_ws(*chp) && !is_end(chp, limit))
+                                return -1;
+
+                        *valp = swar_digits_value(word, nr_digits);
+                        *nxtp = chp;
+                        return 0;
+                }
+        }
+#endif
+
+        for (; '0' <= *chp && *chp <= '9'; chp++) {
                 old_val = val;
                 val = val * 10UL + (unsigned long) (*chp - '0');
                 /* Check if UL type can't hold this number */
@@ -42,7 +105,9 @@ static int parse_ul(const char *chp,
         return 0;
 }
 
-static int parse_quoted_string(const char *chp,
+/* The result is allocated in @arena or, if it's NULL, with xmalloc */
+static int parse_quoted_string(arena_t *arena,
+                               const char *chp,
                                const char *const limit,
                                char quote,
                                char       **valp,
@@ -50,24 +115,26 @@ static int parse_quoted_string(const char *chp,
 {
         const char *src;
         char *val, *dst;
-        unsigned long nalloc = 1UL;
 
         if (*chp != quote)
                 return -1;
 
-        src = ++chp;
-        for (; !is_eol(chp, limit) && *chp != quote; nalloc++, chp++) {
-                if (*chp == '\\') {
-                        chp++;
-                        if (is_eol(chp, limit))
-                                return -1; /* Invalid escaping with backslash */
-                }
+        /* Stops at the sentinel too */
+        for (src = ++chp;
+             *(chp = scan_quote(chp, limit, quote)) == '\\';
+             chp++) {
+                chp++;
+                if (is_eol(chp, limit))
+                        return -1; /* Invalid escaping with backslash */
         }
 
-        if (is_eol(chp, limit))
+        if (*chp != quote)
                 return -1; /* Couldn't find terminating quote character */
 
-        val = dst = xmalloc(nalloc);
+        /* Escapes only make it shorter */
+        val = dst = (arena != NULL) ?
+                    arena_alloc(arena, (unsigned long) (chp - src) + 1UL) :
+                    xmalloc((unsigned long) (chp - src) + 1UL);
 
         for (; src < chp;) {
                 if (*src == '\\')
@@ -81,12 +148,159 @@ static int parse_quoted_string(const char *chp,
         return 0;
 }
 
-int read_linemarker(const char *chp,
-                    const char *const limit,
-                    linemarker_t *lm,
-                    const char **nxtp)
+/** Interned filenames.
+    A translation unit has few distinct files but many linemarkers
+    naming them. Filenames are looked up by their quoted (escaped)
+    form right in the input, so a known one costs a hash and a memcmp.
+    Ids are dense: 0, 1, ... in order of appearance.
+**/
+
+struct name_entry {
+        unsigned long long hash;
+        char *raw; /* Between the quotes, escaped */
+        unsigned long raw_len;
+        char *name;
+};
+
+void name_table_init(name_table_t *names)
+{
+        memset(names, 0, sizeof(*names));
+        arena_init(&names->strings, NULL, 0UL);
+}
+
+void name_table_free(name_table_t *names)
+{
+        arena_free(&names->strings);
+        xfree(names->entries);
+        xfree(names->slots);
+
+        name_table_init(names);
+}
+
+/* Keeps load factor of @names->slots below 1/2 */
+static void grow_slots(name_table_t *names)
+{
+        unsigned long id, idx, mask;
+
+        xfree(names->slots);
+
+        names->nr_slots = (names->nr_slots == 0UL) ? 64UL : names->nr_slots * 2UL;
+        names->slots = xmalloc(names->nr_slots * sizeof(*names->slots));
+        memset(names->slots, 0, names->nr_slots * sizeof(*names->slots));
+
+        mask = names->nr_slots - 1UL;
+        for (id = 0UL; id < names->nr_entries; id++) {
+                for (idx = (unsigned long) names->entries[id].hash & mask;
+                     names->slots[idx] != 0UL;
+                     idx = (idx + 1UL) & mask) ;
+                names->slots[idx] = id + 1UL;
+        }
+}
+
+/* Same syntax as parse_quoted_string, but the result is an id in @names */
+static int intern_quoted_string(name_table_t *names,
+                                const char *chp,
+                                const char *const limit,
+                                char quote,
+                                unsigned long *idp,
+                                const char **nxtp)
+{
+        const char *src, *end;
+        struct name_entry *entry;
+        unsigned long long hash;
+        unsigned long raw_len, idx, mask;
+        char *dst;
+
+        if (*chp != quote)
+                return -1;
+
+        /* Stops at the sentinel too */
+        for (src = ++chp;
+             *(chp = scan_quote(chp, limit, quote)) == '\\';
+             chp++) {
+                chp++;
+                if (is_eol(chp, limit))
+                        return -1; /* Invalid escaping with backslash */
+        }
+
+        if (*chp != quote)
+                return -1; /* Couldn't find terminating quote character */
+
+        end = chp;
+        raw_len = (unsigned long) (end - src);
+        hash = hash_buf(src, raw_len, 0ULL);
+
+        if (names->nr_slots == 0UL)
+                grow_slots(names);
+
+        mask = names->nr_slots - 1UL;
+        for (idx = (unsigned long) hash & mask;
+             names->slots[idx] != 0UL;
+             idx = (idx + 1UL) & mask) {
+                entry = &names->entries[names->slots[idx] - 1UL];
+
+                if (entry->hash == hash &&
+                    entry->raw_len == raw_len &&
+                    memcmp(entry->raw, src, raw_len) == 0) {
+                        *idp = names->slots[idx] - 1UL;
+                        *nxtp = end + 1;
+                        return 0;
+                }
+        }
+
+        /* Miss: unescape and remember */
+        if (names->nr_entries == names->max_entries) {
+                names->max_entries = (names->max_entries == 0UL) ?
+                                     16UL : names->max_entries * 2UL;
+                names->entries = xrealloc(names->entries,
+                                          names->max_entries * sizeof(*names->entries));
+        }
+
+        entry = &names->entries[names->nr_entries];
+        entry->hash = hash;
+        entry->raw_len = raw_len;
+        entry->raw = arena_alloc(&names->strings, raw_len + 1UL);
+        memcpy(entry->raw, src, raw_len);
+        entry->raw[raw_len] = '\0';
+
+        entry->name = dst = arena_alloc(&names->strings, raw_len + 1UL);
+        for (; src < end;) {
+                if (*src == '\\')
+                        src++;
+                *dst++ = *src++;
+        }
+        *dst = '\0';
+
+        names->slots[idx] = ++names->nr_entries;
+        if (names->nr_entries * 2UL > names->nr_slots)
+                grow_slots(names);
+
+        *idp = names->nr_entries - 1UL;
+        *nxtp = end + 1;
+        return 0;
+}
+
+const char *name_table_get(const name_table_t *names,
+                           unsigned long id)
+{
+        return (id < names->nr_entries) ? names->entries[id].name : NULL;
+}
+
+unsigned long name_table_size(const name_table_t *names)
+{
+        return names->nr_entries;
+}
+
+/* With @names, the filename is interned instead of being allocated */
+static int parse_linemarker(const char *chp,
+                            const char *const limit,
+                            name_table_t *names,
+                            arena_t *arena,
+                            linemarker_t *lm,
+                            const char **nxtp)
 {
         linemarker_t lm_mem;
+        arena_mark_t mark;
         const char *nxt;
         enum {
                 S_X_HASH,     /* Expecting '#' character */
@@ -96,11 +310,11 @@ int read_linemarker(const char *chp,
                 S_FAIL,       /* Failed to parse a linemarker */
         } state = S_X_HASH;
         memset(&lm_mem, 0, sizeof(lm_mem));
+        if (arena != NULL)
+                mark = arena_checkpoint(arena);
 
         for (; state != S_FAIL && !is_eol(chp, limit); chp = nxt) {
-                for (nxt = chp;
-                     !is_eol(nxt, limit) && is_ws(*nxt);
-                     nxt++) ;
+                for (nxt = chp; is_ws(*nxt); nxt++) ;
                 if (nxt != chp)
                         continue;
 
@@ -125,7 +339,9 @@ int read_linemarker(const char *chp,
                 }
 
                 case S_X_FILENAME: {
-                        if (parse_quoted_string(chp, limit, '"', &lm_mem.filename, &nxt) == 0) {
+                        if (names != NULL ?
+                            intern_quoted_string(names, chp, limit, '"', &lm_mem.file_id, &nxt) == 0 :
+                            parse_quoted_string(arena, chp, limit, '"', &lm_mem.filename, &nxt) == 0) {
                                 state = S_X_FLAG;
                                 continue;
                         }
@@ -162,66 +378,225 @@ int read_linemarker(const char *chp,
                 *nxtp = nxt;
                 return 0;
         } else {
-                if (lm_mem.filename)
+                if (arena != NULL)
+                        arena_reset(arena, mark);
+                else if (lm_mem.filename)
                         xfree(lm_mem.filename);
                 return -1;
         }
 }
 
-dbuf_t *process_linemarkers(const char *const data,
-                            unsigned long size)
+int read_linemarker(const char *chp,
+                    const char *const limit,
+                    arena_t *arena,
+                    linemarker_t *lm,
+                    const char **nxtp)
 {
-        const char *chp = data, *const limit = data + size, *nxt;
-        dbuf_t *buffer;
-        /* We cannot change bytes below that index in @buffer */
-        unsigned long no_change_idx = 0UL;
-        char *filename = NULL;
-        unsigned long linenum = 1UL;
+        return parse_linemarker(chp, limit, NULL, arena, lm, nxtp);
+}
 
-        buffer = xmalloc(sizeof(*buffer)); dbuf_init(buffer);
+int read_linemarker_id(const char *chp,
+                       const char *const limit,
+                       name_table_t *names,
+                       linemarker_t *lm,
+                       const char **nxtp)
+{
+        return parse_linemarker(chp, limit, names, NULL, lm, nxtp);
+}
+
+/* Only lines starting with '#' (after optional whitespace) may be
+   linemarkers: everything up to the next '#' is copied at once and
+   only its newlines need to be counted (see scan_plain). */
+
+/* Returns start of the next line which may be a linemarker
+   (or @limit). All lines before it are plain. */
+static const char *skip_plain_lines(const char *const chp,
+                                    const char *const limit,
+                                    unsigned long *nr_nl_p)
+{
+        const char *hash, *start;
+
+        for (hash = chp; (hash = scan_plain(hash, limit, nr_nl_p)) < limit; hash++) {
+                for (start = hash; start > chp && is_ws(start[-1]); start--) ;
+
+                if (start == chp || start[-1] == '\n')
+                        return start;
+        }
+
+        return limit;
+}
+
+/* State of process_linemarkers between two calls of lm_stream_run */
+struct lm_stream {
+        const char *chp, *limit; /* Input yet to be processed */
+        name_table_t names;
+        unsigned long file_id;   /* ULONG_MAX if no file yet */
+        unsigned long linenum;
+        /* We cannot change bytes below that index in the output */
+        unsigned long no_change_idx;
+        /* Offsets of newlines in the output from @no_change_idx
+           to @indexed_idx which are not stripped yet. Built lazily:
+           without rogue linemarkers it stays empty. */
+        dbuf_t nl_index;
+        unsigned long indexed_idx;
+};
+
+static void lm_stream_init(struct lm_stream *lm,
+                           const char *const data,
+                           unsigned long size)
+{
+        memset(lm, 0, sizeof(*lm));
+        lm->chp = data;
+        lm->limit = data + size;
+        name_table_init(&lm->names);
+        lm->file_id = ULONG_MAX;
+        lm->linenum = 1UL;
+        dbuf_init(&lm->nl_index);
+}
+
+static void lm_stream_free(struct lm_stream *lm)
+{
+        name_table_free(&lm->names);
+        dbuf_free(&lm->nl_index);
+}
+
+/* Adds newlines of @buffer up to its end to @lm->nl_index */
+static int index_newlines(struct lm_stream *lm,
+                          dbuf_t *buffer)
+{
+        const char *p = buffer->base + lm->indexed_idx;
+        unsigned long off;
+
+        for (; (p = memchr(p, '\n', (unsigned long) (buffer->pos - p))) != NULL; p++) {
+                off = (unsigned long) (p - buffer->base);
+                if (dbuf_append(&lm->nl_index, &off, sizeof(off)) < 0)
+                        return -1;
+        }
+
+        lm->indexed_idx = (unsigned long) (buffer->pos - buffer->base);
+
+        return 0;
+}
+
+/* The first @drop bytes of the output are gone */
+static void lm_stream_shift(struct lm_stream *lm,
+                            unsigned long drop)
+{
+        unsigned long *first = (unsigned long *) lm->nl_index.base;
+        unsigned long *last = (unsigned long *) lm->nl_index.pos, *p, *q;
+
+        lm->no_change_idx = (lm->no_change_idx > drop) ? lm->no_change_idx - drop : 0UL;
+        lm->indexed_idx = (lm->indexed_idx > drop) ? lm->indexed_idx - drop : 0UL;
+
+        /* Newlines before @drop can't be stripped anymore */
+        for (p = first; p < last && *p < drop; p++) ;
+        for (q = first; p < last; p++, q++)
+                *q = *p - drop;
+        lm->nl_index.pos = (char *) q;
+}
+
+/* Appends processed lines to @buffer until at least @want bytes
+   are added or the input ends. Rogue linemarkers never strip newlines
+   below @floor_idx: the consumer may have read them already.
+   Returns -1 on failure. */
+static int lm_stream_run(struct lm_stream *lm,
+                         dbuf_t *buffer,
+                         unsigned long want,
+                         unsigned long floor_idx)
+{
+        const char *chp = lm->chp, *const limit = lm->limit, *nxt;
+        unsigned long start_idx, linenum = lm->linenum;
+        long linelen;
+        int rc = 0;
+
+        start_idx = (unsigned long) (buffer->pos - buffer->base);
 
         for (; chp < limit; chp = nxt) {
                 linemarker_t lm_mem;
-                long linelen;
+                unsigned long nr_lines = 0UL;
 
-                memset(&lm_mem, 0, sizeof(lm_mem));
-                if (read_linemarker(chp, limit, &lm_mem, &nxt) == 0) {
-                        if (filename == NULL ||
-                            strcmp(filename,
-                                   lm_mem.filename) != 0) {
-                                xfree(filename);
-                                filename = lm_mem.filename;
+                if ((unsigned long) (buffer->pos - buffer->base) - start_idx >= want)
+                        break;
 
-                                lm_mem.filename = NULL;
+                /* Plain lines are copied in bulk,
+                   at most about @want bytes of them at once */
+                if ((unsigned long) (limit - chp) > want) {
+                        const char *sublimit = chp + want, *nl;
+
+                        nxt = skip_plain_lines(chp, sublimit, &nr_lines);
+                        if (nxt == sublimit) {
+                                /* Stop at the last complete line */
+                                nl = memrchr(chp, '\n', (unsigned long) (sublimit - chp));
+                                if (nl != NULL) {
+                                        nxt = nl + 1;
+                                } else {
+                                        nr_lines = 0UL;
+                                        nxt = skip_plain_lines(chp, limit, &nr_lines);
+                                }
+                        }
+                } else {
+                        nxt = skip_plain_lines(chp, limit, &nr_lines);
+                }
+
+                if (nxt > chp) {
+                        /* Last line may lack its newline */
+                        if (nxt[-1] != '\n')
+                                nr_lines++;
+
+                        if (nr_lines > ULONG_MAX - linenum) {
+                                linelen = (long) (nxt - chp);
+                                goto linenum_overflow;
+                        }
+
+                        if (dbuf_append(buffer, chp, (unsigned long) (nxt - chp)) < 0) {
+                                linelen = (long) (nxt - chp);
+                                goto print_failure;
+                        }
+
+                        linenum += nr_lines;
+
+                        /* Another marker candidate may be next */
+                        continue;
+                }
+
+                memset(&lm_mem, 0, sizeof(lm_mem));
+                if (read_linemarker_id(chp, limit, &lm->names, &lm_mem, &nxt) == 0) {
+                        if (lm->file_id != lm_mem.file_id) {
+                                lm->file_id = lm_mem.file_id;
 
-                                no_change_idx = (unsigned long) (buffer->pos -
-                                                                 buffer->base);
+                                lm->no_change_idx = (unsigned long) (buffer->pos -
+                                                                     buffer->base);
+                                lm->indexed_idx = lm->no_change_idx;
+                                lm->nl_index.pos = lm->nl_index.base;
 
                                 goto next_line;
-                        } else {
-                                xfree(lm_mem.filename);
-                                lm_mem.filename = NULL;
                         }
 
                         if (lm_mem.linenum < linenum) {
-                                unsigned long to_strip;
-                                char *p;
+                                unsigned long to_strip, *top;
 
                                 to_strip = linenum - lm_mem.linenum;
-                                p = buffer->pos;
+
+                                /* The index gives the newlines at once:
+                                   markers going back far and often
+                                   don't rescan stripped lines */
+                                if (index_newlines(lm, buffer) < 0) {
+                                        linelen = (long) (nxt - chp);
+                                        goto print_failure;
+                                }
+
+                                top = (unsigned long *) lm->nl_index.pos;
 
                                 /* Do not allow rogue linemarkers
                                    to affect lines of other files. */
-                                while (p > buffer->base + no_change_idx &&
+                                while (top > (unsigned long *) lm->nl_index.base &&
+                                       top[-1] >= floor_idx &&
                                        to_strip > 0UL) {
-                                        p--;
-
-                                        if (*p == '\n') {
-                                                *p = ' '; to_strip--;
-                                        }
+                                        top--;
+                                        buffer->base[*top] = ' '; to_strip--;
                                 }
 
-                                ;
+                                lm->nl_index.pos = (char *) top;
                         } else {
                                 /* Pretend we've put enough empty lines
                                    to the file */
@@ -237,14 +612,17 @@ dbuf_t *process_linemarkers(const char *const data,
                         continue;
                 } else {
                         /* Assume normal line here */
-                        for (nxt = chp; !is_eol(nxt, limit); nxt++) ;
+                        if ((nxt = memchr(chp, '\n', (unsigned long) (limit - chp))) == NULL)
+                                nxt = limit;
                         if (nxt < limit) nxt++;
                 }
 
-                if ((linelen = (long) (nxt - chp)) > (long) INT_MAX ||
-                    dbuf_printf(buffer, "%.*s", (int) linelen, chp) < 0) {
+                linelen = (long) (nxt - chp);
+                if (dbuf_append(buffer, chp, (unsigned long) linelen) < 0) {
                         int printlen;
 
+                print_failure:
+
                         if (linelen < 80L)
                                 printlen = (int) linelen;
                         else
@@ -255,14 +633,15 @@ dbuf_t *process_linemarkers(const char *const data,
                                         "%.*s",
                                         printlen, chp);
 
-                        dbuf_free(buffer);
-                        xfree(buffer); buffer = NULL;
-                        goto out;
+                        rc = -1;
+                        break;
                 }
 
                 if (linenum == ULONG_MAX) {
                         int printlen;
 
+                linenum_overflow:
+
                         if (linelen < 80L)
                                 printlen = (int) linelen;
                         else
@@ -273,55 +652,87 @@ dbuf_t *process_linemarkers(const char *const data,
                                         "%.*s",
                                         printlen, chp);
 
-                        dbuf_free(buffer);
-                        xfree(buffer); buffer = NULL;
-                        goto out;
+                        rc = -1;
+                        break;
                 }
 
                 linenum++;
         }
 
-out:
-        xfree(filename); filename = NULL;
+        lm->chp = chp;
+        lm->linenum = linenum;
+
+        return rc;
+}
+
+int process_linemarkers_into(dbuf_t *buffer,
+                             const char *const data,
+                             unsigned long size)
+{
+        struct lm_stream lm_mem, *const lm = &lm_mem;
+        int rc = -1;
+
+        lm_stream_init(lm, data, size);
+
+        /* Output is never longer than the input.
+           Bytes already in @buffer are not ours to strip. */
+        if (dbuf_reserve(buffer, size) == 0)
+                rc = lm_stream_run(lm, buffer, ULONG_MAX,
+                                   (unsigned long) (buffer->pos - buffer->base));
+
+        lm_stream_free(lm);
+
+        return rc;
+}
+
+dbuf_t *process_linemarkers(const char *const data,
+                            unsigned long size)
+{
+        dbuf_t *buffer;
+
+        buffer = xmalloc(sizeof(*buffer)); dbuf_init(buffer);
+
+        if (process_linemarkers_into(buffer, data, size) < 0) {
+                dbuf_free(buffer);
+                xfree(buffer); buffer = NULL;
+        }
 
         return buffer;
 }
 
+/* Open blocks form a stack in an arena:
+   popping one releases its memory at once */
 struct block_desc {
         int ch;
         unsigned long indent;
+        struct block_desc *prev;
+        arena_mark_t mark;
 };
 
-static struct block_desc *push_block_desc(dbuf_t *blocks,
+static struct block_desc *push_block_desc(arena_t *blocks,
+                                          struct block_desc *current,
                                           int ch,
                                           unsigned long indent)
 {
         struct block_desc *desc;
+        arena_mark_t mark;
 
-        desc = (struct block_desc *) dbuf_alloc(blocks, sizeof(*desc));
-        if (desc == NULL) {
-                print_error_msg(-1, 0,
-                                "Failed to push block description:\n"
-                                "    %c, %lu\n"
-                                "In function:\n"
-                                "    %s",
-                                ch, indent, __func__);
-                _exit(ENOENT);
-        }
+        mark = arena_checkpoint(blocks);
+        desc = (struct block_desc *) arena_alloc(blocks, sizeof(*desc));
 
         memset(desc, 0, sizeof(*desc));
         desc->ch = ch; desc->indent = indent;
-
-        /* Overflow check is done by dbuf_alloc */
-        blocks->pos += sizeof(*desc);
+        desc->prev = current;
+        desc->mark = mark;
 
         return desc;
 }
 
-static struct block_desc *pop_block_desc(dbuf_t *blocks,
+static struct block_desc *pop_block_desc(arena_t *blocks,
+                                         struct block_desc *current,
                                          int ch)
 {
-        struct block_desc *desc;
+        struct block_desc *prev;
 
         if (ch == ')')
                 ch = '(';
@@ -337,7 +748,7 @@ static struct block_desc *pop_block_desc(dbuf_t *blocks,
                 _exit(EINVAL);
         }
 
-        if (blocks->pos == blocks->base) {
+        if (current == NULL) {
                 print_error_msg(-1, 0,
                                 "No more stack entries.\n"
                                 "In function:\n"
@@ -346,47 +757,65 @@ static struct block_desc *pop_block_desc(dbuf_t *blocks,
                 _exit(ENOENT);
         }
 
-        desc = (struct block_desc *) blocks->pos - 1;
-
-        if (ch != desc->ch) {
+        if (ch != current->ch) {
                 print_error_msg(-1, 0,
                                 "Wrong block type:\n"
                                 "    expected [%c], actual [%c]\n"
                                 "In function:\n"
                                 "    %s",
-                                ch, desc->ch, __func__);
+                                ch, current->ch, __func__);
                 _exit(ESRCH);
         }
 
-        blocks->pos = (char *) desc;
+        prev = current->prev;
+        arena_reset(blocks, current->mark);
 
-        return (blocks->pos == blocks->base) ? NULL : (desc - 1);
+        return prev;
 }
 
+/* Bytes seen by adjust_style. With @src set, the window slides
+   over output of process_linemarkers produced on demand. */
+struct style_input {
+        char *base;  /* Start of the window */
+        char *limit; /* End of bytes which may be looked at */
+        struct fused_stream *src;
+};
+
+static int refill(struct style_input *in,
+                  char **chpp,
+                  char **extrap);
+
 static int skip_comment(char **chpp,
-                        char *const limit)
+                        struct style_input *in)
 {
         char *chp = *chpp;
         int is_skipped = 0;
 
-        if (chp < limit && *chp++ == '/' &&
-            chp < limit && (*chp == '*' || *chp == '/')) {
+        /* Both bytes of the opener must be visible */
+        if (*chp == '/' && chp + 1 == in->limit)
+                refill(in, &chp, NULL);
+
+        /* The sentinel is neither of them */
+        if (*chp == '/' && (chp[1] == '*' || chp[1] == '/')) {
                 is_skipped = 1;
+                chp++;
 
                 if (*chp++ == '*') {
-                        int is_terminated = 0;
-
                         /* Seek '*' '/'
                            skipping everything until that */
-                        while (chp < limit) {
-                                if (*chp++ == '*' && chp < limit &&
-                                    *chp == '/') {
-                                        is_terminated = 1;
-                                        chp++; break;
-                                }
+                        char *end, *from = chp;
+
+                        while ((end = (char *) scan_comment_end(from, in->limit)) == NULL) {
+                                /* The '*' may be the last visible byte */
+                                if (in->limit > from)
+                                        from = in->limit - 1;
+                                if (refill(in, &chp, &from) < 0)
+                                        break;
                         }
 
-                        if (!is_terminated) {
+                        if (end != NULL) {
+                                chp = end;
+                        } else {
                                 print_error_msg(-1, 0,
                                                 "Incomplete multiline "
                                                 "comment detected.\n"
@@ -398,7 +827,13 @@ static int skip_comment(char **chpp,
                 } else {
                         /* Eliminate the comment but keep NL
                            character */
-                        while (!is_eol(chp, limit)) chp++;
+                        char *eol;
+
+                        while ((eol = memchr(chp, '\n',
+                                             (unsigned long) (in->limit - chp))) == NULL &&
+                               refill(in, &chp, NULL) == 0) ;
+
+                        chp = (eol != NULL) ? eol : in->limit;
                 }
         }
 
@@ -408,25 +843,28 @@ static int skip_comment(char **chpp,
 }
 
 static char get_character(char **chpp,
-                          char *const limit)
+                          struct style_input *in)
 {
         char *chp = *chpp, ret;
 
         ret = '\0';
 
-        while (skip_comment(&chp, limit) ||
-               (chp < limit && is_ws(*chp) && (chp++, 1))) ret = ' ';
+        do {
+                while (skip_comment(&chp, in) ||
+                       (is_ws(*chp) && (chp++, 1))) ret = ' ';
+                /* Decision below depends on the next byte */
+        } while (is_end(chp, in->limit) && refill(in, &chp, NULL) == 0);
 
         /* Enumerated characters are handled specially.
            So it is desirable to omit whitespaces
            preceding them */
-        if (chp < limit &&
-            (ret == '\0' || (ret == ' ' && (*chp == '\n' ||
+        if ((ret == '\0' || (ret == ' ' && (*chp == '\n' ||
                                             *chp == ';'  ||
                                             *chp == '{'  ||
                                             *chp == '}'  ||
                                             *chp == '('  ||
-                                            *chp == ')')))) ret = *chp++;
+                                            *chp == ')'))) &&
+            !is_end(chp, in->limit)) ret = *chp++;
 
         *chpp = chp;
         return ret;
@@ -434,11 +872,11 @@ static char get_character(char **chpp,
 
 static void unget_character(char **chpp,
                             char ch,
-                            char *const limit)
+                            struct style_input *in)
 {
         char *chp = *chpp;
 
-        if (chp > limit) {
+        if (chp > in->base) {
                 *--chp = ch;
                 *chpp = chp;
         } else {
@@ -451,11 +889,49 @@ static void unget_character(char **chpp,
         }
 }
 
-dbuf_t *adjust_style(char *const data,
-                     unsigned long size)
+/* Reserves @len bytes at the end of @buffer */
+static char *put_space(dbuf_t *buffer,
+                       unsigned long len)
 {
-        char *chp = data, *const limit = data + size, ch;
-        dbuf_t blocks_mem, *const blocks = &blocks_mem, *buffer;
+        char *dst;
+
+        if ((dst = dbuf_alloc(buffer, len)) == NULL) {
+                print_error_msg(-1, 0,
+                                "Failed to grow output buffer by %lu bytes.\n"
+                                "In function:\n"
+                                "    %s",
+                                len, __func__);
+                _exit(ENOMEM);
+        }
+
+        buffer->pos += len;
+
+        return dst;
+}
+
+static void put_span(dbuf_t *buffer,
+                     const char *src,
+                     unsigned long len)
+{
+        memcpy(put_space(buffer, len), src, len);
+}
+
+/* Indentation padding */
+static void put_blanks(dbuf_t *buffer,
+                       unsigned long len)
+{
+        memset(put_space(buffer, len), ' ', len);
+}
+
+/* Appends to @buffer. Output is usually about as long as @size_hint */
+static void style_run(struct style_input *in,
+                      dbuf_t *buffer,
+                      unsigned long size_hint)
+{
+        char *chp = in->base, ch;
+        arena_t blocks_mem, *const blocks = &blocks_mem;
+        /* Enough for common nesting without malloc */
+        char blocks_buf[2048];
         enum {
                 /* At the start of a new line. Substate #1.
                    We are allowed here to add extra NL character
@@ -481,17 +957,22 @@ dbuf_t *adjust_style(char *const data,
         unsigned long linelen = 0UL, blk_indent = 0UL;
         struct block_desc *current;
 
-        buffer = xmalloc(sizeof(*buffer));
-        dbuf_init(blocks);
-        dbuf_init(buffer);
+        arena_init(blocks, blocks_buf, sizeof(blocks_buf));
+
+        /* Just a hint: put_space reports failures.
+           Past the hint, large outputs grow by a quarter of it
+           instead of doubling. */
+        (void) dbuf_reserve(buffer, size_hint);
+        if (size_hint >= (1UL << 20))
+                dbuf_set_growth(buffer, size_hint / 4UL);
 
-        current = push_block_desc(blocks, '$', 0UL);
+        current = push_block_desc(blocks, NULL, '$', 0UL);
 
-        for (ch = get_character(&chp, limit); ch != '\0';) {
+        for (ch = get_character(&chp, in); ch != '\0';) {
                 switch (state) {
                 case S_NL1:
                         if (ch == '\n') {
-                                dbuf_putc(buffer, '\n');
+                                put_span(buffer, "\n", 1UL);
 
                                 state = S_NL2;
 
@@ -503,26 +984,24 @@ dbuf_t *adjust_style(char *const data,
                             ch == ' ')
                                 goto next;
 
-                        for (linelen = 0UL;
-                             linelen < current->indent;
-                             linelen++) dbuf_putc(buffer, ' ');
+                        put_blanks(buffer, current->indent);
+                        linelen = current->indent;
 
                         state = S_TEXT1;
                         /* FALLTHRU */
                 case S_TEXT1:
                 case S_TEXT2:
                         if (ch == '\n') {
-                                unget_character(&chp, ' ', data);
+                                unget_character(&chp, ' ', in);
 
                                 goto next;
                         }
 
                         if (ch == ';') {
-                                dbuf_putc(buffer, ';'); linelen++;
-                                dbuf_putc(buffer, '\n');
+                                put_span(buffer, ";\n", 2UL); linelen++;
 
-                                if ((ch = get_character(&chp, limit)) == '\n')
-                                        ch = get_character(&chp, limit);
+                                if ((ch = get_character(&chp, in)) == '\n')
+                                        ch = get_character(&chp, in);
 
                                 state = S_NL1;
 
@@ -531,20 +1010,19 @@ dbuf_t *adjust_style(char *const data,
 
                         if (ch == '{') {
                                 if (state == S_TEXT2) {
-                                        dbuf_putc(buffer, ' '); linelen++;
+                                        put_span(buffer, " {\n", 3UL); linelen += 2UL;
+                                } else {
+                                        put_span(buffer, "{\n", 2UL); linelen++;
                                 }
 
-                                dbuf_putc(buffer, '{'); linelen++;
-                                dbuf_putc(buffer, '\n');
-
                                 blk_indent += 4UL;
 
-                                current = push_block_desc(blocks,
+                                current = push_block_desc(blocks, current,
                                                           '{',
                                                           blk_indent);
 
-                                if ((ch = get_character(&chp, limit)) == '\n')
-                                        ch = get_character(&chp, limit);
+                                if ((ch = get_character(&chp, in)) == '\n')
+                                        ch = get_character(&chp, in);
 
                                 state = S_NL1;
 
@@ -552,23 +1030,20 @@ dbuf_t *adjust_style(char *const data,
                         }
 
                         if (ch == '}') {
-                                current = pop_block_desc(blocks,
+                                current = pop_block_desc(blocks, current,
                                                          '}');
 
                                 if (state == S_TEXT2) {
-                                        dbuf_putc(buffer, '\n');
-                                        for (linelen = 0UL;
-                                             linelen < current->indent;
-                                             linelen++) dbuf_putc(buffer, ' ');
+                                        put_span(buffer, "\n", 1UL);
+                                        put_blanks(buffer, current->indent);
+                                        linelen = current->indent;
                                 } else {
                                         assert(linelen == blk_indent);
 
                                         if (current->indent > linelen) {
-                                                for (;
-                                                     linelen < current->indent;
-                                                     linelen++) {
-                                                        dbuf_putc(buffer, ' ');
-                                                }
+                                                put_blanks(buffer,
+                                                           current->indent - linelen);
+                                                linelen = current->indent;
                                         } else {
                                                 unsigned long delta;
 
@@ -581,11 +1056,11 @@ dbuf_t *adjust_style(char *const data,
 
                                 blk_indent -= 4UL;
 
-                                dbuf_putc(buffer, '}'); linelen++;
+                                put_span(buffer, "}", 1UL); linelen++;
 
-                                if ((ch = get_character(&chp, limit)) == '\n') {
-                                        dbuf_putc(buffer, '\n');
-                                        ch = get_character(&chp, limit);
+                                if ((ch = get_character(&chp, in)) == '\n') {
+                                        put_span(buffer, "\n", 1UL);
+                                        ch = get_character(&chp, in);
 
                                         state = S_NL1;
                                 } else {
@@ -597,18 +1072,18 @@ dbuf_t *adjust_style(char *const data,
 
                         if (ch == '(') {
                                 if (state == S_TEXT2) {
-                                        dbuf_putc(buffer, ' '); linelen++;
+                                        put_span(buffer, " (", 2UL); linelen += 2UL;
+                                } else {
+                                        put_span(buffer, "(", 1UL); linelen++;
                                 }
 
-                                dbuf_putc(buffer, '('); linelen++;
-
-                                current = push_block_desc(blocks,
+                                current = push_block_desc(blocks, current,
                                                           '(',
                                                           linelen);
 
-                                if ((ch = get_character(&chp, limit)) == '\n') {
-                                        dbuf_putc(buffer, '\n');
-                                        ch = get_character(&chp, limit);
+                                if ((ch = get_character(&chp, in)) == '\n') {
+                                        put_span(buffer, "\n", 1UL);
+                                        ch = get_character(&chp, in);
 
                                         state = S_NL1;
                                 } else {
@@ -619,14 +1094,14 @@ dbuf_t *adjust_style(char *const data,
                         }
 
                         if (ch == ')') {
-                                current = pop_block_desc(blocks,
+                                current = pop_block_desc(blocks, current,
                                                          ')');
 
-                                dbuf_putc(buffer, ')'); linelen++;
+                                put_span(buffer, ")", 1UL); linelen++;
 
-                                if ((ch = get_character(&chp, limit)) == '\n') {
-                                        unget_character(&chp, ' ', data);
-                                        ch = get_character(&chp, limit);
+                                if ((ch = get_character(&chp, in)) == '\n') {
+                                        unget_character(&chp, ' ', in);
+                                        ch = get_character(&chp, in);
                                 }
 
                                 state = S_TEXT2;
@@ -635,29 +1110,53 @@ dbuf_t *adjust_style(char *const data,
                         }
 
                         if (ch == '"' || ch == '\'') {
-                                dbuf_putc(buffer, ch); linelen++;
-
                                 state = S_QUOTED;
 
                                 continue;
                         }
 
-                        dbuf_putc(buffer, ch); linelen++;
+                        /* The rest of the token goes along with @ch */
+                        {
+                                char *run, *dst;
+                                unsigned long runlen;
+
+                                run = (char *) scan_special(chp, in->limit);
+                                runlen = (unsigned long) (run - chp);
+
+                                dst = put_space(buffer, 1UL + runlen);
+                                *dst = ch;
+                                memcpy(dst + 1, chp, runlen);
+                                linelen += 1UL + runlen;
+                                chp = run;
+                        }
 
                         state = S_TEXT2;
 
                         goto next;
 
-                case S_QUOTED:
-                        while (chp < limit && *chp != ch) {
-                                dbuf_putc(buffer, *chp); linelen++;
+                case S_QUOTED: {
+                        /* Opening quote, text and closing quote at once */
+                        char *end, *dst;
+
+                        /* Stops at backslashes and newlines too:
+                           both are stepped over */
+                        for (end = chp;;) {
+                                end = (char *) scan_quote(end, in->limit, ch);
 
-                                if (*chp++ == '\\' && chp < limit) {
-                                        dbuf_putc(buffer, *chp++); linelen++;
+                                /* Escaped byte must be visible too */
+                                if (end + (end < in->limit && *end == '\\') >= in->limit) {
+                                        if (refill(in, &chp, &end) == 0)
+                                                continue;
+                                        break;
                                 }
+
+                                if (*end == ch)
+                                        break;
+
+                                end += (*end == '\\') ? 2 : 1;
                         }
 
-                        if (chp >= limit) {
+                        if (end >= in->limit || *end != ch) {
                                 print_error_msg(-1, 0,
                                                 "Incomplete quoted "
                                                 "text detected.\n"
@@ -667,17 +1166,188 @@ dbuf_t *adjust_style(char *const data,
                                 _exit(EINVAL);
                         }
 
-                        dbuf_putc(buffer, *chp++); linelen++;
+                        end++;
+                        dst = put_space(buffer, 1UL + (unsigned long) (end - chp));
+                        *dst = ch;
+                        memcpy(dst + 1, chp, (unsigned long) (end - chp));
+                        linelen += 1UL + (unsigned long) (end - chp);
+                        chp = end;
 
                         state = S_TEXT2;
 
                         goto next;
                 }
+                }
         next:
-                ch = get_character(&chp, limit);
+                ch = get_character(&chp, in);
+        }
+
+        arena_free(blocks);
+}
+
+dbuf_t *adjust_style(char *const data,
+                     unsigned long size)
+{
+        struct style_input in_mem;
+        dbuf_t *buffer;
+
+        memset(&in_mem, 0, sizeof(in_mem));
+        in_mem.base = data;
+        in_mem.limit = data + size;
+
+        buffer = xmalloc(sizeof(*buffer)); dbuf_init(buffer);
+        style_run(&in_mem, buffer, size);
+
+        return buffer;
+}
+
+/** Fused process_linemarkers and adjust_style.
+    Linemarkers are processed in chunks right before adjust_style
+    needs the text, so only a window of the intermediate text exists.
+    The last lines of the window are hidden from adjust_style:
+    rogue linemarkers may still strip their newlines.
+**/
+
+struct fused_stream {
+        struct lm_stream lm;
+        dbuf_t window;
+        char hidden; /* Byte replaced with the sentinel at the limit */
+        int failed;
+};
+
+/* Bytes produced at once */
+static const unsigned long fused_chunk = 64UL * 1024UL;
+/* Lines a rogue linemarker may strip exactly as process_linemarkers does */
+static const unsigned long fused_lookback = 64UL;
+
+/* Makes more bytes visible in @in. The sentinel moves to the new
+   limit; the byte it covers is kept in @hidden. Everything before @chpp
+   (and @extrap, if given) except one byte for unget_character
+   may be discarded: both pointers are moved along with the window.
+   Returns -1 if there is nothing more. */
+static int refill(struct style_input *in,
+                  char **chpp,
+                  char **extrap)
+{
+        struct fused_stream *src = in->src;
+        dbuf_t *window;
+        char *keep, *end, *p;
+        unsigned long drop, chp_off, extra_off, limit_off, nr_nl;
+        int rc = -1;
+
+        if (src == NULL || src->failed)
+                return -1;
+
+        window = &src->window;
+        *in->limit = src->hidden;
+
+        keep = *chpp;
+        if (extrap != NULL && *extrap < keep)
+                keep = *extrap;
+        drop = (keep > in->base) ? (unsigned long) (keep - in->base) - 1UL : 0UL;
+
+        chp_off = (unsigned long) (*chpp - in->base);
+        extra_off = (extrap != NULL) ? (unsigned long) (*extrap - in->base) : 0UL;
+        limit_off = (unsigned long) (in->limit - in->base);
+
+        /* Consumed bytes are discarded once they are the bulk of the window */
+        if (drop >= fused_chunk &&
+            drop >= (unsigned long) (window->pos - window->base) / 2UL) {
+                memmove(window->base, window->base + drop,
+                        (unsigned long) (window->pos - window->base) - drop);
+                window->pos -= drop;
+
+                lm_stream_shift(&src->lm, drop);
+                chp_off -= drop;
+                extra_off -= drop;
+                limit_off -= drop;
         }
 
-        dbuf_free(blocks);
+        for (;;) {
+                if (src->lm.chp >= src->lm.limit) {
+                        /* Input is over: nothing is hidden anymore */
+                        if (limit_off < (unsigned long) (window->pos - window->base)) {
+                                limit_off = (unsigned long) (window->pos - window->base);
+                                rc = 0;
+                        }
+                        break;
+                }
+
+                if (lm_stream_run(&src->lm, window, fused_chunk, limit_off) < 0) {
+                        src->failed = 1;
+                        break;
+                }
+
+                /* Start of the line @fused_lookback lines before the end */
+                end = window->pos;
+                p = window->base + limit_off;
+                for (nr_nl = 0UL; nr_nl <= fused_lookback && end > p; nr_nl++) {
+                        if ((end = memrchr(p, '\n', (unsigned long) (end - p))) == NULL)
+                                break;
+                }
+
+                if (end != NULL && nr_nl > fused_lookback) {
+                        limit_off = (unsigned long) (end + 1 - window->base);
+                        rc = 0;
+                        break;
+                }
+        }
+
+        if (dbuf_terminate(window) < 0) {
+                src->failed = 1;
+                limit_off = (unsigned long) (window->pos - window->base);
+        }
+
+        in->base = window->base;
+        in->limit = window->base + limit_off;
+        src->hidden = *in->limit;
+        *in->limit = '\0';
+
+        *chpp = in->base + chp_off;
+        if (extrap != NULL)
+                *extrap = in->base + extra_off;
+
+        return rc;
+}
+
+int process_and_adjust_into(dbuf_t *buffer,
+                            const char *const data,
+                            unsigned long size)
+{
+        struct fused_stream src_mem, *const src = &src_mem;
+        struct style_input in_mem;
+        int rc;
+
+        memset(src, 0, sizeof(*src));
+        lm_stream_init(&src->lm, data, size);
+        dbuf_init(&src->window);
+        /* Empty padded text: the first refill comes at once */
+        dbuf_terminate(&src->window);
+
+        memset(&in_mem, 0, sizeof(in_mem));
+        in_mem.base = in_mem.limit = src->window.base;
+        in_mem.src = src;
+
+        style_run(&in_mem, buffer, size);
+        rc = src->failed ? -1 : 0;
+
+        lm_stream_free(&src->lm);
+        dbuf_free(&src->window);
+
+        return rc;
+}
+
+dbuf_t *process_and_adjust(const char *const data,
+                           unsigned long size)
+{
+        dbuf_t *buffer;
+
+        buffer = xmalloc(sizeof(*buffer)); dbuf_init(buffer);
+
+        if (process_and_adjust_into(buffer, data, size) < 0) {
+                dbuf_free(buffer);
+                xfree(buffer); buffer = NULL;
+        }
 
         return buffer;
 }
@@ -0,0 +1,522 @@
+#include "common.h"
+
+/** Post-processing server.
+    Wrappers hand preprocessed text over a local socket and exit
+    as soon as the compiler is done. The text travels in a memfd
+    passed with SCM_RIGHTS, so requests stay small.
+    Every request is handled by a forked worker: the parser may _exit()
+    on malformed input and must not take the server down with it.
+    The number of workers is bounded by the number of CPUs.
+    The server is started by the first client and exits after
+    SERVER_IDLE_SEC seconds without requests.
+    Settings of handlers come from the environment of each client,
+    not of the one which started the server.
+**/
+
+#define SERVER_IDLE_SEC 30
+#define SERVER_MAGIC 0x67777332U /* "gws2" */
+
+/* Variables read by handlers: sent with every request */
+static const char *const server_env[] = {
+        "TMPDIR",
+        "X_MEM_BUDGET_MB",
+        "X_MEM_BUDGET_WAIT",
+        "X_MMAP_I_FILES",
+        "X_PP_CACHE_DIR",
+        "X_SCAN_KERNELS",
+        NULL,
+};
+
+struct server_req {
+        unsigned int magic;
+        int type;
+        unsigned long size;
+        unsigned int cwd_len;
+        unsigned int i_len;
+        unsigned int o_len;
+        unsigned int env_len;
+};
+
+/* Three paths follow the header, each with its '\0',
+   then "NAME=value" strings of set server_env variables */
+#define SERVER_ENV_MAX (2UL * PATH_MAX)
+#define SERVER_MSG_MAX (sizeof(struct server_req) + 3UL * PATH_MAX + \
+                        SERVER_ENV_MAX)
+
+static char *make_lock_name(const char *sock_path)
+{
+        char *lock;
+        unsigned long size;
+
+        size = strlen(sock_path) + sizeof(".lock");
+        lock = xmalloc(size);
+        snprintf(lock, size, "%s.lock", sock_path);
+
+        return lock;
+}
+
+static int fill_sockaddr(struct sockaddr_un *sa,
+                         const char *sock_path)
+{
+        unsigned long len = strlen(sock_path);
+
+        if (len >= sizeof(sa->sun_path))
+                return -1;
+
+        memset(sa, 0, sizeof(*sa));
+        sa->sun_family = AF_UNIX;
+        memcpy(sa->sun_path, sock_path, len + 1UL);
+
+        return 0;
+}
+
+static int connect_server(const char *sock_path)
+{
+        struct sockaddr_un sa_mem;
+        int fd;
+
+        if (fill_sockaddr(&sa_mem, sock_path) < 0)
+                return -1;
+
+        if ((fd = socket(AF_UNIX,
+                         SOCK_SEQPACKET | SOCK_CLOEXEC,
+                         0)) < 0)
+                return -1;
+
+        if (connect(fd, (struct sockaddr *) &sa_mem, sizeof(sa_mem)) < 0) {
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+/* Starts "<self> --x-server @sock_path" in its own session.
+   The server outlives us, so its output goes to /dev/null
+   and it keeps none of our other files (make's jobserver pipes
+   in particular). */
+static int spawn_server(const char *sock_path)
+{
+        char *argv[4];
+        posix_spawn_file_actions_t fa_mem;
+        posix_spawnattr_t attr_mem;
+        pid_t pid;
+        int err, fd;
+        extern char **environ;
+
+        argv[0] = "gcc-wrapper";
+        argv[1] = "--x-server";
+        argv[2] = (char *) sock_path;
+        argv[3] = NULL;
+
+        posix_spawn_file_actions_init(&fa_mem);
+        posix_spawnattr_init(&attr_mem);
+
+        for (fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++)
+                posix_spawn_file_actions_addopen(&fa_mem, fd, "/dev/null",
+                                                 O_RDWR, 0);
+        posix_spawn_file_actions_addclosefrom_np(&fa_mem, STDERR_FILENO + 1);
+        posix_spawnattr_setflags(&attr_mem, POSIX_SPAWN_SETSID);
+
+        err = posix_spawn(&pid, "/proc/self/exe",
+                          &fa_mem, &attr_mem, argv, environ);
+
+        posix_spawnattr_destroy(&attr_mem);
+        posix_spawn_file_actions_destroy(&fa_mem);
+
+        return (err == 0) ? 0 : -1;
+}
+
+/* Connects to the server starting it if needed */
+static int open_server(const char *sock_path)
+{
+        static const struct timespec delay = { 0, 20L * 1000L * 1000L };
+        int fd, tries;
+
+        if ((fd = connect_server(sock_path)) >= 0)
+                return fd;
+
+        if (errno != ENOENT && errno != ECONNREFUSED)
+                return -1;
+
+        if (spawn_server(sock_path) < 0)
+                return -1;
+
+        for (tries = 0; tries < 50; tries++) {
+                nanosleep(&delay, NULL);
+                if ((fd = connect_server(sock_path)) >= 0)
+                        return fd;
+        }
+
+        return -1;
+}
+
+/* Packs set server_env variables as "NAME=value" strings.
+   Returns the size of the block or -1 if it doesn't fit. */
+static long pack_env(char *block)
+{
+        const char *const *name;
+        const char *val;
+        unsigned long size = 0UL, len;
+
+        for (name = server_env; *name != NULL; name++) {
+                if ((val = getenv(*name)) == NULL)
+                        continue;
+
+                len = strlen(*name) + 1UL + strlen(val) + 1UL;
+                if (len > SERVER_ENV_MAX - size)
+                        return -1L;
+
+                snprintf(block + size, len, "%s=%s", *name, val);
+                size += len;
+        }
+
+        return (long) size;
+}
+
+/* Makes the environment of the worker that of the client */
+static int unpack_env(const char *block,
+                      unsigned long size)
+{
+        const char *const *name;
+        const char *chp, *eq;
+        unsigned long len;
+
+        for (name = server_env; *name != NULL; name++)
+                unsetenv(*name);
+
+        if (size > 0UL && block[size - 1UL] != '\0')
+                return -1;
+
+        for (chp = block; chp < block + size; chp += len + 1UL) {
+                len = strlen(chp);
+
+                if ((eq = strchr(chp, '=')) == NULL)
+                        return -1;
+
+                for (name = server_env; *name != NULL; name++)
+                        if (strlen(*name) == (unsigned long) (eq - chp) &&
+                            memcmp(*name, chp, eq - chp) == 0)
+                                break;
+
+                if (*name == NULL || setenv(*name, eq + 1, 1) < 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+int server_submit(const char *sock_path,
+                  const server_job_t *job)
+{
+        struct server_req req_mem;
+        char cwd_mem[PATH_MAX], env_mem[SERVER_ENV_MAX];
+        char cbuf[CMSG_SPACE(sizeof(int))];
+        struct iovec iov[5];
+        long env_len;
+        struct msghdr msg_mem;
+        struct cmsghdr *cmsg;
+        int sfd = -1, mfd = -1, rc = -1;
+
+        if (job->size == 0UL || job->size > (unsigned long) LONG_MAX ||
+            getcwd(cwd_mem, sizeof(cwd_mem)) == NULL)
+                return -1;
+
+        memset(&req_mem, 0, sizeof(req_mem));
+        req_mem.magic = SERVER_MAGIC;
+        req_mem.type = job->type;
+        req_mem.size = job->size;
+        req_mem.cwd_len = (unsigned int) strlen(cwd_mem) + 1U;
+        req_mem.i_len = (unsigned int) strlen(job->i_file) + 1U;
+        req_mem.o_len = (unsigned int) strlen(job->o_file) + 1U;
+
+        if (req_mem.i_len > PATH_MAX || req_mem.o_len > PATH_MAX ||
+            (env_len = pack_env(env_mem)) < 0L)
+                return -1;
+
+        req_mem.env_len = (unsigned int) env_len;
+
+        if ((mfd = memfd_create("gcc-wrapper", MFD_CLOEXEC)) < 0 ||
+            safe_write(mfd, job->data, job->size) != (long) job->size)
+                goto out;
+
+        if ((sfd = open_server(sock_path)) < 0)
+                goto out;
+
+        iov[0].iov_base = &req_mem;
+        iov[0].iov_len = sizeof(req_mem);
+        iov[1].iov_base = cwd_mem;
+        iov[1].iov_len = req_mem.cwd_len;
+        iov[2].iov_base = (char *) job->i_file;
+        iov[2].iov_len = req_mem.i_len;
+        iov[3].iov_base = (char *) job->o_file;
+        iov[3].iov_len = req_mem.o_len;
+        iov[4].iov_base = env_mem;
+        iov[4].iov_len = req_mem.env_len;
+
+        memset(&msg_mem, 0, sizeof(msg_mem));
+        memset(cbuf, 0, sizeof(cbuf));
+        msg_mem.msg_iov = iov;
+        msg_mem.msg_iovlen = 5;
+        msg_mem.msg_control = cbuf;
+        msg_mem.msg_controllen = sizeof(cbuf);
+
+        cmsg = CMSG_FIRSTHDR(&msg_mem);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &mfd, sizeof(int));
+
+        /* The message is queued along with the descriptor:
+           nothing else is needed from us */
+        while ((rc = (int) sendmsg(sfd, &msg_mem, MSG_NOSIGNAL)) < 0 &&
+               errno == EINTR) ;
+        if (rc >= 0)
+                rc = 0;
+
+out:
+        if (sfd >= 0)
+                close(sfd);
+        if (mfd >= 0)
+                close(mfd);
+
+        return rc;
+}
+
+/* Checks that the path of @len bytes is terminated right where expected */
+static const char *take_path(const char **chpp,
+                             const char *const limit,
+                             unsigned int len)
+{
+        const char *path = *chpp;
+
+        if (len == 0U || (unsigned long) (limit - path) < len ||
+            path[len - 1U] != '\0')
+                return NULL;
+
+        *chpp = path + len;
+        return path;
+}
+
+/* Runs in a worker process */
+static void serve_request(int cfd,
+                          server_handler_t handler)
+{
+        struct server_req req_mem;
+        char *mbuf, cbuf[CMSG_SPACE(sizeof(int))];
+        const char *chp, *limit, *cwd;
+        struct iovec iov_mem;
+        struct msghdr msg_mem;
+        struct cmsghdr *cmsg;
+        server_job_t job_mem;
+        void *base;
+        long len;
+        int mfd = -1;
+
+        mbuf = xmalloc(SERVER_MSG_MAX);
+
+        iov_mem.iov_base = mbuf;
+        iov_mem.iov_len = SERVER_MSG_MAX;
+
+        memset(&msg_mem, 0, sizeof(msg_mem));
+        msg_mem.msg_iov = &iov_mem;
+        msg_mem.msg_iovlen = 1;
+        msg_mem.msg_control = cbuf;
+        msg_mem.msg_controllen = sizeof(cbuf);
+
+        while ((len = (long) recvmsg(cfd, &msg_mem, MSG_CMSG_CLOEXEC)) < 0 &&
+               errno == EINTR) ;
+
+        for (cmsg = (len > 0L) ? CMSG_FIRSTHDR(&msg_mem) : NULL;
+             cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg_mem, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_RIGHTS &&
+                    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+                        memcpy(&mfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        if (mfd < 0 ||
+            (msg_mem.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0 ||
+            (unsigned long) len < sizeof(req_mem))
+                goto out;
+
+        memcpy(&req_mem, mbuf, sizeof(req_mem));
+        chp = mbuf + sizeof(req_mem);
+        limit = mbuf + len;
+
+        memset(&job_mem, 0, sizeof(job_mem));
+        if (req_mem.magic != SERVER_MAGIC ||
+            req_mem.size == 0UL ||
+            (cwd = take_path(&chp, limit, req_mem.cwd_len)) == NULL ||
+            (job_mem.i_file = take_path(&chp, limit, req_mem.i_len)) == NULL ||
+            (job_mem.o_file = take_path(&chp, limit, req_mem.o_len)) == NULL ||
+            (unsigned long) (limit - chp) != req_mem.env_len ||
+            unpack_env(chp, req_mem.env_len) < 0 ||
+            chdir(cwd) < 0)
+                goto out;
+
+        /* Handlers parse the data */
+        if (map_padded_text(mfd, req_mem.size, PROT_READ, &base) < 0)
+                goto out;
+
+        job_mem.type = req_mem.type;
+        job_mem.data = base;
+        job_mem.size = req_mem.size;
+
+        handler(&job_mem);
+
+        delete_file_mapping(base, req_mem.size);
+
+out:
+        if (mfd >= 0)
+                close(mfd);
+        xfree(mbuf);
+}
+
+/* Starts a worker for the connection on @lfd.
+   Returns 1 if a worker is started, 0 if there are no connections. */
+static int accept_request(int lfd,
+                          server_handler_t handler)
+{
+        pid_t pid;
+        int cfd;
+
+        while ((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) < 0 &&
+               errno == EINTR) ;
+        if (cfd < 0)
+                return 0;
+
+        if ((pid = fork()) == 0) {
+                close(lfd);
+                serve_request(cfd, handler);
+                _exit(0);
+        }
+
+        close(cfd);
+
+        return (pid > 0) ? 1 : 0;
+}
+
+static unsigned long reap_workers(int may_block)
+{
+        unsigned long nr_reaped = 0UL;
+        int ignored;
+
+        while (waitpid(-1, &ignored, may_block ? 0 : WNOHANG) > 0) {
+                nr_reaped++;
+                may_block = 0;
+        }
+
+        return nr_reaped;
+}
+
+int server_run(const char *sock_path,
+               server_handler_t handler)
+{
+        struct sockaddr_un sa_mem;
+        struct pollfd pfd_mem;
+        unsigned long nr_workers = 0UL, max_workers;
+        time_t last_active;
+        char *lock;
+        int lock_fd, lfd = -1, rc;
+        mode_t old_mask;
+        long nr_cpus;
+
+        if (fill_sockaddr(&sa_mem, sock_path) < 0)
+                return -1;
+
+        lock = make_lock_name(sock_path);
+        lock_fd = open(lock, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+        xfree(lock);
+
+        if (lock_fd < 0)
+                return -1;
+
+        /* We aren't needed if the running server answers.
+           One which is shutting down has to finish first. */
+        if (flock(lock_fd, LOCK_EX | LOCK_NB) < 0) {
+                if (errno != EWOULDBLOCK ||
+                    (lfd = connect_server(sock_path)) >= 0 ||
+                    flock(lock_fd, LOCK_EX) < 0) {
+                        if (lfd >= 0)
+                                close(lfd);
+                        close(lock_fd);
+                        return 0;
+                }
+        }
+
+        unlink(sock_path);
+
+        if ((lfd = socket(AF_UNIX,
+                          SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                          0)) < 0)
+                goto fail;
+
+        /* Only the owner may hand us files to write */
+        old_mask = umask(077);
+        rc = bind(lfd, (struct sockaddr *) &sa_mem, sizeof(sa_mem));
+        umask(old_mask);
+
+        if (rc < 0 || listen(lfd, 128) < 0)
+                goto fail;
+
+        if ((nr_cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1L)
+                nr_cpus = 1L;
+        max_workers = (unsigned long) nr_cpus;
+
+        last_active = time(NULL);
+
+        for (;;) {
+                int timeout;
+
+                nr_workers -= reap_workers(nr_workers >= max_workers);
+                if (nr_workers >= max_workers)
+                        continue;
+
+                if (nr_workers > 0UL) {
+                        /* Reap workers once in a while */
+                        timeout = 100;
+                } else {
+                        time_t idle = time(NULL) - last_active;
+
+                        if (idle >= SERVER_IDLE_SEC)
+                                break;
+                        timeout = (int) (SERVER_IDLE_SEC - idle) * 1000;
+                }
+
+                pfd_mem.fd = lfd;
+                pfd_mem.events = POLLIN;
+                pfd_mem.revents = 0;
+
+                if (poll(&pfd_mem, 1, timeout) > 0 &&
+                    accept_request(lfd, handler)) {
+                        nr_workers++;
+                        last_active = time(NULL);
+                }
+        }
+
+        /* New clients start another server from now on.
+           Connections already queued are still served. */
+        unlink(sock_path);
+        while (accept_request(lfd, handler))
+                nr_workers++;
+        while (nr_workers > 0UL)
+                nr_workers -= reap_workers(1);
+
+        close(lfd);
+        close(lock_fd);
+
+        return 0;
+
+fail:
+        print_error_msg(errno,
+                        0,
+                        "In %s\nAt \"bind\"",
+                        __func__);
+        if (lfd >= 0)
+                close(lfd);
+        close(lock_fd);
+
+        return -1;
+}
@@ -0,0 +1,182 @@
+#include "../common.h"
+
+/* Objects of @nr sizes (1, 2, ...) are aligned, disjoint
+   and keep their contents. */
+static int check_objects(arena_t *arena,
+                         unsigned long nr)
+{
+        char **objs;
+        unsigned long i, j;
+        int rc = 0;
+
+        objs = xmalloc(nr * sizeof(*objs));
+
+        for (i = 0UL; i < nr; i++) {
+                objs[i] = arena_alloc(arena, i + 1UL);
+                if (((unsigned long) objs[i] & 15UL) != 0UL) {
+                        printf("ERROR: Object #%lu is misaligned: %p\n",
+                               i, (void *) objs[i]);
+                        rc = 1;
+                        goto out;
+                }
+                memset(objs[i], (int) (i & 0xffUL), i + 1UL);
+        }
+
+        for (i = 0UL; i < nr; i++) {
+                for (j = 0UL; j <= i; j++) {
+                        if (objs[i][j] != (char) (i & 0xffUL)) {
+                                printf("ERROR: Object #%lu is overwritten at %lu\n",
+                                       i, j);
+                                rc = 1;
+                                goto out;
+                        }
+                }
+        }
+
+out:
+        xfree(objs);
+        return rc;
+}
+
+static int test_alloc(void)
+{
+        arena_t arena_mem, *const arena = &arena_mem;
+        char buf[1000];
+        int rc = 0;
+
+        printf("TEST: arena_alloc\n");
+
+        arena_init(arena, NULL, 0UL);
+        rc |= check_objects(arena, 3000UL);
+        arena_free(arena);
+
+        /* Objects outgrow the initial buffer */
+        arena_init(arena, buf, sizeof(buf));
+        rc |= check_objects(arena, 3000UL);
+        arena_free(arena);
+
+        /* Larger than any chunk */
+        arena_init(arena, buf, sizeof(buf));
+        memset(arena_alloc(arena, 3UL << 20), 'x', 3UL << 20);
+        rc |= check_objects(arena, 10UL);
+        arena_free(arena);
+
+        printf("%s\n", rc ? "FAIL" : "PASS");
+        return rc;
+}
+
+static int test_checkpoint(void)
+{
+        arena_t arena_mem, *const arena = &arena_mem;
+        arena_mark_t mark;
+        char buf[256], *first, *again;
+        unsigned long i;
+        int rc = 0;
+
+        printf("TEST: arena_checkpoint/arena_reset\n");
+
+        arena_init(arena, buf, sizeof(buf));
+        first = arena_strdup(arena, "first");
+
+        mark = arena_checkpoint(arena);
+        again = arena_alloc(arena, 1UL);
+
+        for (i = 0UL; i < 100UL; i++) {
+                /* Spills out of @buf to chunks */
+                arena_alloc(arena, 1000UL);
+                arena_reset(arena, mark);
+
+                if (arena_alloc(arena, 1UL) != again) {
+                        printf("ERROR: Memory isn't reused after reset #%lu\n", i);
+                        rc = 1;
+                        break;
+                }
+        }
+
+        if (strcmp(first, "first") != 0) {
+                printf("ERROR: Object before the checkpoint is lost\n");
+                rc = 1;
+        }
+
+        arena_free(arena);
+
+        if (arena_alloc(arena, 1UL) != first) {
+                printf("ERROR: The initial buffer isn't reused after arena_free\n");
+                rc = 1;
+        }
+
+        arena_free(arena);
+
+        printf("%s\n", rc ? "FAIL" : "PASS");
+        return rc;
+}
+
+/* Failed parse leaves nothing in the arena */
+static int test_linemarker(void)
+{
+        static const char good[] = "# 42 \"dir/\\\"file\\\".c\" 1 3";
+        static const char bad[] = "# 42 \"file.c\" x";
+        arena_t arena_mem, *const arena = &arena_mem;
+        arena_mark_t mark;
+        linemarker_t lm_mem;
+        const char *nxt;
+        char buf[256], *text;
+        int rc = 0;
+
+        printf("TEST: read_linemarker in arena\n");
+
+        arena_init(arena, buf, sizeof(buf));
+
+        text = text_alloc(sizeof(good) - 1UL);
+        memcpy(text, good, sizeof(good) - 1UL);
+        memset(&lm_mem, 0, sizeof(lm_mem));
+        if (read_linemarker(text, text + sizeof(good) - 1UL,
+                            arena, &lm_mem, &nxt) < 0 ||
+            strcmp(lm_mem.filename, "dir/\"file\".c") != 0 ||
+            lm_mem.filename < buf || lm_mem.filename >= buf + sizeof(buf)) {
+                printf("ERROR: Failed to parse %s\n", good);
+                rc = 1;
+        }
+        xfree(text);
+
+        mark = arena_checkpoint(arena);
+
+        text = text_alloc(sizeof(bad) - 1UL);
+        memcpy(text, bad, sizeof(bad) - 1UL);
+        if (read_linemarker(text, text + sizeof(bad) - 1UL,
+                            arena, &lm_mem, &nxt) == 0) {
+                printf("ERROR: Parsed %s\n", bad);
+                rc = 1;
+        }
+        xfree(text);
+
+        if (arena->pos != mark.pos) {
+                printf("ERROR: Filename of failed parse is kept\n");
+                rc = 1;
+        }
+
+        arena_free(arena);
+
+        printf("%s\n", rc ? "FAIL" : "PASS");
+        return rc;
+}
+
+int main(void)
+{
+        /* Add new tests here */
+        static int (*const tests[])(void) = {
+                test_alloc,
+                test_checkpoint,
+                test_linemarker
+        };
+        static const unsigned long nr_tests = sizeof(tests) / sizeof(tests[0]);
+        int result = 0;
+        unsigned long i;
+
+        for (i = 0UL; i < nr_tests; i++) {
+                if ((tests[i])() != 0)
+                        result = 1;
+        }
+
+        return result;
+}
@@ -0,0 +1,222 @@
+#include "../common.h"
+
+static char pool_path[PATH_MAX];
+
+static int make_pool(void)
+{
+        char dir[] = "/tmp/test-budget.XXXXXX";
+
+        if (mkdtemp(dir) == NULL)
+                return -1;
+
+        snprintf(pool_path, sizeof(pool_path), "%s/pool", dir);
+
+        return 0;
+}
+
+static void remove_pool(void)
+{
+        char *slash;
+
+        unlink(pool_path);
+        if ((slash = strrchr(pool_path, '/')) != NULL) {
+                *slash = '\0';
+                rmdir(pool_path);
+        }
+}
+
+/* Reservations are granted while they fit and again once released */
+static int test_reserve(void)
+{
+        budget_t first_mem, second_mem;
+        int rc = 1;
+
+        printf("TEST: budget_reserve & budget_release\n");
+
+        if (budget_reserve(&first_mem, pool_path, 10UL, 6UL, 0L) < 0 ||
+            first_mem.fd < 0) {
+                printf("FAIL [First reservation is refused]\n");
+                return 1;
+        }
+
+        if (budget_reserve(&second_mem, pool_path, 10UL, 6UL, 50L) == 0) {
+                printf("FAIL [Budget is exceeded]\n");
+                budget_release(&second_mem);
+                goto out;
+        }
+
+        if (budget_reserve(&second_mem, pool_path, 10UL, 4UL, 0L) < 0) {
+                printf("FAIL [Reservation which fits is refused]\n");
+                goto out;
+        }
+        budget_release(&second_mem);
+
+        budget_release(&first_mem);
+
+        /* Alone in the pool, anything goes */
+        if (budget_reserve(&first_mem, pool_path, 10UL, 20UL, 0L) < 0) {
+                printf("FAIL [Oversized reservation is refused]\n");
+                goto out;
+        }
+
+        printf("PASS\n");
+        rc = 0;
+
+out:
+        budget_release(&first_mem);
+        return rc;
+}
+
+/* Shares of dead processes return to the pool */
+static int test_dead_holder(void)
+{
+        budget_t budget_mem;
+        pid_t pid;
+        int status;
+
+        printf("TEST: budget of a dead process\n");
+
+        if ((pid = fork()) == 0)
+                _exit(budget_reserve(&budget_mem, pool_path,
+                                     10UL, 8UL, 0L) == 0 ? 0 : 1);
+
+        if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                printf("FAIL [Child failed to reserve]\n");
+                return 1;
+        }
+
+        if (budget_reserve(&budget_mem, pool_path, 10UL, 8UL, 0L) < 0) {
+                printf("FAIL [Budget of the dead child is still held]\n");
+                return 1;
+        }
+
+        budget_release(&budget_mem);
+        printf("PASS\n");
+
+        return 0;
+}
+
+/* Same layout as struct budget_slot in budget.c */
+struct test_slot {
+        int pid;
+        unsigned int mb;
+        unsigned long long start;
+};
+
+/* A slot of a dead process whose pid is reused is free */
+static int test_reused_pid(void)
+{
+        struct test_slot slot_mem;
+        budget_t budget_mem;
+        int fd;
+
+        printf("TEST: budget of a reused pid\n");
+
+        /* Our parent is alive but didn't take the slot:
+           its start time differs */
+        memset(&slot_mem, 0, sizeof(slot_mem));
+        slot_mem.pid = (int) getppid();
+        slot_mem.mb = 8U;
+        slot_mem.start = 1ULL;
+
+        if ((fd = open(pool_path, O_CREAT | O_WRONLY | O_TRUNC, 0600)) < 0 ||
+            safe_write(fd, (const char *) &slot_mem, sizeof(slot_mem)) !=
+            (long) sizeof(slot_mem)) {
+                printf("FAIL [Cannot write the pool]\n");
+                if (fd >= 0)
+                        close(fd);
+                return 1;
+        }
+        close(fd);
+
+        if (budget_reserve(&budget_mem, pool_path, 10UL, 8UL, 0L) < 0) {
+                printf("FAIL [Slot of the reused pid is still held]\n");
+                return 1;
+        }
+
+        budget_release(&budget_mem);
+        printf("PASS\n");
+
+        return 0;
+}
+
+/* A waiter gets its share as soon as the holder gives it back */
+static int test_wait(void)
+{
+        budget_t budget_mem;
+        int go_fds[2];
+        pid_t pid;
+        char go = '\0';
+        int ignored, rc = 1;
+
+        printf("TEST: waiting for budget\n");
+
+        if (pipe(go_fds) < 0) {
+                printf("FAIL [pipe]\n");
+                return 1;
+        }
+
+        if ((pid = fork()) == 0) {
+                close(go_fds[0]);
+
+                if (budget_reserve(&budget_mem, pool_path,
+                                   10UL, 8UL, 0L) < 0)
+                        _exit(1);
+
+                safe_write(go_fds[1], "y", 1UL);
+                usleep(100000);
+                budget_release(&budget_mem);
+                _exit(0);
+        }
+
+        close(go_fds[1]);
+
+        if (pid < 0 || safe_read(go_fds[0], &go, 1UL) != 1L || go != 'y') {
+                printf("FAIL [Child failed to reserve]\n");
+                goto out;
+        }
+
+        if (budget_reserve(&budget_mem, pool_path, 10UL, 8UL, 5000L) < 0) {
+                printf("FAIL [Released budget isn't handed over]\n");
+                goto out;
+        }
+
+        budget_release(&budget_mem);
+        printf("PASS\n");
+        rc = 0;
+
+out:
+        close(go_fds[0]);
+        if (pid > 0)
+                waitpid(pid, &ignored, 0);
+        return rc;
+}
+
+int main(void)
+{
+        /* Add new tests here */
+        static int (*const tests[])(void) = {
+                test_reserve,
+                test_dead_holder,
+                test_reused_pid,
+                test_wait
+        };
+        static const unsigned long nr_tests = sizeof(tests) / sizeof(tests[0]);
+        int result = 0;
+        unsigned long i;
+
+        if (make_pool() < 0) {
+                printf("ERROR: Failed to make a directory for the pool\n");
+                return 1;
+        }
+
+        for (i = 0UL; i < nr_tests; i++) {
+                if ((tests[i])() != 0)
+                        result = 1;
+        }
+
+        remove_pool();
+
+        return result;
+}
@@ -0,0 +1,340 @@
+#include "../common.h"
+#include <dirent.h>
+
+static int test_hash_buf(void)
+{
+        /* Reference values of XXH64 with zero seed */
+        static const struct {
+                const char *input;
+                unsigned long long x_hash;
+        } vectors[] = {
+                { "",    0xEF46DB3751D8E999ULL },
+                { "abc", 0x44BC2CF5AD770999ULL },
+                { "Nobody inspects the spammish repetition",
+                  0xFBCEA83C8A378BF1ULL },
+        };
+        unsigned long i;
+        int rc = 0;
+
+        printf("TEST: hash_buf\n");
+
+        for (i = 0UL; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+                unsigned long long hash;
+
+                hash = hash_buf(vectors[i].input,
+                                strlen(vectors[i].input),
+                                0ULL);
+
+                if (hash != vectors[i].x_hash) {
+                        printf("FAIL [Wrong hash of \"%s\"]\n"
+                               "    expected: %016llx\n"
+                               "      actual: %016llx\n",
+                               vectors[i].input,
+                               vectors[i].x_hash,
+                               hash);
+                        rc = 1;
+                }
+        }
+
+        if (rc == 0)
+                printf("PASS\n");
+
+        return rc;
+}
+
+static int check_file(const char *path,
+                      const char *x_data,
+                      unsigned long x_size)
+{
+        void *base;
+        unsigned long size;
+        int rc;
+
+        if (create_file_mapping(path, &base, &size) < 0) {
+                printf("FAIL [Cannot map %s]\n", path);
+                return 1;
+        }
+
+        rc = (size != x_size || memcmp(base, x_data, size) != 0);
+        if (rc)
+                printf("FAIL [Contents of %s mismatch]\n", path);
+
+        delete_file_mapping(base, size);
+
+        return rc;
+}
+
+static int count_files(const char *dir)
+{
+        struct dirent *de;
+        DIR *dp;
+        int n = 0;
+
+        if ((dp = opendir(dir)) == NULL)
+                return -1;
+
+        while ((de = readdir(dp)) != NULL)
+                if (strcmp(de->d_name, ".") != 0 &&
+                    strcmp(de->d_name, "..") != 0)
+                        n++;
+
+        closedir(dp);
+        return n;
+}
+
+static int test_store_and_install(void)
+{
+        static const char data[] = "int main(void) { return 0; }\n";
+        static const unsigned long size = sizeof(data) - 1UL;
+        static const unsigned long long key = 0x0123456789abcdefULL;
+        char dir[] = "/tmp/test-cache.XXXXXX";
+        char *entry = NULL, *found = NULL, *dest = NULL;
+        struct stat st_mem;
+        int round, may_link, rc = 1;
+
+        printf("TEST: cache_store & cache_install\n");
+
+        if (mkdtemp(dir) == NULL) {
+                printf("FAIL [mkdtemp]\n");
+                return 1;
+        }
+
+        if (cache_lookup(dir, key, ".pp") != NULL) {
+                printf("FAIL [Entry is found in empty cache]\n");
+                goto out;
+        }
+
+        if ((entry = cache_store(dir, key, ".pp", data, size)) == NULL) {
+                printf("FAIL [cache_store failed]\n");
+                goto out;
+        }
+
+        if ((found = cache_lookup(dir, key, ".pp")) == NULL ||
+            strcmp(found, entry) != 0) {
+                printf("FAIL [Stored entry is not found]\n");
+                goto out;
+        }
+
+        if (check_file(entry, data, size) != 0)
+                goto out;
+
+        if (stat(entry, &st_mem) < 0 ||
+            (st_mem.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0) {
+                printf("FAIL [Entry is writable]\n");
+                goto out;
+        }
+
+        dest = cache_entry_path(dir, 0ULL, ".dest");
+
+        /* Second round replaces the result of the first one,
+           the third one finds the same link in place */
+        for (round = 0; round < 3; round++) {
+                may_link = round > 0;
+                if (cache_install(entry, dest, may_link) < 0) {
+                        printf("FAIL [cache_install failed, may_link = %d]\n",
+                               may_link);
+                        goto out;
+                }
+
+                if (check_file(dest, data, size) != 0)
+                        goto out;
+
+                /* Copies belong to the build tree */
+                if (!may_link && access(dest, W_OK) < 0) {
+                        printf("FAIL [Copy of the entry is read-only]\n");
+                        goto out;
+                }
+        }
+
+        /* Temporary files are gone */
+        if (count_files(dir) != 2) {
+                printf("FAIL [Stray files are left in %s]\n", dir);
+                goto out;
+        }
+
+        printf("PASS\n");
+        rc = 0;
+
+out:
+        if (entry != NULL)
+                unlink(entry);
+        if (dest != NULL)
+                unlink(dest);
+        rmdir(dir);
+
+        xfree(entry);
+        xfree(found);
+        xfree(dest);
+
+        return rc;
+}
+
+static int test_cpp_cache(void)
+{
+        static const unsigned long long key = 0xfedcba9876543210ULL;
+        char dir[] = "/tmp/test-cache.XXXXXX";
+        char header[PATH_MAX], *data = NULL, *obuf = NULL, *path;
+        unsigned long size, osize = 0UL;
+        int fd, rc = 1;
+
+        printf("TEST: cpp_cache_store & cpp_cache_lookup\n");
+
+        if (mkdtemp(dir) == NULL) {
+                printf("FAIL [mkdtemp]\n");
+                return 1;
+        }
+
+        snprintf(header, sizeof(header), "%s/header.h", dir);
+        if ((fd = open(header, O_CREAT | O_WRONLY | O_EXCL, 0644)) < 0 ||
+            safe_write(fd, "int x;\n", 7UL) != 7L) {
+                printf("FAIL [Cannot create %s]\n", header);
+                goto out;
+        }
+        close(fd);
+
+        size = strlen(header) + 64UL;
+        data = text_alloc(size);
+        size = (unsigned long) snprintf(data, size,
+                                        "# 1 \"<built-in>\"\n"
+                                        "# 1 \"%s\" 1\n"
+                                        "int x;\n",
+                                        header);
+
+        /* The header is too fresh to be trusted */
+        if (cpp_cache_store(dir, key, data, size, time(NULL) - 60) == 0) {
+                printf("FAIL [Fresh file is stored]\n");
+                goto out;
+        }
+
+        if (cpp_cache_store(dir, key, data, size, time(NULL) + 60) < 0) {
+                printf("FAIL [cpp_cache_store failed]\n");
+                goto out;
+        }
+
+        if (cpp_cache_lookup(dir, key, &obuf, &osize) < 0 ||
+            osize != size || memcmp(obuf, data, size) != 0) {
+                printf("FAIL [Stored text is not found]\n");
+                goto out;
+        }
+
+        if ((fd = open(header, O_WRONLY | O_APPEND)) < 0 ||
+            safe_write(fd, "int y;\n", 7UL) != 7L) {
+                printf("FAIL [Cannot modify %s]\n", header);
+                goto out;
+        }
+        close(fd);
+
+        xfree(obuf); obuf = NULL;
+        if (cpp_cache_lookup(dir, key, &obuf, &osize) == 0) {
+                printf("FAIL [Modified header is not noticed]\n");
+                goto out;
+        }
+
+        printf("PASS\n");
+        rc = 0;
+
+out:
+        path = cache_entry_path(dir, key, ".cpp");
+        unlink(path);
+        xfree(path);
+        unlink(header);
+        rmdir(dir);
+
+        xfree(data);
+        xfree(obuf);
+
+        return rc;
+}
+
+/* Outputs depending on the time of the build are never stored */
+static int test_cpp_cache_time_macros(void)
+{
+        static const unsigned long long key = 0x0123456789abcdefULL;
+        static const char *const sources[] = {
+                "const char *t = __TIME__;\n",
+                "const char *d = __DATE__;\n",
+                "const char *s = __TIMESTAMP__;\n",
+        };
+        char dir[] = "/tmp/test-cache.XXXXXX";
+        char source[PATH_MAX], *data = NULL, *path;
+        unsigned long i, size;
+        int fd, rc = 1;
+
+        printf("TEST: cpp_cache_store of time-dependent output\n");
+
+        if (mkdtemp(dir) == NULL) {
+                printf("FAIL [mkdtemp]\n");
+                return 1;
+        }
+
+        snprintf(source, sizeof(source), "%s/source.c", dir);
+
+        size = strlen(source) + 64UL;
+        data = text_alloc(size);
+        size = (unsigned long) snprintf(data, size,
+                                        "# 1 \"%s\"\n"
+                                        "const char *t = \"22:59:40\";\n",
+                                        source);
+
+        for (i = 0UL; i < sizeof(sources) / sizeof(sources[0]); i++) {
+                unlink(source);
+                if ((fd = open(source, O_CREAT | O_WRONLY | O_EXCL, 0644)) < 0 ||
+                    safe_write(fd, sources[i], strlen(sources[i])) !=
+                    (long) strlen(sources[i])) {
+                        printf("FAIL [Cannot create %s]\n", source);
+                        if (fd >= 0)
+                                close(fd);
+                        goto out;
+                }
+                close(fd);
+
+                if (cpp_cache_store(dir, key, data, size,
+                                    time(NULL) + 60) == 0) {
+                        printf("FAIL [Output of \"%.*s\" is stored]\n",
+                               (int) strlen(sources[i]) - 1, sources[i]);
+                        goto out;
+                }
+        }
+
+        /* Without the macros, the same text is fine */
+        if (truncate(source, 0) < 0 ||
+            cpp_cache_store(dir, key, data, size, time(NULL) + 60) < 0) {
+                printf("FAIL [cpp_cache_store failed]\n");
+                goto out;
+        }
+
+        printf("PASS\n");
+        rc = 0;
+
+out:
+        path = cache_entry_path(dir, key, ".cpp");
+        unlink(path);
+        xfree(path);
+        unlink(source);
+        rmdir(dir);
+
+        xfree(data);
+
+        return rc;
+}
+
+int main(void)
+{
+        /* Add new tests here */
+        static int (*const tests[])(void) = {
+                test_hash_buf,
+                test_store_and_install,
+                test_cpp_cache,
+                test_cpp_cache_time_macros
+        };
+        static const unsigned long nr_tests = sizeof(tests) / sizeof(tests[0]);
+        int result = 0;
+        unsigned long i;
+
+        for (i = 0UL; i < nr_tests; i++) {
+                if ((tests[i])() != 0)
+                        result = 1;
+        }
+
+        return result;
+}
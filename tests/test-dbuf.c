@@ -56,6 +56,275 @@ static int check_dbuf_printf(dbuf_t *dbuf)
         return 1;
 }
 
+static int check_dbuf_reserve(dbuf_t *dbuf)
+{
+        char *base;
+        unsigned long i;
+
+        if (dbuf_reserve(dbuf, 10000UL) < 0 ||
+            dbuf->capacity != 10000UL) {
+                printf("ERROR: Reserve isn't exact\n"
+                       "Expected: %lu\n"
+                       "  Actual: %lu\n",
+                       10000UL, dbuf->capacity);
+                return 0;
+        }
+
+        base = dbuf->base;
+        for (i = 0UL; i < 10000UL; i++) {
+                if (dbuf_putc(dbuf, (int) (i & 0x7fUL)) < 0 ||
+                    dbuf->base != base) {
+                        printf("ERROR: Reserved buffer moved at %lu\n", i);
+                        return 0;
+                }
+        }
+
+        if (dbuf_reserve(dbuf, ULONG_MAX) == 0) {
+                printf("ERROR: Unexpected success "
+                       "in the test for UL overflow\n");
+                return 0;
+        }
+
+        dbuf_free(dbuf);
+        return 1;
+}
+
+static int check_dbuf_append(dbuf_t *dbuf)
+{
+        static const char span[] = "0123456789abcdef";
+        unsigned long i, size = sizeof(span) - 1UL;
+
+        for (i = 0UL; i < 1000UL; i++) {
+                if (dbuf_append(dbuf, span, size) < 0) {
+                        printf("ERROR: Failed to append span #%lu\n", i);
+                        return 0;
+                }
+        }
+
+        if ((unsigned long) (dbuf->pos - dbuf->base) != size * 1000UL) {
+                printf("ERROR: Wrong size after append\n"
+                       "Expected: %lu\n"
+                       "  Actual: %lu\n",
+                       size * 1000UL,
+                       (unsigned long) (dbuf->pos - dbuf->base));
+                return 0;
+        }
+
+        for (i = 0UL; i < 1000UL; i++) {
+                if (memcmp(dbuf->base + i * size, span, size) != 0) {
+                        printf("ERROR: Span #%lu is corrupted\n", i);
+                        return 0;
+                }
+        }
+
+        dbuf_free(dbuf);
+        return 1;
+}
+
+static int check_dbuf_growth(dbuf_t *dbuf)
+{
+        static const unsigned long max_step = 4096UL;
+        unsigned long prev = dbuf->capacity, i;
+
+        dbuf_set_growth(dbuf, max_step);
+
+        for (i = 0UL; i < 100000UL; i++) {
+                if (dbuf_putc(dbuf, 'x') < 0)
+                        return 0;
+
+                if (dbuf->capacity != prev) {
+                        /* Doubling up to @max_step, then linear */
+                        if (dbuf->capacity != prev * 2UL &&
+                            !(prev >= max_step &&
+                              dbuf->capacity == prev + max_step)) {
+                                printf("ERROR: Capacity %lu grows to %lu\n",
+                                       prev, dbuf->capacity);
+                                return 0;
+                        }
+                        prev = dbuf->capacity;
+                }
+        }
+
+        dbuf_free(dbuf);
+        dbuf_set_growth(dbuf, 0UL);
+        return 1;
+}
+
+static int check_dbuf_shrink(dbuf_t *dbuf)
+{
+        if (dbuf_reserve(dbuf, 1000UL) < 0 ||
+            dbuf_append(dbuf, "abc", 3UL) < 0)
+                return 0;
+
+        /* Small content goes back to the internal buffer */
+        dbuf_shrink_to_fit(dbuf);
+        if (!(dbuf->base == dbuf->internal_buf &&
+              dbuf->pos == dbuf->base + 3UL &&
+              dbuf->capacity == init_capacity &&
+              memcmp(dbuf->base, "abc", 3UL) == 0)) {
+                printf("ERROR: Wrong state after shrinking small buffer\n");
+                return 0;
+        }
+
+        if (dbuf_reserve(dbuf, 10000UL) < 0 ||
+            dbuf_alloc(dbuf, 1000UL) == NULL)
+                return 0;
+        memset(dbuf->pos, 'y', 1000UL);
+        dbuf->pos += 1000UL;
+
+        dbuf_shrink_to_fit(dbuf);
+        if (!(dbuf->base != dbuf->internal_buf &&
+              dbuf->pos == dbuf->base + 1003UL &&
+              dbuf->capacity == 1003UL &&
+              memcmp(dbuf->base, "abcyyy", 6UL) == 0)) {
+                printf("ERROR: Wrong state after shrinking large buffer\n");
+                return 0;
+        }
+
+        dbuf_free(dbuf);
+        return 1;
+}
+
+static int check_dbuf_steal(dbuf_t *dbuf)
+{
+        dbuf_t src_mem, *const src = &src_mem;
+        char *base;
+
+        dbuf_init(src);
+
+        /* Heap content changes hands */
+        if (dbuf_append(dbuf, "old", 3UL) < 0 ||
+            dbuf_reserve(src, 1000UL) < 0 ||
+            dbuf_append(src, "heap", 4UL) < 0)
+                return 0;
+        base = src->base;
+
+        dbuf_steal(dbuf, src);
+        if (!(dbuf->base == base &&
+              dbuf->pos == base + 4UL &&
+              dbuf->capacity == 1000UL &&
+              check_init_state(src))) {
+                printf("ERROR: Wrong state after stealing heap buffer\n");
+                return 0;
+        }
+
+        /* Internal content is copied */
+        if (dbuf_append(src, "internal", 8UL) < 0)
+                return 0;
+
+        dbuf_steal(dbuf, src);
+        if (!(dbuf->base == dbuf->internal_buf &&
+              dbuf->pos == dbuf->base + 8UL &&
+              memcmp(dbuf->base, "internal", 8UL) == 0 &&
+              check_init_state(src))) {
+                printf("ERROR: Wrong state after stealing internal buffer\n");
+                return 0;
+        }
+
+        dbuf_free(dbuf);
+        dbuf_free(src);
+        return 1;
+}
+
+/* The file grows along with the buffer and gets its final size */
+static int check_dbuf_map_file(dbuf_t *dbuf)
+{
+        static const char span[] = "mapped\n";
+        unsigned long i, size = sizeof(span) - 1UL;
+        struct stat st_mem;
+        FILE *file;
+        char *data;
+        int fd, rc = 0;
+
+        if ((file = tmpfile()) == NULL)
+                return 0;
+        fd = fileno(file);
+
+        if (dbuf_map_file(dbuf, fd, 16UL) < 0) {
+                printf("ERROR: Failed to map file\n");
+                fclose(file);
+                return 0;
+        }
+
+        for (i = 0UL; i < 10000UL; i++) {
+                if (dbuf_append(dbuf, span, size) < 0) {
+                        printf("ERROR: Failed to append span #%lu to file\n", i);
+                        goto out;
+                }
+        }
+
+        if (dbuf_unmap_file(dbuf) < 0 || !check_init_state(dbuf)) {
+                printf("ERROR: Wrong state after unmapping file\n");
+                goto out;
+        }
+
+        if (fstat(fd, &st_mem) < 0 ||
+            (unsigned long) st_mem.st_size != size * 10000UL) {
+                printf("ERROR: Wrong file size\n"
+                       "Expected: %lu\n"
+                       "  Actual: %ld\n",
+                       size * 10000UL, (long) st_mem.st_size);
+                goto out;
+        }
+
+        data = mmap(NULL, size * 10000UL, PROT_READ, MAP_PRIVATE, fd, 0L);
+        if (data == MAP_FAILED)
+                goto out;
+
+        for (i = 0UL; i < 10000UL; i++) {
+                if (memcmp(data + i * size, span, size) != 0) {
+                        printf("ERROR: Span #%lu of file is corrupted\n", i);
+                        break;
+                }
+        }
+        rc = (i == 10000UL);
+        munmap(data, size * 10000UL);
+
+out:
+        dbuf_free(dbuf);
+        fclose(file);
+        return rc;
+}
+
+/* Past the limit the content moves to a file, then keeps growing there */
+static int check_dbuf_spill(dbuf_t *dbuf)
+{
+        static const char span[] = "spilled\n";
+        unsigned long i, size = sizeof(span) - 1UL;
+        int fd, rc = 0;
+
+        dbuf_set_spill(dbuf, 4096UL);
+
+        for (i = 0UL; i < 10000UL; i++) {
+                if (dbuf_append(dbuf, span, size) < 0) {
+                        printf("ERROR: Failed to append span #%lu\n", i);
+                        goto out;
+                }
+        }
+
+        if (dbuf->fd < 0 || dbuf->capacity < size * 10000UL ||
+            (unsigned long) (dbuf->pos - dbuf->base) != size * 10000UL) {
+                printf("ERROR: Content hasn't spilled to a file\n");
+                goto out;
+        }
+
+        for (i = 0UL; i < 10000UL; i++) {
+                if (memcmp(dbuf->base + i * size, span, size) != 0) {
+                        printf("ERROR: Span #%lu of spilled content is corrupted\n", i);
+                        break;
+                }
+        }
+        rc = (i == 10000UL);
+
+out:
+        fd = dbuf->fd;
+        dbuf_free(dbuf);
+        if (fd >= 0)
+                close(fd);
+        dbuf_set_spill(dbuf, 0UL);
+        return rc;
+}
+
 int main(void)
 {
         dbuf_t dbuf_mem, *const dbuf = &dbuf_mem;
@@ -124,6 +393,17 @@ int main(void)
 
         if (!check_dbuf_printf(dbuf))
                 return 1;
+
+        dbuf_free(dbuf);
+
+        if (!check_dbuf_reserve(dbuf) ||
+            !check_dbuf_append(dbuf) ||
+            !check_dbuf_growth(dbuf) ||
+            !check_dbuf_shrink(dbuf) ||
+            !check_dbuf_steal(dbuf) ||
+            !check_dbuf_map_file(dbuf) ||
+            !check_dbuf_spill(dbuf))
+                return 1;
         
         dbuf_free(dbuf);
 
@@ -135,8 +135,55 @@ static int precheck(void)
                 size_4 == size_5);
 }
 
+/* Interned names must match the allocated ones */
+static int check_interned(name_table_t *names,
+                          const char *input,
+                          const char *x_filename)
+{
+        const char *limit = input + strlen(input), *nxt = NULL;
+        const char *filename;
+        linemarker_t lm_mem;
+
+        memset(&lm_mem, 0, sizeof(lm_mem));
+
+        if (read_linemarker_id(input, limit, names, &lm_mem, &nxt) < 0 ||
+            nxt != limit ||
+            (filename = name_table_get(names, lm_mem.file_id)) == NULL ||
+            strcmp(filename, x_filename) != 0) {
+                printf("ERROR: Wrong interned filename for the following test:\n"
+                       "    %s\n"
+                       "Expected: %s\n",
+                       input, x_filename);
+                return 1;
+        }
+
+        return 0;
+}
+
+/* Each distinct filename is interned once */
+static unsigned long count_distinct(void)
+{
+        unsigned long i, j, nr_distinct = 0UL;
+
+        for (i = 0UL; i < sizeof(inputs_) / sizeof(inputs_[0]); i++) {
+                if (x_retvals_[i] < 0)
+                        continue;
+
+                for (j = 0UL;
+                     j < i && (x_retvals_[j] < 0 ||
+                               strcmp(x_filenames_[j], x_filenames_[i]) != 0);
+                     j++) ;
+
+                if (j == i)
+                        nr_distinct++;
+        }
+
+        return nr_distinct;
+}
+
 int main(void)
 {
+        name_table_t names_mem, *const names = &names_mem;
         int result = 0;
         unsigned long i;
 
@@ -145,16 +192,22 @@ int main(void)
                 return 1;
         }
 
+        name_table_init(names);
+
         for (i = 0UL;
              i < sizeof(inputs_) / sizeof(inputs_[0]);
              i++) {
                 const char *input, *x_filename;
+                char *text;
                 int x_retval, retval;
                 unsigned long x_linenum, x_info;
                 const char *limit, *nxt;
                 linemarker_t lm_mem;
 
-                input      = inputs_[i];
+                /* Parsers take padded text */
+                text       = text_alloc(strlen(inputs_[i]));
+                memcpy(text, inputs_[i], strlen(inputs_[i]));
+                input      = text;
                 x_retval   = x_retvals_[i];
                 x_linenum  = x_linenums_[i];
                 x_filename = x_filenames_[i];
@@ -165,7 +218,7 @@ int main(void)
 
                 memset(&lm_mem, 0, sizeof(lm_mem));
 
-                retval = read_linemarker(input, limit, &lm_mem, &nxt);
+                retval = read_linemarker(input, limit, NULL, &lm_mem, &nxt);
 
                 if (retval != x_retval) {
                         printf("ERROR: Wrong retval for the following test:\n"
@@ -223,6 +276,11 @@ int main(void)
                         goto next;
                 }
 
+                if (check_interned(names, input, x_filename) != 0) {
+                        result = 1;
+                        goto next;
+                }
+
                 printf("PASS: %s\n"
                        "          (linenum, filename, info)\n"
                        "Expected: (%lu, %s, 0x%lx)\n"
@@ -234,8 +292,19 @@ int main(void)
         next:
                 if (retval == 0)
                         xfree(lm_mem.filename);
+                xfree(text);
         }
 
+        if (name_table_size(names) != count_distinct()) {
+                printf("ERROR: Wrong number of interned filenames\n"
+                       "Expected: %lu\n"
+                       "  Actual: %lu\n",
+                       count_distinct(), name_table_size(names));
+                result = 1;
+        }
+
+        name_table_free(names);
+
         if (result)
                 printf("Some tests were failed. See logs above\n");
         else
@@ -1,4 +1,5 @@
 #include "../common.h"
+#include <time.h>
 
 static char **dup_argv(const char *const *argv,
                        unsigned long argc)
@@ -168,6 +169,88 @@ static int test_with_cat(void)
         return rc;
 }
 
+/* Both stdin and stdout of the child are files:
+   no pipes, nothing passes through the parent */
+static int test_with_files(void)
+{
+        static const char *const argv[] = {
+                "cat",
+                "-"
+        };
+        static const unsigned long argc = sizeof(argv) / sizeof(argv[0UL]);
+        static const int backends[] = { SPAWN_FORK, SPAWN_POSIX };
+
+        char **copy, *ibuf, *obuf;
+        child_ctx_t ctx_mem;
+        const unsigned long isize = 1UL << 20UL;
+        unsigned long i;
+        struct stat st_mem;
+        int rc = 0, ifd, ofd;
+
+        print_test_header(argv, argc);
+
+        if ((copy = dup_argv(argv, argc)) == NULL) {
+                printf("FAIL [Failed to locate \"%s\"]\n",
+                       argv[0]);
+
+                return 1;
+        }
+
+        ibuf = xmalloc(isize);
+        obuf = xmalloc(isize);
+        for (i = 0UL; i < isize; i++)
+                ibuf[i] = (char) ('a' + i % 26UL);
+
+        for (i = 0UL; rc == 0 && i < sizeof(backends) / sizeof(backends[0]); i++) {
+                ifd = memfd_create("test-in", MFD_CLOEXEC);
+                ofd = memfd_create("test-out", MFD_CLOEXEC);
+
+                if (ifd < 0 || ofd < 0 ||
+                    safe_write(ifd, ibuf, isize) != (long) isize ||
+                    lseek(ifd, 0L, SEEK_SET) != 0L) {
+                        printf("FAIL [Failed to make memfd]\n");
+                        rc = 1;
+                        goto next;
+                }
+
+                memset(&ctx_mem, 0, sizeof(ctx_mem));
+                ctx_mem.argv = copy;
+                ctx_mem.flags = IO_TO_FD | IO_FROM_FD;
+                ctx_mem.ifd = ifd;
+                ctx_mem.ofd = ofd;
+                ctx_mem.spawn = backends[i];
+
+                if (run_cmd(&ctx_mem) < 0) {
+                        printf("FAIL [API run_cmd failed]\n");
+                        rc = 1;
+                        goto next;
+                }
+
+                /* Our descriptors are left open */
+                if (fstat(ofd, &st_mem) < 0 ||
+                    (unsigned long) st_mem.st_size != isize ||
+                    pread(ofd, obuf, isize, 0L) != (long) isize ||
+                    memcmp(obuf, ibuf, isize) != 0) {
+                        printf("FAIL [Contents of files mismatch]\n");
+                        rc = 1;
+                }
+
+        next:
+                if (ifd >= 0)
+                        close(ifd);
+                if (ofd >= 0)
+                        close(ofd);
+        }
+
+        if (rc == 0)
+                printf("PASS\n");
+
+        xfree(obuf);
+        xfree(ibuf);
+        free_argv(copy, argc);
+        return rc;
+}
+
 static int test_with_sh(void)
 {
         static const char *const argv[] = {
@@ -373,15 +456,444 @@ static int test_with_false(void)
         return 0;
 }
 
+static double elapsed_sec(const struct timespec *start)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (double) (now.tv_sec - start->tv_sec) +
+               (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int test_large_output(void)
+{
+        static const char *const argv[] = {
+                "head",
+                "-c",
+                "268435456",
+                "/dev/zero"
+        };
+        static const unsigned long argc = sizeof(argv) / sizeof(argv[0UL]);
+        static const unsigned long x_osize = 256UL << 20UL;
+
+        char **copy;
+        child_ctx_t ctx_mem;
+        char *obuf = NULL; /* Data from child. */
+        unsigned long i, osize = 0UL; /* Size of such data. */
+        struct timespec start;
+        double elapsed;
+        int rc;
+
+        print_test_header(argv, argc);
+
+        if ((copy = dup_argv(argv, argc)) == NULL) {
+                printf("FAIL [Failed to locate \"%s\"]\n",
+                       argv[0]);
+
+                return 1;
+        }
+
+        memset(&ctx_mem, 0, sizeof(ctx_mem));
+        ctx_mem.argv = copy;
+        ctx_mem.flags = IO_FROM;
+        ctx_mem.obuf_p = &obuf;
+        ctx_mem.osize_p = &osize;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (run_cmd(&ctx_mem) < 0 || obuf == NULL) {
+                printf("FAIL [API run_cmd failed]\n");
+
+                free_argv(copy, argc);
+                return 1;
+        }
+
+        elapsed = elapsed_sec(&start);
+
+        for (i = 0UL; i < osize && obuf[i] == '\0'; i++) ;
+
+        rc = (osize != x_osize || i != osize);
+
+        if (rc) {
+                printf("FAIL [Unexpected output]\n"
+                       "    expected: %lu zero bytes\n"
+                       "      actual: %lu bytes, first non-zero at %lu\n",
+                       x_osize, osize, i);
+        } else {
+                printf("PASS [%lu MiB in %.3f s, %.1f MiB/s]\n",
+                       osize >> 20UL, elapsed,
+                       elapsed > 0.0 ? (double) (osize >> 20UL) / elapsed : 0.0);
+        }
+
+        xfree(obuf);
+        free_argv(copy, argc);
+        return rc;
+}
+
+/* Output past the limit ends up in a file instead of the heap */
+static int test_spilled_output(void)
+{
+        static const char *const argv[] = {
+                "head",
+                "-c",
+                "16777216",
+                "/dev/zero"
+        };
+        static const unsigned long argc = sizeof(argv) / sizeof(argv[0UL]);
+        static const unsigned long x_osize = 16UL << 20UL;
+
+        char **copy;
+        child_ctx_t ctx_mem;
+        char *obuf = NULL; /* Data from child. */
+        unsigned long osize = 0UL; /* Size of such data. */
+        struct stat st_mem;
+        int rc, ofd = -1;
+
+        print_test_header(argv, argc);
+
+        if ((copy = dup_argv(argv, argc)) == NULL) {
+                printf("FAIL [Failed to locate \"%s\"]\n",
+                       argv[0]);
+
+                return 1;
+        }
+
+        memset(&ctx_mem, 0, sizeof(ctx_mem));
+        ctx_mem.argv = copy;
+        ctx_mem.flags = IO_FROM;
+        ctx_mem.obuf_p = &obuf;
+        ctx_mem.osize_p = &osize;
+        ctx_mem.spill_size = 1UL << 20UL;
+        ctx_mem.ofd_p = &ofd;
+
+        if (run_cmd(&ctx_mem) < 0) {
+                printf("FAIL [API run_cmd failed]\n");
+
+                free_argv(copy, argc);
+                return 1;
+        }
+
+        rc = (obuf != NULL || ofd < 0 || osize != x_osize ||
+              fstat(ofd, &st_mem) < 0 ||
+              (unsigned long) st_mem.st_size != x_osize);
+
+        if (rc)
+                printf("FAIL [Output hasn't spilled]\n"
+                       "    expected: file of %lu bytes\n"
+                       "      actual: buffer %p, file %d of %lu bytes\n",
+                       x_osize, (void *) obuf, ofd, osize);
+        else
+                printf("PASS\n");
+
+        if (ofd >= 0)
+                close(ofd);
+        xfree(obuf);
+        free_argv(copy, argc);
+        return rc;
+}
+
+/* Feeds the child with and without splicing of our pages */
+static int test_large_input(void)
+{
+        static const char *const argv[] = {
+                "wc",
+                "-c"
+        };
+        static const unsigned long argc = sizeof(argv) / sizeof(argv[0UL]);
+        static const unsigned long isize = 256UL << 20UL;
+        static const char *const modes[] = {
+                "vmsplice",
+                "write",
+                "io_uring"
+        };
+
+        char **copy, *ibuf;
+        child_ctx_t ctx_mem;
+        char *obuf; /* Data from child. */
+        unsigned long i, osize; /* Size of such data. */
+        struct timespec start;
+        double elapsed;
+        int rc = 0;
+
+        print_test_header(argv, argc);
+
+        if ((copy = dup_argv(argv, argc)) == NULL) {
+                printf("FAIL [Failed to locate \"%s\"]\n",
+                       argv[0]);
+
+                return 1;
+        }
+
+        ibuf = xmalloc(isize);
+        memset(ibuf, 'x', isize);
+
+        for (i = 0UL; rc == 0 && i < sizeof(modes) / sizeof(modes[0]); i++) {
+                if (i == 0UL)
+                        setenv("X_VMSPLICE", "1", 1);
+                else
+                        unsetenv("X_VMSPLICE");
+
+                if (i == 2UL)
+                        setenv("X_IO_URING", "1", 1);
+
+                obuf = NULL;
+                osize = 0UL;
+
+                memset(&ctx_mem, 0, sizeof(ctx_mem));
+                ctx_mem.argv = copy;
+                ctx_mem.flags = IO_BOTH;
+                ctx_mem.ibuf = ibuf;
+                ctx_mem.isize = isize;
+                ctx_mem.obuf_p = &obuf;
+                ctx_mem.osize_p = &osize;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+
+                if (run_cmd(&ctx_mem) < 0 || obuf == NULL) {
+                        printf("FAIL [API run_cmd failed]\n");
+                        rc = 1;
+                        break;
+                }
+
+                elapsed = elapsed_sec(&start);
+
+                if (strtoul(obuf, NULL, 10) != isize) {
+                        printf("FAIL [Unexpected output]\n"
+                               "    expected: %lu\n"
+                               "      actual: %s\n",
+                               isize, obuf);
+                        rc = 1;
+                } else {
+                        printf("PASS [%s: %lu MiB in %.3f s, %.1f MiB/s]\n",
+                               modes[i], isize >> 20UL, elapsed,
+                               elapsed > 0.0 ? (double) (isize >> 20UL) / elapsed : 0.0);
+                }
+
+                xfree(obuf);
+        }
+
+        unsetenv("X_VMSPLICE");
+        unsetenv("X_IO_URING");
+        xfree(ibuf);
+        free_argv(copy, argc);
+        return rc;
+}
+
+/* Several children driven at once by either backend:
+   each one echoes its own input */
+static int test_drive_cmds(void)
+{
+        static const char *const argv[] = {
+                "cat",
+                "-"
+        };
+        static const unsigned long argc = sizeof(argv) / sizeof(argv[0UL]);
+        static const unsigned long isizes[] = {
+                0UL,
+                1UL,
+                4096UL,
+                (1UL << 20UL) + 7UL,
+                16UL << 20UL
+        };
+        enum { nr_ios = sizeof(isizes) / sizeof(isizes[0]) };
+        static const char *const backends[] = {
+                "poll",
+                "io_uring"
+        };
+
+        char **copy, *ibufs[nr_ios];
+        child_ctx_t ctx_mem;
+        child_t children[nr_ios];
+        child_io_t ios[nr_ios];
+        dbuf_t obufs[nr_ios];
+        unsigned long i, j, osize;
+        struct timespec start;
+        double elapsed;
+        int rc = 0;
+
+        print_test_header(argv, argc);
+
+        if ((copy = dup_argv(argv, argc)) == NULL) {
+                printf("FAIL [Failed to locate \"%s\"]\n",
+                       argv[0]);
+
+                return 1;
+        }
+
+        for (j = 0UL; j < nr_ios; j++) {
+                ibufs[j] = xmalloc(isizes[j] + 1UL);
+                for (i = 0UL; i < isizes[j]; i++)
+                        ibufs[j][i] = (char) ('a' + (i + j) % 26UL);
+        }
+
+        for (i = 0UL; rc == 0 && i < sizeof(backends) / sizeof(backends[0]); i++) {
+                if (i == 1UL)
+                        setenv("X_IO_URING", "1", 1);
+
+                memset(&ctx_mem, 0, sizeof(ctx_mem));
+                ctx_mem.argv = copy;
+                ctx_mem.flags = IO_BOTH;
+
+                for (j = 0UL; j < nr_ios; j++) {
+                        dbuf_init(&obufs[j]);
+                        ios[j].child = &children[j];
+                        ios[j].ibuf = ibufs[j];
+                        ios[j].isize = isizes[j];
+                        ios[j].obuf = &obufs[j];
+
+                        if (start_cmd(&ctx_mem, &children[j]) < 0) {
+                                printf("FAIL [API start_cmd failed]\n");
+                                rc = 1;
+                        }
+                }
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+
+                if (rc == 0 && drive_cmds(ios, nr_ios) < 0) {
+                        printf("FAIL [API drive_cmds failed]\n");
+                        rc = 1;
+                }
+
+                elapsed = elapsed_sec(&start);
+
+                for (j = 0UL; j < nr_ios; j++) {
+                        osize = (unsigned long) (obufs[j].pos - obufs[j].base);
+
+                        if (rc == 0 &&
+                            (ios[j].status != 0 || osize != isizes[j] ||
+                             memcmp(obufs[j].base, ibufs[j], osize) != 0)) {
+                                printf("FAIL [%s: output of child %lu mismatches]\n"
+                                       "    expected: %lu bytes\n"
+                                       "      actual: %lu bytes, status %d\n",
+                                       backends[i], j, isizes[j],
+                                       osize, ios[j].status);
+                                rc = 1;
+                        }
+
+                        if (rc != 0)
+                                kill_cmd(&children[j], SIGKILL);
+                        dbuf_free(&obufs[j]);
+                }
+
+                if (rc == 0)
+                        printf("PASS [%s: %lu children in %.3f s]\n",
+                               backends[i], (unsigned long) nr_ios, elapsed);
+        }
+
+        unsetenv("X_IO_URING");
+
+        for (j = 0UL; j < nr_ios; j++)
+                xfree(ibufs[j]);
+        free_argv(copy, argc);
+        return rc;
+}
+
+/* Not a correctness test: shows how the cost of starting a child
+   depends on the amount of memory held by the parent. */
+static int test_spawn_backends(void)
+{
+        static const char *const argv[] = {
+                "true"
+        };
+        static const unsigned long argc = sizeof(argv) / sizeof(argv[0UL]);
+        static const unsigned long heap_sizes[] = {
+                0UL,
+                16UL << 20UL,
+                128UL << 20UL,
+                512UL << 20UL,
+        };
+        static const struct {
+                const char *name;
+                int spawn;
+        } backends[] = {
+                { "fork",        SPAWN_FORK },
+                { "posix_spawn", SPAWN_POSIX },
+        };
+        static const unsigned long nr_runs = 20UL;
+
+        char **copy;
+        child_ctx_t ctx_mem;
+        unsigned long i, j, k;
+        int rc = 0;
+
+        print_test_header(argv, argc);
+
+        if ((copy = dup_argv(argv, argc)) == NULL) {
+                printf("FAIL [Failed to locate \"%s\"]\n",
+                       argv[0]);
+
+                return 1;
+        }
+
+        memset(&ctx_mem, 0, sizeof(ctx_mem));
+        ctx_mem.argv = copy;
+        ctx_mem.flags = IO_NONE;
+
+        for (i = 0UL;
+             i < sizeof(heap_sizes) / sizeof(heap_sizes[0]);
+             i++) {
+                char *heap = NULL;
+
+                /* The memory must be touched to get page table entries */
+                if (heap_sizes[i] > 0UL) {
+                        heap = xmalloc(heap_sizes[i]);
+                        memset(heap, 'X', heap_sizes[i]);
+                }
+
+                for (j = 0UL;
+                     j < sizeof(backends) / sizeof(backends[0]);
+                     j++) {
+                        struct timespec start;
+                        double elapsed;
+
+                        ctx_mem.spawn = backends[j].spawn;
+
+                        clock_gettime(CLOCK_MONOTONIC, &start);
+
+                        for (k = 0UL; k < nr_runs; k++) {
+                                if (run_cmd(&ctx_mem) < 0) {
+                                        printf("FAIL [API run_cmd failed "
+                                               "with %s backend]\n",
+                                               backends[j].name);
+                                        rc = 1;
+                                        break;
+                                }
+                        }
+
+                        elapsed = elapsed_sec(&start);
+
+                        printf("    heap %4lu MiB, %-11s: %8.1f us per child\n",
+                               heap_sizes[i] >> 20UL,
+                               backends[j].name,
+                               elapsed * 1e6 / (double) nr_runs);
+                }
+
+                xfree(heap);
+        }
+
+        if (rc == 0)
+                printf("PASS\n");
+
+        free_argv(copy, argc);
+        return rc;
+}
+
 int main(void)
 {
         /* Add new tests here */
         static int (*const tests[])(void) = {
                 test_with_cat,
+                test_with_files,
                 test_with_sh,
                 test_with_stdio_h,
                 test_with_true,
-                test_with_false
+                test_with_false,
+                test_large_output,
+                test_spilled_output,
+                test_large_input,
+                test_drive_cmds,
+                test_spawn_backends
         };
         static const unsigned long nr_tests = sizeof(tests) / sizeof(tests[0]);
         int result = 0;
@@ -0,0 +1,406 @@
+#include "../common.h"
+
+static double elapsed_sec(const struct timespec *start)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (double) (now.tv_sec - start->tv_sec) +
+               (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Straightforward version of scan_plain */
+static const char *x_scan_plain(const char *chp,
+                                const char *const limit,
+                                unsigned long *nr_nl_p)
+{
+        for (; chp < limit && *chp != '#'; chp++) {
+                if (*chp == '\n')
+                        (*nr_nl_p)++;
+        }
+
+        return chp;
+}
+
+/* Random buffers of mostly newlines and '#' at every offset
+   and length cover all block boundaries of vectorized scanners */
+static int test_scan_plain(void)
+{
+        static const char alphabet[] = "\n\n\n#abc \t\"";
+        static const unsigned long max_size = 200UL;
+        char *buf;
+        unsigned long size, start, i, round;
+        int rc = 0;
+
+        printf("TEST: scan_plain\n");
+
+        buf = xmalloc(max_size);
+        srand(1);
+
+        for (round = 0UL; round < 2000UL && rc == 0; round++) {
+                /* Rare '#' makes long runs without one */
+                for (i = 0UL; i < max_size; i++) {
+                        buf[i] = alphabet[(unsigned long) rand() %
+                                          (sizeof(alphabet) - 1UL)];
+                        if (buf[i] == '#' && rand() % 8 != 0)
+                                buf[i] = '\n';
+                }
+
+                size = (unsigned long) rand() % max_size;
+                start = (unsigned long) rand() % (size + 1UL);
+
+                {
+                        const char *limit = buf + size;
+                        const char *x_res, *res;
+                        unsigned long x_nr_nl = 0UL, nr_nl = 0UL;
+
+                        x_res = x_scan_plain(buf + start, limit, &x_nr_nl);
+                        res = scan_plain(buf + start, limit, &nr_nl);
+
+                        if (x_res != res || x_nr_nl != nr_nl) {
+                                printf("FAIL [Mismatch on [%lu, %lu)]\n"
+                                       "    expected: stop at %ld, %lu newlines\n"
+                                       "      actual: stop at %ld, %lu newlines\n",
+                                       start, size,
+                                       (long) (x_res - buf), x_nr_nl,
+                                       (long) (res - buf), nr_nl);
+                                rc = 1;
+                        }
+                }
+        }
+
+        if (rc == 0)
+                printf("PASS\n");
+
+        xfree(buf);
+        return rc;
+}
+
+/* Bulk copying must not change the result:
+   only lines starting with '#' may be linemarkers */
+static int test_process_linemarkers(void)
+{
+        static const char input[] =
+                "# 1 \"a.c\"\n"
+                "int a; /* # not a marker */\n"
+                "\n"
+                "  # 7 \"a.c\"\n"
+                "int b;\n"
+                "#pragma once\n"
+                "int c; int d; int e; int f; int g; int h; int i;\n"
+                "# 5 \"a.c\"\n"
+                "int j;";
+        /* Backward marker joins the lines after the forward one */
+        static const char x_output[] =
+                "int a; /* # not a marker */  "
+                "int b; "
+                "#pragma once "
+                "int c; int d; int e; int f; int g; int h; int i; "
+                "int j;";
+        dbuf_t *output;
+        char *text;
+        unsigned long size;
+        int rc;
+
+        printf("TEST: process_linemarkers\n");
+
+        text = text_alloc(sizeof(input) - 1UL);
+        memcpy(text, input, sizeof(input) - 1UL);
+        output = process_linemarkers(text, sizeof(input) - 1UL);
+        xfree(text);
+
+        if (output == NULL) {
+                printf("FAIL [process_linemarkers failed]\n");
+                return 1;
+        }
+
+        size = (unsigned long) (output->pos - output->base);
+        rc = (size != sizeof(x_output) - 1UL ||
+              memcmp(output->base, x_output, size) != 0);
+
+        if (rc)
+                printf("FAIL [Unexpected output]\n"
+                       "    expected: \"%s\"\n"
+                       "      actual: \"%.*s\"\n",
+                       x_output, (int) size, output->base);
+        else
+                printf("PASS\n");
+
+        dbuf_free(output);
+        xfree(output);
+        return rc;
+}
+
+/* Pathological input: 100k markers going far back, each after
+   a single line. Every one of them may strip all preceding lines
+   of the file, but only one newline is left to strip. */
+static int test_backward_markers(void)
+{
+        static const unsigned long nr_markers = 100000UL;
+        dbuf_t input_mem, *const input = &input_mem, *output;
+        struct timespec start;
+        unsigned long i, size, nr_nl = 0UL;
+        double elapsed;
+        int rc = 0;
+
+        printf("TEST: backward linemarkers\n");
+
+        dbuf_init(input);
+
+        rc |= dbuf_printf(input, "# 1 \"gen.c\"\n") < 0;
+        for (i = 0UL; i < nr_markers && rc == 0; i++)
+                rc |= dbuf_printf(input,
+                                  "# 1000000 \"gen.c\"\n"
+                                  "int x%lu;\n"
+                                  "# 1 \"gen.c\"\n",
+                                  i) < 0;
+
+        if (rc || dbuf_terminate(input) < 0) {
+                printf("FAIL [Failed to make input]\n");
+                dbuf_free(input);
+                return 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        output = process_linemarkers(input->base,
+                                     (unsigned long) (input->pos - input->base));
+        elapsed = elapsed_sec(&start);
+
+        if (output == NULL) {
+                printf("FAIL [process_linemarkers failed]\n");
+                dbuf_free(input);
+                return 1;
+        }
+
+        /* All lines are joined */
+        size = (unsigned long) (output->pos - output->base);
+        for (i = 0UL; i < size; i++)
+                nr_nl += (output->base[i] == '\n');
+
+        if (nr_nl != 0UL || output->base[size - 1UL] != ' ') {
+                printf("FAIL [%lu newlines are left]\n", nr_nl);
+                rc = 1;
+        } else {
+                printf("PASS [%lu markers in %.3f s]\n",
+                       nr_markers * 2UL, elapsed);
+        }
+
+        dbuf_free(output);
+        xfree(output);
+        dbuf_free(input);
+        return rc;
+}
+
+/* Bytes adjust_style doesn't copy as is */
+static int x_is_special(char ch)
+{
+        return ch == '\0' || ch == ' '  || ch == '\t' || ch == '\n' ||
+               ch == '\v' || ch == '\f' || ch == '\r' || ch == '/'  ||
+               ch == ';'  || ch == '{'  || ch == '}'  || ch == '('  ||
+               ch == ')'  || ch == '"'  || ch == '\'';
+}
+
+/* Every byte value at every offset of a 64-byte window
+   with every start and limit around it */
+static int test_scan_special(void)
+{
+        static const unsigned long window = 64UL;
+        char buf[64];
+        unsigned long pos, start, end;
+        int byte, rc = 0;
+
+        printf("TEST: scan_special\n");
+
+        for (byte = 0; byte < 256 && rc == 0; byte++) {
+                for (pos = 0UL; pos < window; pos++) {
+                        memset(buf, 'a', window);
+                        buf[pos] = (char) byte;
+
+                        for (start = 0UL; start <= pos; start++) {
+                                for (end = pos; end <= window; end++) {
+                                        const char *limit = buf + end;
+                                        const char *x_res, *res;
+
+                                        for (x_res = buf + start;
+                                             x_res < limit && !x_is_special(*x_res);
+                                             x_res++) ;
+                                        res = scan_special(buf + start, limit);
+
+                                        if (x_res != res) {
+                                                printf("FAIL [0x%02x at %lu, [%lu, %lu)]\n"
+                                                       "    expected: %ld\n"
+                                                       "      actual: %ld\n",
+                                                       byte, pos, start, end,
+                                                       (long) (x_res - buf),
+                                                       (long) (res - buf));
+                                                rc = 1;
+                                                goto out;
+                                        }
+                                }
+                        }
+                }
+        }
+
+out:
+        if (rc == 0)
+                printf("PASS\n");
+
+        return rc;
+}
+
+/* '*' followed by every byte value at every offset */
+static int test_scan_comment_end(void)
+{
+        static const unsigned long window = 80UL;
+        char buf[80];
+        unsigned long pos, start, end;
+        int byte, rc = 0;
+
+        printf("TEST: scan_comment_end\n");
+
+        for (byte = 0; byte < 256 && rc == 0; byte++) {
+                for (pos = 0UL; pos + 1UL < window; pos++) {
+                        /* Stars all around must not be taken for the end */
+                        memset(buf, (pos & 1UL) ? '*' : 'a', window);
+                        buf[pos] = '*';
+                        buf[pos + 1UL] = (char) byte;
+
+                        for (start = 0UL; start <= pos; start += 3UL) {
+                                for (end = pos; end <= window; end++) {
+                                        const char *limit = buf + end;
+                                        const char *x_res = NULL, *chp, *res;
+
+                                        for (chp = buf + start; limit - chp >= 2; chp++) {
+                                                if (chp[0] == '*' && chp[1] == '/') {
+                                                        x_res = chp + 2;
+                                                        break;
+                                                }
+                                        }
+                                        res = scan_comment_end(buf + start, limit);
+
+                                        if (x_res != res) {
+                                                printf("FAIL [0x%02x after '*' at %lu, [%lu, %lu)]\n"
+                                                       "    expected: %ld\n"
+                                                       "      actual: %ld\n",
+                                                       byte, pos, start, end,
+                                                       x_res ? (long) (x_res - buf) : -1L,
+                                                       res ? (long) (res - buf) : -1L);
+                                                rc = 1;
+                                                goto out;
+                                        }
+                                }
+                        }
+                }
+        }
+
+out:
+        if (rc == 0)
+                printf("PASS\n");
+
+        return rc;
+}
+
+/* Every variant the CPU supports must agree with the scalar one.
+   Buffers end right before an inaccessible page:
+   reading past @limit crashes the test. */
+static int test_kernel_variants(void)
+{
+        static const char alphabet[] = "#\n\n*/ \t\\\"';{}()\0ab\r";
+        static const unsigned long max_size = 300UL;
+        const scan_kernels_t *const *variants = scan_kernel_variants();
+        const scan_kernels_t *ref = variants[0];
+        char *area, *guard, *buf;
+        unsigned long page, size, start, i, round, v;
+        int rc = 0;
+
+        printf("TEST: kernel_variants\n");
+
+        page = (unsigned long) sysconf(_SC_PAGESIZE);
+        if ((area = mmap(NULL, page * 2UL,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0)) == MAP_FAILED) {
+                printf("FAIL [mmap() failed]\n");
+                return 1;
+        }
+        guard = area + page;
+        mprotect(guard, page, PROT_NONE);
+
+        for (v = 0UL; variants[v] != NULL; v++)
+                printf("    variant: %s\n", variants[v]->name);
+
+        srand(3);
+
+        for (round = 0UL; round < 20000UL && rc == 0; round++) {
+                size = (unsigned long) rand() % max_size;
+                start = (unsigned long) rand() % (size + 1UL);
+                buf = guard - size;
+
+                for (i = 0UL; i < size; i++)
+                        buf[i] = alphabet[(unsigned long) rand() %
+                                          (sizeof(alphabet) - 1UL)];
+                /* Long runs without stop bytes */
+                if (round % 2UL == 0UL && size > 0UL)
+                        memset(buf, 'a', (unsigned long) rand() % size);
+
+                for (v = 1UL; variants[v] != NULL && rc == 0; v++) {
+                        const scan_kernels_t *k = variants[v];
+                        const char *limit = buf + size;
+                        unsigned long ref_nr_nl = 0UL, nr_nl = 0UL;
+                        const char *what = NULL;
+
+                        if (ref->scan_plain(buf + start, limit, &ref_nr_nl) !=
+                            k->scan_plain(buf + start, limit, &nr_nl) ||
+                            ref_nr_nl != nr_nl)
+                                what = "scan_plain";
+                        else if (ref->scan_special(buf + start, limit) !=
+                                 k->scan_special(buf + start, limit))
+                                what = "scan_special";
+                        else if (ref->scan_comment_end(buf + start, limit) !=
+                                 k->scan_comment_end(buf + start, limit))
+                                what = "scan_comment_end";
+                        else if (ref->scan_quote(buf + start, limit, '"') !=
+                                 k->scan_quote(buf + start, limit, '"') ||
+                                 ref->scan_quote(buf + start, limit, '\'') !=
+                                 k->scan_quote(buf + start, limit, '\''))
+                                what = "scan_quote";
+
+                        if (what != NULL) {
+                                printf("FAIL [%s of %s differs on [%lu, %lu)]\n",
+                                       what, k->name, start, size);
+                                rc = 1;
+                        }
+                }
+        }
+
+        munmap(area, page * 2UL);
+
+        if (rc == 0)
+                printf("PASS\n");
+
+        return rc;
+}
+
+int main(void)
+{
+        /* Add new tests here */
+        static int (*const tests[])(void) = {
+                test_scan_plain,
+                test_process_linemarkers,
+                test_backward_markers,
+                test_scan_special,
+                test_scan_comment_end,
+                test_kernel_variants
+        };
+        static const unsigned long nr_tests = sizeof(tests) / sizeof(tests[0]);
+        int result = 0;
+        unsigned long i;
+
+        for (i = 0UL; i < nr_tests; i++) {
+                if ((tests[i])() != 0)
+                        result = 1;
+        }
+
+        return result;
+}
@@ -0,0 +1,122 @@
+#include "../common.h"
+
+static char result_path[PATH_MAX];
+
+/* Records the job as "<type> <i_file> <o_file> <X_PP_CACHE_DIR> <data>" */
+static void record_job(const server_job_t *job)
+{
+        FILE *fp;
+
+        if ((fp = fopen(result_path, "w")) == NULL)
+                return;
+
+        fprintf(fp, "%d %s %s %s %.*s",
+                job->type,
+                job->i_file,
+                job->o_file,
+                getenv("X_PP_CACHE_DIR") != NULL ?
+                getenv("X_PP_CACHE_DIR") : "(unset)",
+                (int) job->size,
+                job->data);
+        fclose(fp);
+}
+
+static int test_submit(void)
+{
+        static const char data[] = "int x;\n";
+        char dir[] = "/tmp/test-server.XXXXXX";
+        char sock_path[PATH_MAX], lock_path[PATH_MAX], expected[64];
+        server_job_t job_mem;
+        pid_t pid;
+        void *base = NULL;
+        unsigned long size = 0UL;
+        int tries, ignored, rc = 1;
+
+        printf("TEST: server_submit & server_run\n");
+
+        if (mkdtemp(dir) == NULL) {
+                printf("FAIL [mkdtemp]\n");
+                return 1;
+        }
+
+        snprintf(sock_path, sizeof(sock_path), "%s/sock", dir);
+        snprintf(lock_path, sizeof(lock_path), "%s/sock.lock", dir);
+        snprintf(result_path, sizeof(result_path), "%s/result", dir);
+
+        /* Otherwise server_submit would start gcc-wrapper */
+        if ((pid = fork()) == 0)
+                _exit(server_run(sock_path, record_job) == 0 ? 0 : 1);
+
+        for (tries = 0; tries < 100 && access(sock_path, F_OK) < 0; tries++)
+                usleep(10000);
+
+        /* The server must see the settings of the client */
+        setenv("X_PP_CACHE_DIR", "/client/cache", 1);
+
+        memset(&job_mem, 0, sizeof(job_mem));
+        job_mem.type = 2;
+        job_mem.i_file = "source.c";
+        job_mem.o_file = "source.o";
+        job_mem.data = data;
+        job_mem.size = sizeof(data) - 1UL;
+
+        if (server_submit(sock_path, &job_mem) < 0) {
+                printf("FAIL [server_submit failed]\n");
+                unsetenv("X_PP_CACHE_DIR");
+                goto out;
+        }
+        unsetenv("X_PP_CACHE_DIR");
+
+        snprintf(expected, sizeof(expected),
+                 "2 source.c source.o /client/cache %s", data);
+
+        for (tries = 0; tries < 100; tries++) {
+                if (create_file_mapping(result_path, &base, &size) == 0) {
+                        if (size == strlen(expected))
+                                break;
+                        delete_file_mapping(base, size);
+                        base = NULL;
+                }
+                usleep(10000);
+        }
+
+        if (base == NULL || memcmp(base, expected, size) != 0) {
+                printf("FAIL [Job is not handled]\n");
+                goto out;
+        }
+
+        printf("PASS\n");
+        rc = 0;
+
+out:
+        if (base != NULL)
+                delete_file_mapping(base, size);
+
+        kill(pid, SIGTERM);
+        waitpid(pid, &ignored, 0);
+
+        unlink(result_path);
+        unlink(sock_path);
+        unlink(lock_path);
+        rmdir(dir);
+
+        return rc;
+}
+
+int main(void)
+{
+        /* Add new tests here */
+        static int (*const tests[])(void) = {
+                test_submit
+        };
+        static const unsigned long nr_tests = sizeof(tests) / sizeof(tests[0]);
+        int result = 0;
+        unsigned long i;
+
+        for (i = 0UL; i < nr_tests; i++) {
+                if ((tests[i])() != 0)
+                        result = 1;
+        }
+
+        return result;
+}
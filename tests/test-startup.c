@@ -0,0 +1,154 @@
+#include "../common.h"
+
+/* Built by the top-level Makefile before the tests are run */
+static const char wrapper_path[] = "../gcc-wrapper";
+
+static double elapsed_sec(const struct timespec *start)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (double) (now.tv_sec - start->tv_sec) +
+               (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Returns exit status of @argv[0] or -1 */
+static int run_status(char *const argv[])
+{
+        extern char **environ;
+        pid_t pid;
+        int status;
+
+        if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0 ||
+            waitpid(pid, &status, 0) != pid ||
+            !WIFEXITED(status))
+                return -1;
+
+        return WEXITSTATUS(status);
+}
+
+/* Passthrough replaces the wrapper with the compiler */
+static int test_exit_status(void)
+{
+        char *argv[] = { (char *) wrapper_path, "a.o", "-o", "a.out", NULL };
+        int status;
+
+        printf("TEST: exit status of passthrough\n");
+
+        setenv("REAL_CC", "false", 1);
+        status = run_status(argv);
+        unsetenv("REAL_CC");
+
+        if (status != 1) {
+                printf("FAIL [Wrong exit status]\n"
+                       "    expected: 1\n"
+                       "      actual: %d\n",
+                       status);
+                return 1;
+        }
+
+        printf("PASS\n");
+        return 0;
+}
+
+/* Not a correctness test: shows the wrapper's overhead
+   compared to running the programs it starts directly. */
+static int test_startup_latency(void)
+{
+        static const unsigned long nr_runs = 100UL;
+        char dir[] = "/tmp/test-startup.XXXXXX";
+        char src[PATH_MAX], obj[PATH_MAX], *cpp;
+        char *true_argv[] = { NULL, NULL };
+        char *link_argv[] = { (char *) wrapper_path, "a.o", "-o", "a.out", NULL };
+        char *cpp_argv[] = { NULL, src, "-o", "/dev/null", NULL };
+        char *cc_argv[] = { (char *) wrapper_path, "-c", src, "-o", obj, NULL };
+        struct {
+                const char *name;
+                char **argv;
+                int is_wrapped;
+        } cases[] = {
+                { "true",                 true_argv, 0 },
+                { "wrapper, passthrough", link_argv, 1 },
+                { "cpp",                  cpp_argv,  0 },
+                { "wrapper, processing",  cc_argv,   1 },
+        };
+        unsigned long i, j;
+        struct timespec start;
+        int fd, rc = 0;
+
+        printf("TEST: startup latency\n");
+
+        if (mkdtemp(dir) == NULL) {
+                printf("FAIL [mkdtemp]\n");
+                return 1;
+        }
+
+        snprintf(src, sizeof(src), "%s/empty.c", dir);
+        snprintf(obj, sizeof(obj), "%s/empty.o", dir);
+
+        if ((fd = open(src, O_CREAT | O_WRONLY | O_EXCL, 0644)) >= 0)
+                close(fd);
+
+        true_argv[0] = locate_file("true");
+        cpp_argv[0] = cpp = locate_file("cpp");
+        if (true_argv[0] == NULL || cpp == NULL || fd < 0) {
+                printf("FAIL [Cannot prepare]\n");
+                rc = 1;
+                goto out;
+        }
+
+        /* The compiler itself isn't measured */
+        setenv("REAL_CC", "true", 1);
+
+        for (i = 0UL; i < sizeof(cases) / sizeof(cases[0]); i++) {
+                double elapsed;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (j = 0UL; j < nr_runs; j++) {
+                        if (run_status(cases[i].argv) != 0) {
+                                printf("FAIL [%s has failed]\n", cases[i].name);
+                                rc = 1;
+                                break;
+                        }
+                }
+                elapsed = elapsed_sec(&start);
+
+                if (j == nr_runs)
+                        printf("    %-22s %8.3f ms\n",
+                               cases[i].name,
+                               elapsed * 1e3 / (double) nr_runs);
+        }
+
+        unsetenv("REAL_CC");
+
+        if (rc == 0)
+                printf("PASS\n");
+
+out:
+        unlink(src);
+        rmdir(dir);
+        xfree(true_argv[0]);
+        xfree(cpp);
+
+        return rc;
+}
+
+int main(void)
+{
+        /* Add new tests here */
+        static int (*const tests[])(void) = {
+                test_exit_status,
+                test_startup_latency
+        };
+        static const unsigned long nr_tests = sizeof(tests) / sizeof(tests[0]);
+        int result = 0;
+        unsigned long i;
+
+        for (i = 0UL; i < nr_tests; i++) {
+                if ((tests[i])() != 0)
+                        result = 1;
+        }
+
+        return result;
+}
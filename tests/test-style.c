@@ -0,0 +1,671 @@
+#include "../common.h"
+
+static double elapsed_sec(const struct timespec *start)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (double) (now.tv_sec - start->tv_sec) +
+               (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** Baseline for test_style_throughput: adjust_style as it was
+    before it appended spans, emitting one character at a time.
+**/
+
+
+struct block_desc {
+        int ch;
+        unsigned long indent;
+};
+
+static struct block_desc *push_block_desc(dbuf_t *blocks,
+                                          int ch,
+                                          unsigned long indent)
+{
+        struct block_desc *desc;
+
+        desc = (struct block_desc *) dbuf_alloc(blocks, sizeof(*desc));
+        if (desc == NULL) {
+                print_error_msg(-1, 0,
+                                "Failed to push block description:\n"
+                                "    %c, %lu\n"
+                                "In function:\n"
+                                "    %s",
+                                ch, indent, __func__);
+                _exit(ENOENT);
+        }
+
+        memset(desc, 0, sizeof(*desc));
+        desc->ch = ch; desc->indent = indent;
+
+        /* Overflow check is done by dbuf_alloc */
+        blocks->pos += sizeof(*desc);
+
+        return desc;
+}
+
+static struct block_desc *pop_block_desc(dbuf_t *blocks,
+                                         int ch)
+{
+        struct block_desc *desc;
+
+        if (ch == ')')
+                ch = '(';
+        else if (ch == '}')
+                ch = '{';
+        else {
+                print_error_msg(-1, 0,
+                                "Unknown character:\n"
+                                "    %c\n"
+                                "In function:\n"
+                                "    %s",
+                                ch, __func__);
+                _exit(EINVAL);
+        }
+
+        if (blocks->pos == blocks->base) {
+                print_error_msg(-1, 0,
+                                "No more stack entries.\n"
+                                "In function:\n"
+                                "    %s",
+                                __func__);
+                _exit(ENOENT);
+        }
+
+        desc = (struct block_desc *) blocks->pos - 1;
+
+        if (ch != desc->ch) {
+                print_error_msg(-1, 0,
+                                "Wrong block type:\n"
+                                "    expected [%c], actual [%c]\n"
+                                "In function:\n"
+                                "    %s",
+                                ch, desc->ch, __func__);
+                _exit(ESRCH);
+        }
+
+        blocks->pos = (char *) desc;
+
+        return (blocks->pos == blocks->base) ? NULL : (desc - 1);
+}
+
+static int skip_comment(char **chpp,
+                        char *const limit)
+{
+        char *chp = *chpp;
+        int is_skipped = 0;
+
+        if (chp < limit && *chp++ == '/' &&
+            chp < limit && (*chp == '*' || *chp == '/')) {
+                is_skipped = 1;
+
+                if (*chp++ == '*') {
+                        int is_terminated = 0;
+
+                        /* Seek '*' '/'
+                           skipping everything until that */
+                        while (chp < limit) {
+                                if (*chp++ == '*' && chp < limit &&
+                                    *chp == '/') {
+                                        is_terminated = 1;
+                                        chp++; break;
+                                }
+                        }
+
+                        if (!is_terminated) {
+                                print_error_msg(-1, 0,
+                                                "Incomplete multiline "
+                                                "comment detected.\n"
+                                                "In function:\n"
+                                                "    %s",
+                                                __func__);
+                                _exit(EINVAL);
+                        }
+                } else {
+                        /* Eliminate the comment but keep NL
+                           character */
+                        while (!is_eol(chp, limit)) chp++;
+                }
+        }
+
+        if (is_skipped) *chpp = chp;
+
+        return is_skipped;
+}
+
+static char get_character(char **chpp,
+                          char *const limit)
+{
+        char *chp = *chpp, ret;
+
+        ret = '\0';
+
+        while (skip_comment(&chp, limit) ||
+               (chp < limit && is_ws(*chp) && (chp++, 1))) ret = ' ';
+
+        /* Enumerated characters are handled specially.
+           So it is desirable to omit whitespaces
+           preceding them */
+        if (chp < limit &&
+            (ret == '\0' || (ret == ' ' && (*chp == '\n' ||
+                                            *chp == ';'  ||
+                                            *chp == '{'  ||
+                                            *chp == '}'  ||
+                                            *chp == '('  ||
+                                            *chp == ')')))) ret = *chp++;
+
+        *chpp = chp;
+        return ret;
+}
+
+static void unget_character(char **chpp,
+                            char ch,
+                            char *const limit)
+{
+        char *chp = *chpp;
+
+        if (chp > limit) {
+                *--chp = ch;
+                *chpp = chp;
+        } else {
+                print_error_msg(-1, 0,
+                                "No head space for character.\n"
+                                "In function:\n"
+                                "    %s",
+                                __func__);
+                _exit(ENOMEM);
+        }
+}
+
+static dbuf_t *baseline_adjust_style(char *const data,
+                                     unsigned long size)
+{
+        char *chp = data, *const limit = data + size, ch;
+        dbuf_t blocks_mem, *const blocks = &blocks_mem, *buffer;
+        enum {
+                /* At the start of a new line. Substate #1.
+                   We are allowed here to add extra NL character
+                   (used perhaps for semantical grouping of statements). */
+                S_NL1,
+                /* At the start of a new line. Substate #2.
+                   Skip all whitespace characters.
+                   Add fixed amount of space characters ' '
+                   just before the initial token in the line */
+                S_NL2,
+                /* Main program text.
+                   No line data exists in the output buffer */
+                S_TEXT1,
+                /* Main program text.
+                   Some line data has been printed */
+                S_TEXT2,
+                /* This is quoted text.
+                   It should be transmitted to output buffer
+                   without any changes. */
+                S_QUOTED,
+        } state = S_NL2;
+
+        unsigned long linelen = 0UL, blk_indent = 0UL;
+        struct block_desc *current;
+
+        buffer = xmalloc(sizeof(*buffer));
+        dbuf_init(blocks);
+        dbuf_init(buffer);
+
+        current = push_block_desc(blocks, '$', 0UL);
+
+        for (ch = get_character(&chp, limit); ch != '\0';) {
+                switch (state) {
+                case S_NL1:
+                        if (ch == '\n') {
+                                dbuf_putc(buffer, '\n');
+
+                                state = S_NL2;
+
+                                goto next;
+                        }
+                        /* FALLTHRU */
+                case S_NL2:
+                        if (ch == '\n' ||
+                            ch == ' ')
+                                goto next;
+
+                        for (linelen = 0UL;
+                             linelen < current->indent;
+                             linelen++) dbuf_putc(buffer, ' ');
+
+                        state = S_TEXT1;
+                        /* FALLTHRU */
+                case S_TEXT1:
+                case S_TEXT2:
+                        if (ch == '\n') {
+                                unget_character(&chp, ' ', data);
+
+                                goto next;
+                        }
+
+                        if (ch == ';') {
+                                dbuf_putc(buffer, ';'); linelen++;
+                                dbuf_putc(buffer, '\n');
+
+                                if ((ch = get_character(&chp, limit)) == '\n')
+                                        ch = get_character(&chp, limit);
+
+                                state = S_NL1;
+
+                                continue;
+                        }
+
+                        if (ch == '{') {
+                                if (state == S_TEXT2) {
+                                        dbuf_putc(buffer, ' '); linelen++;
+                                }
+
+                                dbuf_putc(buffer, '{'); linelen++;
+                                dbuf_putc(buffer, '\n');
+
+                                blk_indent += 4UL;
+
+                                current = push_block_desc(blocks,
+                                                          '{',
+                                                          blk_indent);
+
+                                if ((ch = get_character(&chp, limit)) == '\n')
+                                        ch = get_character(&chp, limit);
+
+                                state = S_NL1;
+
+                                continue;
+                        }
+
+                        if (ch == '}') {
+                                current = pop_block_desc(blocks,
+                                                         '}');
+
+                                if (state == S_TEXT2) {
+                                        dbuf_putc(buffer, '\n');
+                                        for (linelen = 0UL;
+                                             linelen < current->indent;
+                                             linelen++) dbuf_putc(buffer, ' ');
+                                } else {
+                                        assert(linelen == blk_indent);
+
+                                        if (current->indent > linelen) {
+                                                for (;
+                                                     linelen < current->indent;
+                                                     linelen++) {
+                                                        dbuf_putc(buffer, ' ');
+                                                }
+                                        } else {
+                                                unsigned long delta;
+
+                                                delta = (linelen -
+                                                         current->indent);
+                                                linelen -= delta;
+                                                buffer->pos -= delta;
+                                        }
+                                }
+
+                                blk_indent -= 4UL;
+
+                                dbuf_putc(buffer, '}'); linelen++;
+
+                                if ((ch = get_character(&chp, limit)) == '\n') {
+                                        dbuf_putc(buffer, '\n');
+                                        ch = get_character(&chp, limit);
+
+                                        state = S_NL1;
+                                } else {
+                                        state = S_TEXT2;
+                                }
+
+                                continue;
+                        }
+
+                        if (ch == '(') {
+                                if (state == S_TEXT2) {
+                                        dbuf_putc(buffer, ' '); linelen++;
+                                }
+
+                                dbuf_putc(buffer, '('); linelen++;
+
+                                current = push_block_desc(blocks,
+                                                          '(',
+                                                          linelen);
+
+                                if ((ch = get_character(&chp, limit)) == '\n') {
+                                        dbuf_putc(buffer, '\n');
+                                        ch = get_character(&chp, limit);
+
+                                        state = S_NL1;
+                                } else {
+                                        state = S_TEXT2;
+                                }
+
+                                continue;
+                        }
+
+                        if (ch == ')') {
+                                current = pop_block_desc(blocks,
+                                                         ')');
+
+                                dbuf_putc(buffer, ')'); linelen++;
+
+                                if ((ch = get_character(&chp, limit)) == '\n') {
+                                        unget_character(&chp, ' ', data);
+                                        ch = get_character(&chp, limit);
+                                }
+
+                                state = S_TEXT2;
+
+                                continue;
+                        }
+
+                        if (ch == '"' || ch == '\'') {
+                                dbuf_putc(buffer, ch); linelen++;
+
+                                state = S_QUOTED;
+
+                                continue;
+                        }
+
+                        dbuf_putc(buffer, ch); linelen++;
+
+                        state = S_TEXT2;
+
+                        goto next;
+
+                case S_QUOTED:
+                        while (chp < limit && *chp != ch) {
+                                dbuf_putc(buffer, *chp); linelen++;
+
+                                if (*chp++ == '\\' && chp < limit) {
+                                        dbuf_putc(buffer, *chp++); linelen++;
+                                }
+                        }
+
+                        if (chp >= limit) {
+                                print_error_msg(-1, 0,
+                                                "Incomplete quoted "
+                                                "text detected.\n"
+                                                "In function:\n"
+                                                "    %s",
+                                                __func__);
+                                _exit(EINVAL);
+                        }
+
+                        dbuf_putc(buffer, *chp++); linelen++;
+
+                        state = S_TEXT2;
+
+                        goto next;
+                }
+        next:
+                ch = get_character(&chp, limit);
+        }
+
+        dbuf_free(blocks);
+
+        return buffer;
+}
+
+/* Runs adjust_style on a copy of @input: it may alter its input.
+   The copy is padded text. */
+static dbuf_t *style_copy(const char *input,
+                          unsigned long size)
+{
+        char *copy;
+        dbuf_t *output;
+
+        copy = text_alloc(size);
+        memcpy(copy, input, size);
+        output = adjust_style(copy, size);
+        xfree(copy);
+
+        return output;
+}
+
+static int test_adjust_style(void)
+{
+        static const char input[] =
+                "struct s { int a; char *b; };\n"
+                "int f(int x, const char *y)\n"
+                "{\n"
+                "  if (x) { return g(\"a;{\\\"}\", '('); }\n"
+                "  /* c */ return (x + 1) * 2; // d\n"
+                "}\n";
+        static const char x_output[] =
+                "struct s {\n"
+                "    int a;\n"
+                "    char *b;\n"
+                "};\n"
+                "int f (int x, const char *y) {\n"
+                "    if (x) {\n"
+                "        return g (\"a;{\\\"}\", '(');\n"
+                "    }\n"
+                "    return (x + 1) * 2;\n"
+                "}\n";
+        dbuf_t *output;
+        unsigned long size;
+        int rc;
+
+        printf("TEST: adjust_style\n");
+
+        output = style_copy(input, sizeof(input) - 1UL);
+        size = (unsigned long) (output->pos - output->base);
+
+        rc = (size != sizeof(x_output) - 1UL ||
+              memcmp(output->base, x_output, size) != 0);
+
+        if (rc)
+                printf("FAIL [Unexpected output]\n"
+                       "    expected: \"%s\"\n"
+                       "      actual: \"%.*s\"\n",
+                       x_output, (int) size, output->base);
+        else
+                printf("PASS\n");
+
+        dbuf_free(output);
+        xfree(output);
+        return rc;
+}
+
+/* The fused pass must match the two separate ones. The input is
+   several megabytes: comments and quoted text longer than
+   the window of the fused pass cross its boundaries. */
+static int test_process_and_adjust(void)
+{
+        dbuf_t input_mem, *const input = &input_mem;
+        dbuf_t *twopass, *tmp, *fused;
+        unsigned long i, j, linenum = 1UL, size;
+        int rc = 0;
+
+        printf("TEST: process_and_adjust\n");
+
+        dbuf_init(input);
+
+        for (i = 0UL; i < 20000UL && rc == 0; i++) {
+                if (i % 7UL == 0UL) {
+                        linenum = i;
+                        rc |= dbuf_printf(input, "# %lu \"f%lu.c\" 1\n",
+                                          linenum, i % 3UL) < 0;
+                }
+
+                rc |= dbuf_printf(input,
+                                  "int f%lu(int x) { /* c */ return g(x, \"s;{\\\"\"); }\n"
+                                  "  struct s%lu { int a; }; // d\n",
+                                  i, i) < 0;
+                linenum += 2UL;
+
+                /* Rogue linemarker */
+                if (i % 5UL == 4UL) {
+                        linenum -= 2UL;
+                        rc |= dbuf_printf(input, "# %lu \"f%lu.c\"\n",
+                                          linenum, (i - i % 7UL) % 3UL) < 0;
+                }
+
+                if (i % 2000UL == 1000UL) {
+                        rc |= dbuf_printf(input, "/*") < 0;
+                        for (j = 0UL; j < 10000UL; j++)
+                                rc |= dbuf_printf(input, " * line %lu\n", j) < 0;
+                        rc |= dbuf_printf(input, "*/ char q[] = \"") < 0;
+                        for (j = 0UL; j < 10000UL; j++)
+                                rc |= dbuf_printf(input, "\\\"%lu */ ", j) < 0;
+                        rc |= dbuf_printf(input, "\";\n") < 0;
+                        linenum += 10001UL;
+                }
+        }
+
+        if (rc || dbuf_terminate(input) < 0) {
+                printf("FAIL [Failed to make input]\n");
+                dbuf_free(input);
+                return 1;
+        }
+
+        size = (unsigned long) (input->pos - input->base);
+
+        tmp = process_linemarkers(input->base, size);
+        twopass = style_copy(tmp->base, (unsigned long) (tmp->pos - tmp->base));
+        fused = process_and_adjust(input->base, size);
+
+        if (fused == NULL ||
+            fused->pos - fused->base != twopass->pos - twopass->base ||
+            memcmp(fused->base, twopass->base,
+                   (unsigned long) (twopass->pos - twopass->base)) != 0) {
+                printf("FAIL [Output differs from adjust_style(process_linemarkers())]\n");
+                rc = 1;
+        } else {
+                printf("PASS [%lu bytes]\n", size);
+        }
+
+        if (fused != NULL) {
+                dbuf_free(fused);
+                xfree(fused);
+        }
+        dbuf_free(twopass);
+        xfree(twopass);
+        dbuf_free(tmp);
+        xfree(tmp);
+        dbuf_free(input);
+        return rc;
+}
+
+static double mib_per_sec(unsigned long size,
+                          double elapsed)
+{
+        return elapsed > 0.0 ? (double) (size >> 20UL) / elapsed : 0.0;
+}
+
+/* Not a correctness test: shows throughput of adjust_style
+   and of baseline_adjust_style on preprocessed system headers
+   repeated to about 64 MiB. Their outputs must be the same. */
+static int test_style_throughput(void)
+{
+        static const char source[] =
+                "#include <stdio.h>\n"
+                "#include <stdlib.h>\n"
+                "#include <string.h>\n"
+                "#include <unistd.h>\n"
+                "#include <pthread.h>\n"
+                "#include <sys/socket.h>\n";
+        static const unsigned long target_size = 64UL << 20UL;
+        char path[] = "/tmp/test-style.XXXXXX.c";
+        char *argv[] = { NULL, "-P", path, NULL };
+        char *obuf = NULL, *input, *baseline_input;
+        unsigned long osize = 0UL, size, copied;
+        child_ctx_t ctx_mem;
+        struct timespec start;
+        dbuf_t *output, *baseline_output;
+        double elapsed, baseline_elapsed;
+        int fd, rc = 1;
+
+        printf("TEST: adjust_style throughput\n");
+
+        if ((fd = mkstemps(path, 2)) < 0 ||
+            safe_write(fd, source, sizeof(source) - 1UL) != (long) (sizeof(source) - 1UL) ||
+            (argv[0] = locate_file("cpp")) == NULL) {
+                printf("FAIL [Cannot prepare]\n");
+                goto out;
+        }
+
+        /* -P: no linemarkers, as after process_linemarkers */
+        memset(&ctx_mem, 0, sizeof(ctx_mem));
+        ctx_mem.argv = argv;
+        ctx_mem.flags = IO_FROM;
+        ctx_mem.obuf_p = &obuf;
+        ctx_mem.osize_p = &osize;
+
+        if (run_cmd(&ctx_mem) < 0 || osize == 0UL) {
+                printf("FAIL [cpp has failed]\n");
+                goto out;
+        }
+
+        size = (target_size / osize + 1UL) * osize;
+        input = text_alloc(size);
+        for (copied = 0UL; copied < size; copied += osize)
+                memcpy(input + copied, obuf, osize);
+
+        /* Both may alter their input */
+        baseline_input = text_alloc(size);
+        memcpy(baseline_input, input, size);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        baseline_output = baseline_adjust_style(baseline_input, size);
+        baseline_elapsed = elapsed_sec(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        output = adjust_style(input, size);
+        elapsed = elapsed_sec(&start);
+
+        if (output->pos - output->base !=
+            baseline_output->pos - baseline_output->base ||
+            memcmp(output->base, baseline_output->base,
+                   (unsigned long) (output->pos - output->base)) != 0) {
+                printf("FAIL [Output differs from the baseline]\n");
+        } else {
+                printf("PASS [%lu MiB: baseline %.3f s, %.1f MiB/s; "
+                       "current %.3f s, %.1f MiB/s]\n",
+                       size >> 20UL,
+                       baseline_elapsed, mib_per_sec(size, baseline_elapsed),
+                       elapsed, mib_per_sec(size, elapsed));
+                rc = 0;
+        }
+
+        dbuf_free(baseline_output);
+        xfree(baseline_output);
+        xfree(baseline_input);
+        dbuf_free(output);
+        xfree(output);
+        xfree(input);
+
+out:
+        if (fd >= 0) {
+                close(fd);
+                unlink(path);
+        }
+        xfree(argv[0]);
+        xfree(obuf);
+
+        return rc;
+}
+
+int main(void)
+{
+        /* Add new tests here */
+        static int (*const tests[])(void) = {
+                test_adjust_style,
+                test_process_and_adjust,
+                test_style_throughput
+        };
+        static const unsigned long nr_tests = sizeof(tests) / sizeof(tests[0]);
+        int result = 0;
+        unsigned long i;
+
+        for (i = 0UL; i < nr_tests; i++) {
+                if ((tests[i])() != 0)
+                        result = 1;
+        }
+
+        return result;
+}
@@ -65,6 +65,152 @@ char *xstrdup(const char *s)
         return d;
 }
 
+/* Room for @size bytes of padded text. The padding is ready. */
+char *text_alloc(unsigned long size)
+{
+        char *text;
+
+        if (size > ULONG_MAX - TEXT_PADDING) {
+                print_error_msg(-1,
+                                0,
+                                "Failed to allocate %lu bytes of text",
+                                size);
+                _exit(ENOMEM);
+        }
+
+        text = xmalloc(size + TEXT_PADDING);
+        memset(text + size, 0, TEXT_PADDING);
+
+        return text;
+}
+
+/***************************************
+ * Bump allocator for short-lived data *
+ ***************************************/
+
+#define ARENA_ALIGN     16UL
+#define ARENA_MIN_CHUNK 4096UL
+#define ARENA_MAX_CHUNK (1UL << 20)
+
+struct arena_chunk {
+        struct arena_chunk *prev;
+        char *end;
+        unsigned long size; /* Including the header */
+};
+
+/* Header size keeps the first object aligned */
+#define ARENA_HDR_SIZE ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1UL) & \
+                        ~(ARENA_ALIGN - 1UL))
+
+/* @buf (may be NULL) of @size bytes is used before any chunk
+   is allocated: small arenas on the stack cost no malloc at all. */
+void arena_init(arena_t *arena,
+                char *buf,
+                unsigned long size)
+{
+        memset(arena, 0, sizeof(*arena));
+
+        if (buf != NULL) {
+                arena->pos = arena->buf = buf;
+                arena->end = arena->buf_end = buf + size;
+        }
+}
+
+void *arena_alloc(arena_t *arena,
+                  unsigned long size)
+{
+        struct arena_chunk *chunk;
+        unsigned long chunk_size;
+        char *ret;
+
+        if (size > ULONG_MAX / 2UL) {
+                print_error_msg(-1,
+                                0,
+                                "Failed to allocate %lu bytes in arena",
+                                size);
+                _exit(ENOMEM);
+        }
+
+        size = (size + ARENA_ALIGN - 1UL) & ~(ARENA_ALIGN - 1UL);
+
+        if (arena->pos != NULL) {
+                ret = (char *) (((unsigned long) arena->pos + ARENA_ALIGN - 1UL) &
+                                ~(ARENA_ALIGN - 1UL));
+                if (ret <= arena->end &&
+                    size <= (unsigned long) (arena->end - ret)) {
+                        arena->pos = ret + size;
+                        return ret;
+                }
+        }
+
+        /* Chunks grow with the arena. A large object gets
+           a chunk of its own size. */
+        chunk_size = (arena->chunk == NULL) ? ARENA_MIN_CHUNK : arena->chunk->size * 2UL;
+        if (chunk_size > ARENA_MAX_CHUNK)
+                chunk_size = ARENA_MAX_CHUNK;
+        if (chunk_size < ARENA_HDR_SIZE + size)
+                chunk_size = ARENA_HDR_SIZE + size;
+
+        chunk = xmalloc(chunk_size);
+        chunk->prev = arena->chunk;
+        chunk->end = (char *) chunk + chunk_size;
+        chunk->size = chunk_size;
+
+        arena->chunk = chunk;
+        arena->end = chunk->end;
+        ret = (char *) chunk + ARENA_HDR_SIZE;
+        arena->pos = ret + size;
+
+        return ret;
+}
+
+char *arena_strdup(arena_t *arena,
+                   const char *s)
+{
+        unsigned long size;
+        char *d;
+
+        size = strlen(s) + 1UL;
+        d = arena_alloc(arena, size);
+        memcpy(d, s, size);
+
+        return d;
+}
+
+arena_mark_t arena_checkpoint(const arena_t *arena)
+{
+        arena_mark_t mark;
+
+        mark.chunk = arena->chunk;
+        mark.pos = arena->pos;
+
+        return mark;
+}
+
+/* Everything allocated after @mark is released at once */
+void arena_reset(arena_t *arena,
+                 arena_mark_t mark)
+{
+        struct arena_chunk *chunk;
+
+        while ((chunk = arena->chunk) != mark.chunk) {
+                arena->chunk = chunk->prev;
+                xfree(chunk);
+        }
+
+        arena->pos = mark.pos;
+        arena->end = (mark.chunk != NULL) ? mark.chunk->end : arena->buf_end;
+}
+
+void arena_free(arena_t *arena)
+{
+        arena_mark_t mark;
+
+        mark.chunk = NULL;
+        mark.pos = arena->buf;
+        arena_reset(arena, mark);
+}
+
 /********************************
  * File system helper functions *
  ********************************/
@@ -162,9 +308,46 @@ long safe_write(int fd, const char *buf, unsigned long size)
         return -1L;
 }
 
+/* Length of the mapping holding @size bytes of padded text */
+static unsigned long padded_map_size(unsigned long size)
+{
+        unsigned long page = (unsigned long) sysconf(_SC_PAGESIZE);
+
+        return (size + TEXT_PADDING + page - 1UL) & ~(page - 1UL);
+}
+
+/* Maps @size bytes of @fd as padded text (see TEXT_PADDING).
+   Pages past the end of the file would fault on access: the file is
+   mapped over anonymous zeroed memory long enough for the padding. */
+int map_padded_text(int fd,
+                    unsigned long size,
+                    int prot,
+                    void **basep)
+{
+        unsigned long map_size;
+        void *base;
+
+        if (size > ULONG_MAX / 2UL)
+                return -1;
+
+        map_size = padded_map_size(size);
+        base = mmap(NULL, map_size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0L);
+        if (base == MAP_FAILED)
+                return -1;
+
+        if (mmap(base, size, prot, MAP_PRIVATE | MAP_FIXED, fd, 0L) == MAP_FAILED) {
+                munmap(base, map_size);
+                return -1;
+        }
+
+        *basep = base;
+        return 0;
+}
+
 /* Creates private RW mapping of the file specified with @path.
    Return -1 on failure (for any reason), 0 - on success.
-   Provides mapping data (base address + size) via pointers @basep, @sizep. */
+   Provides mapping data (base address + size) via pointers @basep, @sizep.
+   The data is padded text. */
 int create_file_mapping(const char *path,
                         void **basep,
                         unsigned long *sizep)
@@ -188,8 +371,7 @@ int create_file_mapping(const char *path,
                 goto out_close;
 
         size = (unsigned long) st_mem.st_size;
-        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0L);
-        if (base == MAP_FAILED)
+        if (map_padded_text(fd, size, PROT_READ | PROT_WRITE, &base) < 0)
                 goto out_close;
 
         *basep = base;
@@ -202,11 +384,12 @@ out:
         return rc;
 }
 
+/* Also unmaps mappings made by map_padded_text */
 void delete_file_mapping(void *base,
                          unsigned long size)
 {
         if (base != NULL && size > 0UL)
-                munmap(base, size);
+                munmap(base, padded_map_size(size));
 }
 
 /* Using $PATH environment variable locates real path of target binary */
@@ -291,17 +474,149 @@ char *locate_file(const char *name)
  * Dynamic (self-expandable) buffer API *
  ****************************************/
 
+#define DBUF_INTERNAL_SIZE (sizeof(((dbuf_t *) NULL)->internal_buf))
+
 void dbuf_init(dbuf_t *dbuf)
 {
         if (dbuf == NULL)
                 return;
         dbuf->pos = dbuf->base = dbuf->internal_buf;
-        dbuf->capacity = sizeof(dbuf->internal_buf) / sizeof(dbuf->internal_buf[0]);
+        dbuf->capacity = DBUF_INTERNAL_SIZE;
+        dbuf->max_step = 0UL;
+        dbuf->spill_size = 0UL;
+        dbuf->fd = -1;
 }
 
-char *dbuf_alloc(dbuf_t *dbuf, unsigned long size)
+/* Capacity doubles until a step would exceed @max_step bytes;
+   then it grows by @max_step at a time (0 means no limit).
+   Large buffers of unknown size may overshoot their final size
+   by @max_step instead of doubling their footprint. */
+void dbuf_set_growth(dbuf_t *dbuf, unsigned long max_step)
+{
+        if (dbuf != NULL)
+                dbuf->max_step = max_step;
+}
+
+void dbuf_set_spill(dbuf_t *dbuf, unsigned long spill_size)
+{
+        if (dbuf != NULL)
+                dbuf->spill_size = spill_size;
+}
+
+/* Makes @fd @size bytes long. Blocks are allocated if the file system
+   can do it: stores to a mapping of a sparse file would get SIGBUS
+   instead of ENOSPC. */
+static int size_file(int fd, unsigned long size)
+{
+        if (size > (unsigned long) LONG_MAX) {
+                errno = EFBIG;
+                return -1;
+        }
+
+        if (fallocate(fd, 0, 0L, (off_t) size) == 0)
+                return 0;
+
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+                return -1;
+
+        return ftruncate(fd, (off_t) size);
+}
+
+/* Moves the content to a heap block (or a mapping of @dbuf->fd)
+   of exactly @capacity bytes. Only mappings may fail. */
+static int dbuf_resize(dbuf_t *dbuf, unsigned long capacity)
+{
+        unsigned long size = (unsigned long) (dbuf->pos - dbuf->base);
+
+        if (dbuf->fd >= 0) {
+                void *base;
+
+                if (capacity > dbuf->capacity &&
+                    size_file(dbuf->fd, capacity) < 0)
+                        return -1;
+
+                base = mremap(dbuf->base, dbuf->capacity, capacity, MREMAP_MAYMOVE);
+                if (base == MAP_FAILED)
+                        return -1;
+
+                if (capacity < dbuf->capacity)
+                        ftruncate(dbuf->fd, (off_t) capacity);
+
+                dbuf->base = base;
+        } else if (dbuf->base == dbuf->internal_buf) {
+                dbuf->base = xmalloc(capacity);
+                memcpy(dbuf->base, dbuf->internal_buf, size);
+        } else {
+                dbuf->base = xrealloc(dbuf->base, capacity);
+        }
+
+        dbuf->pos = dbuf->base + size;
+        dbuf->capacity = capacity;
+
+        return 0;
+}
+
+/* An unlinked file in $TMPDIR (or /tmp) */
+static int open_spill_file(void)
+{
+        const char *dir;
+        char *path;
+        int fd;
+
+        if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0')
+                dir = "/tmp";
+
+        if ((fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) >= 0)
+                return fd;
+
+        /* File systems without O_TMPFILE */
+        path = xmalloc(strlen(dir) + sizeof("/gcc-wrapper.XXXXXX"));
+        strcpy(path, dir);
+        strcat(path, "/gcc-wrapper.XXXXXX");
+
+        if ((fd = mkostemp(path, O_CLOEXEC)) >= 0)
+                unlink(path);
+
+        xfree(path);
+        return fd;
+}
+
+/* Moves the content to a mapping of a new unlinked file
+   of @capacity bytes. On failure @dbuf is intact. */
+static int dbuf_spill(dbuf_t *dbuf, unsigned long capacity)
+{
+        unsigned long size = (unsigned long) (dbuf->pos - dbuf->base);
+        void *base;
+        int fd;
+
+        if ((fd = open_spill_file()) < 0)
+                return -1;
+
+        if (size_file(fd, capacity) < 0 ||
+            (base = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0L)) == MAP_FAILED) {
+                close(fd);
+                return -1;
+        }
+
+        memcpy(base, dbuf->base, size);
+
+        if (dbuf->base != dbuf->internal_buf)
+                xfree(dbuf->base);
+
+        dbuf->base = base;
+        dbuf->pos = dbuf->base + size;
+        dbuf->capacity = capacity;
+        dbuf->fd = fd;
+
+        return 0;
+}
+
+/* Room for @size more bytes. With @exact, no more is allocated
+   than asked for; otherwise the growth policy applies. */
+static char *dbuf_grow(dbuf_t *dbuf, unsigned long size, int exact)
 {
-        unsigned long old_size;
+        unsigned long old_size, capacity, step;
 
         if (dbuf == NULL)
                 return NULL;
@@ -318,21 +633,115 @@ char *dbuf_alloc(dbuf_t *dbuf, unsigned long size)
                 return NULL;
 
         if (size > dbuf->capacity) {
-                while (size > (dbuf->capacity *= 2UL)) ;
+                capacity = dbuf->capacity;
 
-                if (dbuf->base == dbuf->internal_buf) {
-                        dbuf->base = xmalloc(dbuf->capacity);
-                        memcpy(dbuf->base, dbuf->internal_buf, old_size);
+                if (exact) {
+                        capacity = size;
+                } else if (dbuf->max_step == 0UL) {
+                        while (size > (capacity *= 2UL)) ;
                 } else {
-                        dbuf->base = xrealloc(dbuf->base, dbuf->capacity);
+                        while (capacity < size && capacity < dbuf->max_step)
+                                capacity *= 2UL;
+
+                        if (capacity < size) {
+                                step = dbuf->max_step;
+                                capacity += (size - capacity + step - 1UL) / step * step;
+                        }
                 }
 
-                dbuf->pos = dbuf->base + old_size;
+                /* Heap stays the fallback if the file can't be made */
+                if (dbuf->fd < 0 && dbuf->spill_size != 0UL &&
+                    capacity > dbuf->spill_size &&
+                    dbuf_spill(dbuf, capacity) == 0)
+                        return dbuf->pos;
+
+                if (dbuf_resize(dbuf, capacity) < 0)
+                        return NULL;
         }
 
         return dbuf->pos;
 }
 
+char *dbuf_alloc(dbuf_t *dbuf, unsigned long size)
+{
+        return dbuf_grow(dbuf, size, 0);
+}
+
+/* Makes sure that @size more bytes fit without reallocation.
+   Callers knowing a bound of their output avoid the growth steps. */
+int dbuf_reserve(dbuf_t *dbuf, unsigned long size)
+{
+        return (dbuf_grow(dbuf, size, 1) != NULL) ? 0 : -1;
+}
+
+int dbuf_append(dbuf_t *dbuf, const void *data, unsigned long size)
+{
+        char *ptr;
+
+        if ((ptr = dbuf_alloc(dbuf, size)) == NULL)
+                return -1;
+
+        memcpy(ptr, data, size);
+        dbuf->pos += size;
+
+        return 0;
+}
+
+/* Returns unused memory of @dbuf */
+void dbuf_shrink_to_fit(dbuf_t *dbuf)
+{
+        unsigned long size;
+
+        if (dbuf == NULL || dbuf->base == dbuf->internal_buf)
+                return;
+
+        size = (unsigned long) (dbuf->pos - dbuf->base);
+
+        if (dbuf->fd >= 0) {
+                /* Mappings can't be empty */
+                if (size > 0UL && size < dbuf->capacity)
+                        dbuf_resize(dbuf, size);
+        } else if (size <= DBUF_INTERNAL_SIZE) {
+                memcpy(dbuf->internal_buf, dbuf->base, size);
+                xfree(dbuf->base);
+                dbuf->base = dbuf->internal_buf;
+                dbuf->pos = dbuf->base + size;
+                dbuf->capacity = DBUF_INTERNAL_SIZE;
+        } else if (size < dbuf->capacity) {
+                dbuf_resize(dbuf, size);
+        }
+}
+
+/* The content of @src moves to @dst (whose own content is freed).
+   No copy is made unless it still lives in the internal buffer.
+   @src is left in the initial state, @dst keeps its growth policy. */
+void dbuf_steal(dbuf_t *dst, dbuf_t *src)
+{
+        unsigned long size;
+
+        if (dst == NULL || src == NULL || dst == src)
+                return;
+
+        dbuf_free(dst);
+        size = (unsigned long) (src->pos - src->base);
+
+        if (src->base == src->internal_buf) {
+                memcpy(dst->internal_buf, src->internal_buf, size);
+                dst->pos = dst->base + size;
+        } else {
+                dst->base = src->base;
+                dst->pos = src->pos;
+                dst->capacity = src->capacity;
+                dst->fd = src->fd;
+
+                src->base = src->internal_buf;
+                src->capacity = DBUF_INTERNAL_SIZE;
+                src->fd = -1;
+        }
+
+        src->pos = src->base;
+}
+
 int dbuf_putc(dbuf_t *dbuf, int c)
 {
         char *ptr;
@@ -391,154 +800,1625 @@ int dbuf_printf(dbuf_t *dbuf, const char *fmt, ...)
         return ret_val;
 }
 
-void dbuf_free(dbuf_t *dbuf)
+/* Hands the contents over to the caller who must xfree it.
+   No copy is made unless the data still lives in the internal buffer.
+   Slack left by the growth policy is returned to the allocator.
+   Returns NULL for empty buffer. @dbuf is left in the initial state. */
+char *dbuf_detach(dbuf_t *dbuf, unsigned long *sizep)
 {
+        char *ret;
+        unsigned long size;
+
         if (dbuf == NULL)
-                return;
+                return NULL;
 
-        if (dbuf->base != dbuf->internal_buf) {
-                xfree(dbuf->base);
+        size = (unsigned long) (dbuf->pos - dbuf->base);
+
+        if (size == 0UL) {
+                ret = NULL;
+                dbuf_free(dbuf);
+        } else if (dbuf->base == dbuf->internal_buf || dbuf->fd >= 0) {
+                ret = xmalloc(size);
+                memcpy(ret, dbuf->base, size);
+                dbuf_free(dbuf);
+        } else {
+                if (dbuf->capacity > size)
+                        dbuf_resize(dbuf, size);
+                ret = dbuf->base;
                 dbuf->base = dbuf->internal_buf;
-                dbuf->capacity = sizeof(dbuf->internal_buf) / sizeof(dbuf->internal_buf[0]);
+                dbuf->capacity = DBUF_INTERNAL_SIZE;
         }
 
         dbuf->pos = dbuf->base;
-}
 
-/**************************
- * General purpose logger *
- **************************/
+        if (sizep != NULL)
+                *sizep = size;
 
-void print_error_msg(int fd,
-                     int error_kind,
-                     const char *fmt,
-                     ...)
+        return ret;
+}
+
+/* Makes the content of @dbuf padded text without changing its size.
+   Returns -1 if the padding doesn't fit. */
+int dbuf_terminate(dbuf_t *dbuf)
 {
-        va_list ap;
-        char scratch_mem[4096], *tail = scratch_mem;
-        unsigned long tail_room = sizeof(scratch_mem);
-        int rv, old_err_num = errno;
+        char *pad;
 
-        if (fd < 0)
-                fd = STDERR_FILENO;
-        if (error_kind < 0)
-                error_kind = old_err_num;
+        if ((pad = dbuf_alloc(dbuf, TEXT_PADDING)) == NULL)
+                return -1;
 
-        if (error_kind != 0) {
-                const char *error_dsc;
+        memset(pad, 0, TEXT_PADDING);
 
-                errno = 0;
-                error_dsc = strerror(error_kind);
-                if (error_dsc == NULL || errno != 0)
-                        error_dsc = "Unknown error";
+        return 0;
+}
 
-                rv = snprintf(tail,
-                              tail_room,
-                              "Failed with \"%s\"\n",
-                              error_dsc);
-                if (rv <= 0 || (unsigned long) rv >= tail_room)
-                        goto out;
-                tail += rv, tail_room -= (unsigned long) rv;
-        }
+/* Same as dbuf_detach, but the result is padded text */
+char *dbuf_detach_text(dbuf_t *dbuf, unsigned long *sizep)
+{
+        char *ret;
+        unsigned long size;
 
-        va_start(ap, fmt);
-        rv = vsnprintf(tail, tail_room, fmt, ap);
-        va_end(ap);
-        if (rv <= 0 || (unsigned long) rv >= tail_room)
-                goto out;
-        tail += rv, tail_room -= (unsigned long) rv;
+        if (dbuf == NULL)
+                return NULL;
 
-        if (tail[-1] != '\n')
-                *tail++ = '\n', tail_room--;
+        size = (unsigned long) (dbuf->pos - dbuf->base);
 
-        safe_write(fd, scratch_mem, sizeof(scratch_mem) - tail_room);
+        if (size == 0UL || dbuf_terminate(dbuf) < 0) {
+                ret = NULL;
+                dbuf_free(dbuf);
+                size = 0UL;
+        } else if (dbuf->base == dbuf->internal_buf || dbuf->fd >= 0) {
+                ret = text_alloc(size);
+                memcpy(ret, dbuf->base, size);
+                dbuf_free(dbuf);
+        } else {
+                if (dbuf->capacity > size + TEXT_PADDING)
+                        dbuf_resize(dbuf, size + TEXT_PADDING);
+                ret = dbuf->base;
+                dbuf->base = dbuf->internal_buf;
+                dbuf->capacity = DBUF_INTERNAL_SIZE;
+        }
 
-out:
-        errno = old_err_num;
-}
+        dbuf->pos = dbuf->base;
 
-/*******************************************
- * Enhanced (and convenient) child spawner *
- *******************************************/
+        if (sizep != NULL)
+                *sizep = size;
 
-static void run_child(char **argv,
-                      int log_fd,
-                      int in_fd,
-                      int out_fd)
+        return ret;
+}
+
+/* Content of @dbuf is written right into a shared mapping of @fd
+   (which must stay open), initially @capacity bytes long. Growing
+   the buffer grows the file. @dbuf must be empty. Returns -1 on
+   failure: @dbuf is left on the heap then. */
+int dbuf_map_file(dbuf_t *dbuf, int fd, unsigned long capacity)
 {
-        extern char **environ;
+        void *base;
 
-        /* CLOEXEC bit ensures our parent will see
-           the EOF in log pipe. */
-        fcntl(log_fd, F_SETFD, FD_CLOEXEC);
+        if (dbuf == NULL || fd < 0 ||
+            dbuf->pos != dbuf->base ||
+            capacity == 0UL || capacity > ULONG_MAX / 2UL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (size_file(fd, capacity) < 0)
+                return -1;
+
+        base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0L);
+        if (base == MAP_FAILED)
+                return -1;
+
+        dbuf_free(dbuf);
+        dbuf->pos = dbuf->base = base;
+        dbuf->capacity = capacity;
+        dbuf->fd = fd;
+
+        return 0;
+}
+
+/* The file mapped by dbuf_map_file gets the size of the content.
+   @dbuf is left in the initial state. */
+int dbuf_unmap_file(dbuf_t *dbuf)
+{
+        int rc;
+
+        if (dbuf == NULL || dbuf->fd < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        rc = ftruncate(dbuf->fd, (off_t) (dbuf->pos - dbuf->base));
+        dbuf_free(dbuf);
+
+        return rc;
+}
+
+void dbuf_free(dbuf_t *dbuf)
+{
+        if (dbuf == NULL)
+                return;
+
+        if (dbuf->fd >= 0) {
+                /* The file is the caller's */
+                munmap(dbuf->base, dbuf->capacity);
+                dbuf->fd = -1;
+                dbuf->base = dbuf->internal_buf;
+                dbuf->capacity = DBUF_INTERNAL_SIZE;
+        } else if (dbuf->base != dbuf->internal_buf) {
+                xfree(dbuf->base);
+                dbuf->base = dbuf->internal_buf;
+                dbuf->capacity = DBUF_INTERNAL_SIZE;
+        }
+
+        dbuf->pos = dbuf->base;
+}
+
+/***************************************
+ * Fast non-cryptographic hash (XXH64) *
+ ***************************************/
+
+static const unsigned long long xxh_p1 = 0x9E3779B185EBCA87ULL;
+static const unsigned long long xxh_p2 = 0xC2B2AE3D27D4EB4FULL;
+static const unsigned long long xxh_p3 = 0x165667B19E3779F9ULL;
+static const unsigned long long xxh_p4 = 0x85EBCA77C2B2AE63ULL;
+static const unsigned long long xxh_p5 = 0x27D4EB2F165667C5ULL;
+
+static unsigned long long xxh_rotl(unsigned long long x, unsigned int r)
+{
+        return (x << r) | (x >> (64U - r));
+}
+
+/* Input is read as little endian regardless of the host */
+static unsigned long long xxh_read64(const unsigned char *p)
+{
+        unsigned long long v = 0ULL;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(&v, p, sizeof(v));
+#else
+        unsigned int i;
+
+        for (i = 8U; i > 0U; i--)
+                v = (v << 8U) | p[i - 1U];
+#endif
+        return v;
+}
+
+static unsigned long long xxh_round(unsigned long long acc,
+                                    unsigned long long input)
+{
+        acc += input * xxh_p2;
+        acc = xxh_rotl(acc, 31U);
+        return acc * xxh_p1;
+}
+
+static unsigned long long xxh_merge(unsigned long long acc,
+                                    unsigned long long val)
+{
+        acc ^= xxh_round(0ULL, val);
+        return acc * xxh_p1 + xxh_p4;
+}
+
+/* Chaining is done by passing previous result as @seed */
+unsigned long long hash_buf(const void *data,
+                            unsigned long size,
+                            unsigned long long seed)
+{
+        const unsigned char *p = data, *const limit = p + size;
+        unsigned long long h;
+
+        if (size >= 32UL) {
+                unsigned long long v1 = seed + xxh_p1 + xxh_p2;
+                unsigned long long v2 = seed + xxh_p2;
+                unsigned long long v3 = seed;
+                unsigned long long v4 = seed - xxh_p1;
+
+                for (; limit - p >= 32L; p += 32) {
+                        v1 = xxh_round(v1, xxh_read64(p));
+                        v2 = xxh_round(v2, xxh_read64(p + 8));
+                        v3 = xxh_round(v3, xxh_read64(p + 16));
+                        v4 = xxh_round(v4, xxh_read64(p + 24));
+                }
+
+                h = (xxh_rotl(v1, 1U) + xxh_rotl(v2, 7U) +
+                     xxh_rotl(v3, 12U) + xxh_rotl(v4, 18U));
+                h = xxh_merge(h, v1);
+                h = xxh_merge(h, v2);
+                h = xxh_merge(h, v3);
+                h = xxh_merge(h, v4);
+        } else {
+                h = seed + xxh_p5;
+        }
+
+        h += (unsigned long long) size;
+
+        for (; limit - p >= 8L; p += 8) {
+                h ^= xxh_round(0ULL, xxh_read64(p));
+                h = xxh_rotl(h, 27U) * xxh_p1 + xxh_p4;
+        }
+
+        if (limit - p >= 4L) {
+                unsigned long long v;
+
+                v = ((unsigned long long) p[0] |
+                     (unsigned long long) p[1] << 8U |
+                     (unsigned long long) p[2] << 16U |
+                     (unsigned long long) p[3] << 24U);
+                h ^= v * xxh_p1;
+                h = xxh_rotl(h, 23U) * xxh_p2 + xxh_p3;
+                p += 4;
+        }
+
+        for (; p < limit; p++) {
+                h ^= (unsigned long long) *p * xxh_p5;
+                h = xxh_rotl(h, 11U) * xxh_p1;
+        }
+
+        h ^= h >> 33U;
+        h *= xxh_p2;
+        h ^= h >> 29U;
+        h *= xxh_p3;
+        h ^= h >> 32U;
+
+        return h;
+}
+
+/*******************************************
+ * Scanning kernels with runtime dispatch  *
+ *******************************************/
+
+/* Bytes adjust_style looks at: blanks, newline, '/', quotes,
+   ';', braces, parentheses and NUL */
+static int is_special(char ch)
+{
+        static unsigned char table[256];
+        static int is_ready = 0;
+
+        if (!is_ready) {
+                static const char special[] = " \f\r\t\v\n/;{}()\"'";
+                const char *chp;
+
+                table[0] = 1;
+                for (chp = special; *chp != '\0'; chp++)
+                        table[(unsigned char) *chp] = 1;
+                is_ready = 1;
+        }
+
+        return table[(unsigned char) ch];
+}
+
+/* Scalar variants define the behaviour of all others */
+
+static const char *scan_plain_scalar(const char *chp,
+                                     const char *const limit,
+                                     unsigned long *nr_nl_p)
+{
+        unsigned long nr_nl = 0UL;
+
+        for (; chp < limit && *chp != '#'; chp++)
+                nr_nl += (*chp == '\n');
+
+        *nr_nl_p += nr_nl;
+        return chp;
+}
+
+static const char *scan_special_scalar(const char *chp,
+                                       const char *const limit)
+{
+        for (; chp < limit && !is_special(*chp); chp++) ;
+
+        return chp;
+}
+
+static const char *scan_comment_end_scalar(const char *chp,
+                                           const char *const limit)
+{
+        for (; limit - chp >= 2; chp++) {
+                if (chp[0] == '*' && chp[1] == '/')
+                        return chp + 2;
+        }
+
+        return NULL;
+}
+
+static const char *scan_quote_scalar(const char *chp,
+                                     const char *const limit,
+                                     char quote)
+{
+        for (; chp < limit && *chp != quote && *chp != '\\' && *chp != '\n'; chp++) ;
+
+        return chp;
+}
+
+static const scan_kernels_t scalar_kernels = {
+        "scalar",
+        scan_plain_scalar,
+        scan_special_scalar,
+        scan_comment_end_scalar,
+        scan_quote_scalar,
+};
+
+#if defined(__x86_64__)
+/* SSE2 is a part of x86-64. Wider variants finish
+   their tails with narrower ones. */
+
+/* Bytes of @v within [@lo, @lo + @width] */
+static __m128i in_range_sse2(__m128i v,
+                             char lo,
+                             char width)
+{
+        __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+
+        return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(width)), d);
+}
+
+static const char *scan_plain_sse2(const char *chp,
+                                   const char *const limit,
+                                   unsigned long *nr_nl_p)
+{
+        const __m128i nl = _mm_set1_epi8('\n');
+        const __m128i hash = _mm_set1_epi8('#');
+        unsigned long nr_nl = 0UL;
+
+        for (; limit - chp >= 16; chp += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) chp);
+                unsigned int h_mask, nl_mask;
+
+                h_mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, hash));
+                nl_mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+                if (h_mask != 0U) {
+                        unsigned int idx = (unsigned int) __builtin_ctz(h_mask);
+
+                        nr_nl += (unsigned long) __builtin_popcount(nl_mask &
+                                                                    ((1U << idx) - 1U));
+                        *nr_nl_p += nr_nl;
+                        return chp + idx;
+                }
+
+                nr_nl += (unsigned long) __builtin_popcount(nl_mask);
+        }
+
+        *nr_nl_p += nr_nl;
+        return scan_plain_scalar(chp, limit, nr_nl_p);
+}
+
+static const char *scan_special_sse2(const char *chp,
+                                     const char *const limit)
+{
+        for (; limit - chp >= 16; chp += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) chp);
+                __m128i m;
+                unsigned int mask;
+
+                m = _mm_or_si128(in_range_sse2(v, '\t', '\r' - '\t'),
+                                 in_range_sse2(v, '\'', ')' - '\''));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('{')));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+
+                if ((mask = (unsigned int) _mm_movemask_epi8(m)) != 0U)
+                        return chp + __builtin_ctz(mask);
+        }
+
+        return scan_special_scalar(chp, limit);
+}
+
+static const char *scan_comment_end_sse2(const char *chp,
+                                         const char *const limit)
+{
+        const __m128i star = _mm_set1_epi8('*');
+        const __m128i slash = _mm_set1_epi8('/');
+
+        /* Second load is one byte ahead: it must fit too */
+        for (; limit - chp >= 17; chp += 16) {
+                __m128i a = _mm_loadu_si128((const __m128i *) chp);
+                __m128i b = _mm_loadu_si128((const __m128i *) (chp + 1));
+                unsigned int mask;
+
+                mask = (unsigned int) _mm_movemask_epi8(
+                        _mm_and_si128(_mm_cmpeq_epi8(a, star),
+                                      _mm_cmpeq_epi8(b, slash)));
+                if (mask != 0U)
+                        return chp + __builtin_ctz(mask) + 2;
+        }
+
+        return scan_comment_end_scalar(chp, limit);
+}
+
+static const char *scan_quote_sse2(const char *chp,
+                                   const char *const limit,
+                                   char quote)
+{
+        const __m128i q = _mm_set1_epi8(quote);
+        const __m128i bs = _mm_set1_epi8('\\');
+        const __m128i nl = _mm_set1_epi8('\n');
+
+        for (; limit - chp >= 16; chp += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) chp);
+                unsigned int mask;
+
+                mask = (unsigned int) _mm_movemask_epi8(
+                        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, q),
+                                                  _mm_cmpeq_epi8(v, bs)),
+                                     _mm_cmpeq_epi8(v, nl)));
+                if (mask != 0U)
+                        return chp + __builtin_ctz(mask);
+        }
+
+        return scan_quote_scalar(chp, limit, quote);
+}
+
+static const scan_kernels_t sse2_kernels = {
+        "sse2",
+        scan_plain_sse2,
+        scan_special_sse2,
+        scan_comment_end_sse2,
+        scan_quote_sse2,
+};
+
+#define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+
+AVX2_TARGET
+static __m256i in_range_avx2(__m256i v,
+                             char lo,
+                             char width)
+{
+        __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+
+        return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(width)), d);
+}
+
+AVX2_TARGET
+static const char *scan_plain_avx2(const char *chp,
+                                   const char *const limit,
+                                   unsigned long *nr_nl_p)
+{
+        const __m256i nl = _mm256_set1_epi8('\n');
+        const __m256i hash = _mm256_set1_epi8('#');
+        unsigned long nr_nl = 0UL;
+
+        for (; limit - chp >= 32; chp += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *) chp);
+                unsigned int h_mask, nl_mask;
+
+                h_mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, hash));
+                nl_mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+                if (h_mask != 0U) {
+                        /* @idx is below 32: the shift is defined */
+                        unsigned int idx = (unsigned int) __builtin_ctz(h_mask);
+
+                        nr_nl += (unsigned long) __builtin_popcount(nl_mask &
+                                                                    ((1U << idx) - 1U));
+                        *nr_nl_p += nr_nl;
+                        return chp + idx;
+                }
+
+                nr_nl += (unsigned long) __builtin_popcount(nl_mask);
+        }
+
+        *nr_nl_p += nr_nl;
+        return scan_plain_sse2(chp, limit, nr_nl_p);
+}
+
+AVX2_TARGET
+static const char *scan_special_avx2(const char *chp,
+                                     const char *const limit)
+{
+        for (; limit - chp >= 32; chp += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *) chp);
+                __m256i m;
+                unsigned int mask;
+
+                m = _mm256_or_si256(in_range_avx2(v, '\t', '\r' - '\t'),
+                                    in_range_avx2(v, '\'', ')' - '\''));
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')));
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}')));
+
+                if ((mask = (unsigned int) _mm256_movemask_epi8(m)) != 0U)
+                        return chp + __builtin_ctz(mask);
+        }
+
+        return scan_special_sse2(chp, limit);
+}
+
+AVX2_TARGET
+static const char *scan_comment_end_avx2(const char *chp,
+                                         const char *const limit)
+{
+        const __m256i star = _mm256_set1_epi8('*');
+        const __m256i slash = _mm256_set1_epi8('/');
+
+        for (; limit - chp >= 33; chp += 32) {
+                __m256i a = _mm256_loadu_si256((const __m256i *) chp);
+                __m256i b = _mm256_loadu_si256((const __m256i *) (chp + 1));
+                unsigned int mask;
+
+                mask = (unsigned int) _mm256_movemask_epi8(
+                        _mm256_and_si256(_mm256_cmpeq_epi8(a, star),
+                                         _mm256_cmpeq_epi8(b, slash)));
+                if (mask != 0U)
+                        return chp + __builtin_ctz(mask) + 2;
+        }
+
+        return scan_comment_end_sse2(chp, limit);
+}
+
+AVX2_TARGET
+static const char *scan_quote_avx2(const char *chp,
+                                   const char *const limit,
+                                   char quote)
+{
+        const __m256i q = _mm256_set1_epi8(quote);
+        const __m256i bs = _mm256_set1_epi8('\\');
+        const __m256i nl = _mm256_set1_epi8('\n');
+
+        for (; limit - chp >= 32; chp += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *) chp);
+                unsigned int mask;
+
+                mask = (unsigned int) _mm256_movemask_epi8(
+                        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, q),
+                                                        _mm256_cmpeq_epi8(v, bs)),
+                                        _mm256_cmpeq_epi8(v, nl)));
+                if (mask != 0U)
+                        return chp + __builtin_ctz(mask);
+        }
+
+        return scan_quote_sse2(chp, limit, quote);
+}
+
+static const scan_kernels_t avx2_kernels = {
+        "avx2",
+        scan_plain_avx2,
+        scan_special_avx2,
+        scan_comment_end_avx2,
+        scan_quote_avx2,
+};
+
+/* Masked loads never fault on bytes outside the mask:
+   tails need no narrower variant. */
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw,popcnt")))
+
+/* Mask of the first min(@len, 64) lanes */
+AVX512_TARGET
+static __mmask64 live_lanes(unsigned long len)
+{
+        return (len >= 64UL) ? ~(__mmask64) 0 : (((__mmask64) 1 << len) - 1);
+}
+
+AVX512_TARGET
+static __mmask64 in_range_avx512(__mmask64 live,
+                                 __m512i v,
+                                 char lo,
+                                 char width)
+{
+        return _mm512_mask_cmple_epu8_mask(live,
+                                           _mm512_sub_epi8(v, _mm512_set1_epi8(lo)),
+                                           _mm512_set1_epi8(width));
+}
+
+AVX512_TARGET
+static const char *scan_plain_avx512(const char *chp,
+                                     const char *const limit,
+                                     unsigned long *nr_nl_p)
+{
+        const __m512i nl = _mm512_set1_epi8('\n');
+        const __m512i hash = _mm512_set1_epi8('#');
+        unsigned long nr_nl = 0UL;
+
+        for (; chp < limit; chp += 64) {
+                __mmask64 live = live_lanes((unsigned long) (limit - chp));
+                __m512i v = _mm512_maskz_loadu_epi8(live, chp);
+                __mmask64 h_mask, nl_mask;
+
+                h_mask = _mm512_mask_cmpeq_epi8_mask(live, v, hash);
+                nl_mask = _mm512_mask_cmpeq_epi8_mask(live, v, nl);
+
+                if (h_mask != 0) {
+                        unsigned int idx = (unsigned int) __builtin_ctzll(h_mask);
+
+                        nr_nl += (unsigned long) __builtin_popcountll(nl_mask &
+                                                                      (((__mmask64) 1 << idx) - 1));
+                        *nr_nl_p += nr_nl;
+                        return chp + idx;
+                }
+
+                nr_nl += (unsigned long) __builtin_popcountll(nl_mask);
+
+                if (limit - chp <= 64)
+                        break;
+        }
+
+        *nr_nl_p += nr_nl;
+        return limit;
+}
+
+AVX512_TARGET
+static const char *scan_special_avx512(const char *chp,
+                                       const char *const limit)
+{
+        for (; chp < limit; chp += 64) {
+                __mmask64 live = live_lanes((unsigned long) (limit - chp));
+                __m512i v = _mm512_maskz_loadu_epi8(live, chp);
+                __mmask64 mask;
+
+                mask = in_range_avx512(live, v, '\t', '\r' - '\t') |
+                       in_range_avx512(live, v, '\'', ')' - '\'') |
+                       _mm512_mask_cmpeq_epi8_mask(live, v, _mm512_setzero_si512()) |
+                       _mm512_mask_cmpeq_epi8_mask(live, v, _mm512_set1_epi8(' ')) |
+                       _mm512_mask_cmpeq_epi8_mask(live, v, _mm512_set1_epi8('"')) |
+                       _mm512_mask_cmpeq_epi8_mask(live, v, _mm512_set1_epi8('/')) |
+                       _mm512_mask_cmpeq_epi8_mask(live, v, _mm512_set1_epi8(';')) |
+                       _mm512_mask_cmpeq_epi8_mask(live, v, _mm512_set1_epi8('{')) |
+                       _mm512_mask_cmpeq_epi8_mask(live, v, _mm512_set1_epi8('}'));
+
+                if (mask != 0)
+                        return chp + __builtin_ctzll(mask);
+
+                if (limit - chp <= 64)
+                        break;
+        }
+
+        return limit;
+}
+
+AVX512_TARGET
+static const char *scan_comment_end_avx512(const char *chp,
+                                           const char *const limit)
+{
+        const __m512i star = _mm512_set1_epi8('*');
+        const __m512i slash = _mm512_set1_epi8('/');
+
+        /* Lanes are positions of '*' followed by one more byte */
+        for (; limit - chp >= 2; chp += 64) {
+                __mmask64 live = live_lanes((unsigned long) (limit - chp) - 1UL);
+                __m512i a = _mm512_maskz_loadu_epi8(live, chp);
+                __m512i b = _mm512_maskz_loadu_epi8(live, chp + 1);
+                __mmask64 mask;
+
+                mask = _mm512_mask_cmpeq_epi8_mask(live, a, star) &
+                       _mm512_mask_cmpeq_epi8_mask(live, b, slash);
+                if (mask != 0)
+                        return chp + __builtin_ctzll(mask) + 2;
+        }
+
+        return NULL;
+}
+
+AVX512_TARGET
+static const char *scan_quote_avx512(const char *chp,
+                                     const char *const limit,
+                                     char quote)
+{
+        const __m512i q = _mm512_set1_epi8(quote);
+        const __m512i bs = _mm512_set1_epi8('\\');
+        const __m512i nl = _mm512_set1_epi8('\n');
+
+        for (; chp < limit; chp += 64) {
+                __mmask64 live = live_lanes((unsigned long) (limit - chp));
+                __m512i v = _mm512_maskz_loadu_epi8(live, chp);
+                __mmask64 mask;
+
+                mask = _mm512_mask_cmpeq_epi8_mask(live, v, q) |
+                       _mm512_mask_cmpeq_epi8_mask(live, v, bs) |
+                       _mm512_mask_cmpeq_epi8_mask(live, v, nl);
+                if (mask != 0)
+                        return chp + __builtin_ctzll(mask);
+
+                if (limit - chp <= 64)
+                        break;
+        }
+
+        return limit;
+}
+
+static const scan_kernels_t avx512_kernels = {
+        "avx512",
+        scan_plain_avx512,
+        scan_special_avx512,
+        scan_comment_end_avx512,
+        scan_quote_avx512,
+};
+#endif
+
+static const scan_kernels_t *supported_kernels[5];
+static const scan_kernels_t *active_kernels = &scalar_kernels;
+
+/* Runs before main(): the choice is made once per process */
+__attribute__((constructor))
+static void init_scan_kernels(void)
+{
+        const char *forced = getenv("X_SCAN_KERNELS");
+        unsigned long i, nr = 0UL;
+
+        supported_kernels[nr++] = &scalar_kernels;
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        supported_kernels[nr++] = &sse2_kernels;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+                supported_kernels[nr++] = &avx2_kernels;
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+                supported_kernels[nr++] = &avx512_kernels;
+#endif
+        supported_kernels[nr] = NULL;
+
+        /* The widest one unless another supported one is asked for */
+        active_kernels = supported_kernels[nr - 1UL];
+        for (i = 0UL; forced != NULL && i < nr; i++) {
+                if (strcmp(forced, supported_kernels[i]->name) == 0)
+                        active_kernels = supported_kernels[i];
+        }
+}
+
+const scan_kernels_t *const *scan_kernel_variants(void)
+{
+        return supported_kernels;
+}
+
+const char *scan_plain(const char *chp,
+                       const char *const limit,
+                       unsigned long *nr_nl_p)
+{
+        return active_kernels->scan_plain(chp, limit, nr_nl_p);
+}
+
+const char *scan_special(const char *chp,
+                         const char *const limit)
+{
+        return active_kernels->scan_special(chp, limit);
+}
+
+const char *scan_comment_end(const char *chp,
+                             const char *const limit)
+{
+        return active_kernels->scan_comment_end(chp, limit);
+}
+
+const char *scan_quote(const char *chp,
+                       const char *const limit,
+                       char quote)
+{
+        return active_kernels->scan_quote(chp, limit, quote);
+}
+
+/**************************
+ * General purpose logger *
+ **************************/
+
+void print_error_msg(int fd,
+                     int error_kind,
+                     const char *fmt,
+                     ...)
+{
+        va_list ap;
+        char scratch_mem[4096], *tail = scratch_mem;
+        unsigned long tail_room = sizeof(scratch_mem);
+        int rv, old_err_num = errno;
+
+        if (fd < 0)
+                fd = STDERR_FILENO;
+        if (error_kind < 0)
+                error_kind = old_err_num;
+
+        if (error_kind != 0) {
+                const char *error_dsc;
+
+                errno = 0;
+                error_dsc = strerror(error_kind);
+                if (error_dsc == NULL || errno != 0)
+                        error_dsc = "Unknown error";
+
+                rv = snprintf(tail,
+                              tail_room,
+                              "Failed with \"%s\"\n",
+                              error_dsc);
+                if (rv <= 0 || (unsigned long) rv >= tail_room)
+                        goto out;
+                tail += rv, tail_room -= (unsigned long) rv;
+        }
+
+        va_start(ap, fmt);
+        rv = vsnprintf(tail, tail_room, fmt, ap);
+        va_end(ap);
+        if (rv <= 0 || (unsigned long) rv >= tail_room)
+                goto out;
+        tail += rv, tail_room -= (unsigned long) rv;
+
+        if (tail[-1] != '\n')
+                *tail++ = '\n', tail_room--;
+
+        safe_write(fd, scratch_mem, sizeof(scratch_mem) - tail_room);
+
+out:
+        errno = old_err_num;
+}
+
+/*******************************************
+ * Enhanced (and convenient) child spawner *
+ *******************************************/
+
+static void run_child(char **argv,
+                      int log_fd,
+                      int in_fd,
+                      int out_fd)
+{
+        extern char **environ;
+
+        /* CLOEXEC bit ensures our parent will see
+           the EOF in log pipe. */
+        fcntl(log_fd, F_SETFD, FD_CLOEXEC);
+
+        if (in_fd >= 0) {
+                /* dup2 duplicates file descriptor
+                   with CLOEXEC bit cleared for the copy. */
+                if (dup2(in_fd, STDIN_FILENO) < 0) {
+                        print_error_msg(log_fd,
+                                        -1,
+                                        "In %s\n"
+                                        "At \"dup2(in_fd, STDIN_FILENO)\"",
+                                        __func__);
+                        goto fail;
+                }
+
+                
+                fcntl(in_fd, F_SETFD, FD_CLOEXEC);
+        }
+
+        if (out_fd >= 0) {
+                if (dup2(out_fd, STDOUT_FILENO) < 0) {
+                        print_error_msg(log_fd,
+                                        -1,
+                                        "In %s\n"
+                                        "At \"dup2(out_fd, STDOUT_FILENO)\"",
+                                        __func__);
+                        goto fail;
+                }
+
+                fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+        }
+
+        execve(argv[0], argv, environ);
+
+        print_error_msg(log_fd,
+                        -1,
+                        "In %s\n"
+                        "At \"execve\"",
+                        __func__);
+
+fail:
+        _exit(-1);
+}
+
+/* Hands pages of @buf to the pipe by reference instead of copying them.
+   The pages must stay intact until the reader has consumed them. */
+static long splice_to_pipe(int fd, const char *buf, unsigned long size)
+{
+        struct iovec iov_mem;
+        long rv, total = 0L;
+
+        while (size > 0UL) {
+                iov_mem.iov_base = (void *) buf;
+                iov_mem.iov_len = size > (unsigned long) LONG_MAX ?
+                                  (unsigned long) LONG_MAX : size;
+
+                rv = (long) vmsplice(fd, &iov_mem, 1UL, SPLICE_F_NONBLOCK);
+
+                if (rv < 0L && errno == EINTR)
+                        continue;
+
+                if (rv <= 0L || (unsigned long) rv > size)
+                        break;
+
+                buf += rv;
+                size -= (unsigned long) rv;
+                total += rv;
+        }
+
+        if (total > 0L) {
+                errno = 0;
+                return total;
+        } else if (rv == 0L) {
+                errno = ENOSPC;
+        }
+
+        return -1L;
+}
+
+/* Pushes as much of @*wbuf as the pipe accepts.
+   With @*splice_p set, pages are spliced (see splice_to_pipe);
+   it is cleared if the kernel refuses that.
+   Returns 0 if the pipe is still open, 1 if it has been closed
+   (everything is written or the child doesn't want more data),
+   -1 on error. */
+static int feed_child(int *wfd,
+                      char **wbuf,
+                      unsigned long *wsize,
+                      int close_on_empty,
+                      int *splice_p)
+{
+        long n;
+
+        while (*wsize > 0UL) {
+                if (splice_p != NULL && *splice_p) {
+                        n = splice_to_pipe(*wfd, *wbuf, *wsize);
+
+                        if (n < 0L && errno != EAGAIN && errno != EPIPE) {
+                                *splice_p = 0;
+                                continue;
+                        }
+                } else {
+                        n = safe_write(*wfd, *wbuf, *wsize);
+                }
+
+                if (n <= 0L)
+                        break;
+
+                *wbuf += n;
+                *wsize -= (unsigned long) n;
+        }
+
+        if ((*wsize == 0UL && close_on_empty) ||
+            (*wsize > 0UL && errno == EPIPE)) {
+                close(*wfd); *wfd = -1;
+                return 1;
+        }
+
+        if (*wsize > 0UL && errno != EAGAIN) {
+                print_error_msg(-1,
+                                -1,
+                                "In %s\n"
+                                "At \"write(*wfd)\"",
+                                __func__);
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Makes the pipe hold up to @size bytes (capped at 1 MiB, which
+   unprivileged users may always ask for) so the child is woken up
+   less often. Failure is harmless: the pipe keeps its size. */
+static void size_pipe(int fd, unsigned long size)
+{
+        static const unsigned long min_size = 1UL << 16UL;
+        unsigned long pipe_size = 1UL << 20UL;
+
+        while (pipe_size > min_size && pipe_size / 2UL >= size)
+                pipe_size /= 2UL;
+
+        for (; pipe_size > min_size; pipe_size /= 2UL) {
+                if (fcntl(fd, F_SETPIPE_SZ, (int) pipe_size) >= 0 ||
+                    errno != EPERM)
+                        break;
+        }
+}
+
+/* Appends everything the child has written so far to @rbuf.
+   Reads land directly in @rbuf which grows geometrically.
+   Closes @*rfd on EOF. */
+static int drain_child(int *rfd,
+                       dbuf_t *rbuf)
+{
+        /* The least room we offer to read() */
+        static const unsigned long min_room = 1UL << 16UL;
+        unsigned long room;
+        long n;
+
+        do {
+                if (dbuf_alloc(rbuf, min_room) == NULL) {
+                        print_error_msg(-1,
+                                        ERANGE,
+                                        "In %s\n"
+                                        "At \"dbuf_alloc\"",
+                                        __func__);
+                        return -1;
+                }
+
+                room = rbuf->capacity - (unsigned long) (rbuf->pos -
+                                                         rbuf->base);
+                if (room > (unsigned long) LONG_MAX)
+                        room = (unsigned long) LONG_MAX;
+
+                n = safe_read(*rfd,
+                              rbuf->pos,
+                              room);
+
+                if (n < 0L && errno == EAGAIN)
+                        break;
+
+                if (n == 0L) {
+                        close(*rfd); *rfd = -1;
+                        break;
+                }
+
+                if (n < 0L) {
+                        print_error_msg(-1,
+                                        -1,
+                                        "In %s\n"
+                                        "At \"read(*rfd)\"",
+                                        __func__);
+                        return -1;
+                }
+
+                rbuf->pos += n;
+
+                /* If n == room then there may be more data.
+                   Anyway, at least one read is required
+                   to find it out. */
+        } while ((unsigned long) n == room);
+
+        return 0;
+}
+
+static int communicate_child(int *wfd,
+                             int *rfd,
+                             char **wbuf,
+                             unsigned long *wsize,
+                             int *splice_p,
+                             dbuf_t *rbuf)
+{
+        struct pollfd pbuf[2U];
+        unsigned int pcount = 0U;
+        int revents;
+
+        memset(pbuf, 0, sizeof(pbuf));
+
+        if (*wfd >= 0) {
+                pbuf[0U].fd = *wfd;
+                pbuf[0U].events = POLLOUT;
+                pcount++;
+        }
+
+        if (*rfd >= 0) {
+                pbuf[pcount].fd = *rfd;
+                pbuf[pcount].events = POLLIN;
+                pcount++;
+        }
+
+        if (poll(pbuf, pcount, -1) < 0) {
+                print_error_msg(-1,
+                                -1,
+                                "In %s\n"
+                                "At \"poll\"",
+                                __func__);
+                return -1;
+        }
+
+        if (*wfd >= 0 && (revents = pbuf[0U].revents) != 0) {
+                if ((revents & POLLERR) != 0) {
+                        close(*wfd); *wfd = -1;
+                } else if ((revents & POLLOUT) != 0) {
+                        if (feed_child(wfd, wbuf, wsize, 1, splice_p) < 0)
+                                return -1;
+                } else {
+                        print_error_msg(-1,
+                                        -1,
+                                        "In %s\n"
+                                        "Spurious value from \"poll\": %d",
+                                        __func__,
+                                        revents);
+                        return -1;
+                }
+        }
+
+        if (*rfd >= 0 && (revents = pbuf[pcount - 1U].revents) != 0) {
+                if ((revents & POLLIN) != 0) {
+                        if (drain_child(rfd, rbuf) < 0)
+                                return -1;
+                } else {
+                        /* Probably, POLLHUP without any data */
+                        close(*rfd); *rfd = -1;
+                }
+        }
+
+        return 0;
+}
+
+static void close_child_fds(child_t *child)
+{
+        if (child->in_fd >= 0) {
+                close(child->in_fd);
+                child->in_fd = -1;
+        }
+
+        if (child->out_fd >= 0) {
+                close(child->out_fd);
+                child->out_fd = -1;
+        }
+}
+
+/* fork() + execve() backend.
+   Failures of the child before execve() are reported
+   through the log pipe. */
+static pid_t fork_child(char **argv,
+                        int in_fd,
+                        int out_fd)
+{
+        int log_fds[2] = { -1, -1 };
+        pid_t child_id = -1;
+        char scratch_mem[4096];
+        long n;
+
+        /*
+          Log pipe signals whether system error has occured
+          during process creation.
+          It is used for synchronization since we cannot rely on
+          exit codes: in general case, external program is capable of
+          exiting with arbitrary codes.
+          So it would be impossible to distinguish if something went wrong
+          because of our miscalculations.
+          Log pipe is going away upon successful call to execve()
+          which is ensured with CLOEXEC file descriptor bit.
+         */
+
+        if (pipe(log_fds) < 0) {
+                print_error_msg(-1,
+                                -1,
+                                "In %s\n"
+                                "At \"pipe(log_fds)\"",
+                                __func__);
+                goto fail;
+        }
+
+        if (log_fds[0] < 0 ||
+            log_fds[1] < 0) {
+                print_error_msg(-1,
+                                EBADF,
+                                "In %s\n"
+                                "At \"pipe(log_fds)\"",
+                                __func__);
+                goto fail;
+        }
+
+        fcntl(log_fds[0], F_SETFD, FD_CLOEXEC);
+
+        if ((child_id = fork()) < 0) {
+                print_error_msg(-1,
+                                -1,
+                                "In %s\nAt \"fork\"",
+                                __func__);
+                goto fail;
+        }
+
+        if (child_id == 0) {
+                close(log_fds[0]);
+                log_fds[0] = -1;
+
+                run_child(argv,
+                          log_fds[1],
+                          in_fd,
+                          out_fd);
+
+                /* Unreachable */
+                for (;;) ;
+        }
+
+        close(log_fds[1]);
+        log_fds[1] = -1;
+
+        /* We avoid printing error messages to console in the child process
+           so no message interleaving takes place. */
+        if ((n = safe_read(log_fds[0],
+                           scratch_mem,
+                           sizeof(scratch_mem))) != 0L) {
+                if (n < 0L) {
+                        print_error_msg(-1,
+                                        -1,
+                                        "In %s\n"
+                                        "At \"safe_read(log_fds[0])\"",
+                                        __func__);
+                } else {
+                        /* Print error message produced by our child */
+                        print_error_msg(-1,
+                                        0,
+                                        "%.*s",
+                                        (int) n,
+                                        scratch_mem);
+                }
+
+                goto fail;
+        }
+
+        close(log_fds[0]);
+
+        return child_id;
+
+fail:
+        if (child_id > 0) {
+                int ignored;
+
+                kill(child_id, SIGKILL);
+                waitpid(child_id, &ignored, 0);
+        }
+
+        if (log_fds[0] >= 0)
+                close(log_fds[0]);
+        if (log_fds[1] >= 0)
+                close(log_fds[1]);
+
+        return -1;
+}
+
+/* posix_spawn() backend.
+   glibc creates the child with clone(CLONE_VM | CLONE_VFORK),
+   so no page tables are copied however large our heap is.
+   It also reports failure of execve() as the return value,
+   which makes the log pipe unnecessary. */
+static pid_t spawn_child(char **argv,
+                         int in_fd,
+                         int out_fd)
+{
+        extern char **environ;
+        posix_spawn_file_actions_t fa_mem, *const fa = &fa_mem;
+        pid_t child_id = -1;
+        int rc;
+
+        if ((rc = posix_spawn_file_actions_init(fa)) != 0) {
+                print_error_msg(-1,
+                                rc,
+                                "In %s\n"
+                                "At \"posix_spawn_file_actions_init\"",
+                                __func__);
+                return -1;
+        }
+
+        /* dup2 duplicates file descriptor
+           with CLOEXEC bit cleared for the copy.
+           The originals are CLOEXEC and go away on execve. */
+        if ((in_fd >= 0 &&
+             (rc = posix_spawn_file_actions_adddup2(fa,
+                                                    in_fd,
+                                                    STDIN_FILENO)) != 0) ||
+            (out_fd >= 0 &&
+             (rc = posix_spawn_file_actions_adddup2(fa,
+                                                    out_fd,
+                                                    STDOUT_FILENO)) != 0)) {
+                print_error_msg(-1,
+                                rc,
+                                "In %s\n"
+                                "At \"posix_spawn_file_actions_adddup2\"",
+                                __func__);
+                goto out;
+        }
+
+        if ((rc = posix_spawn(&child_id, argv[0], fa, NULL,
+                              argv, environ)) != 0) {
+                print_error_msg(-1,
+                                rc,
+                                "In %s\n"
+                                "At \"execve\"",
+                                __func__);
+                child_id = -1;
+        }
+
+out:
+        posix_spawn_file_actions_destroy(fa);
+
+        return child_id;
+}
+
+int start_cmd(const child_ctx_t *ctx, child_t *child)
+{
+        int all_fds[4] = { -1, -1, -1, -1 };
+        int *const in_fds  = all_fds;
+        int *const out_fds = all_fds + 2;
+        pid_t child_id = -1;
+        int status, use_fork;
+        long n;
+
+        static int initialized = 0;
+
+        child->pid = -1;
+        child->in_fd = child->out_fd = -1;
+
+        if ((ctx->flags & ~(IO_BOTH | IO_TO_FD | IO_FROM_FD)) != 0 ||
+            (ctx->flags & (IO_TO | IO_TO_FD)) == (IO_TO | IO_TO_FD) ||
+            (ctx->flags & (IO_FROM | IO_FROM_FD)) == (IO_FROM | IO_FROM_FD) ||
+            ((ctx->flags & IO_TO_FD) != 0 && ctx->ifd < 0) ||
+            ((ctx->flags & IO_FROM_FD) != 0 && ctx->ofd < 0)) {
+                print_error_msg(-1,
+                                0,
+                                "In %s\n"
+                                "Invalid flags %d",
+                                __func__,
+                                ctx->flags);
+                goto fail;
+        }
+
+        switch (ctx->spawn) {
+        case SPAWN_DEFAULT:
+                use_fork = getenv("X_SPAWN_FORK") != NULL;
+                break;
+        case SPAWN_FORK:
+                use_fork = 1;
+                break;
+        case SPAWN_POSIX:
+                use_fork = 0;
+                break;
+        default:
+                print_error_msg(-1,
+                                0,
+                                "In %s\n"
+                                "Invalid spawn backend %d",
+                                __func__,
+                                ctx->spawn);
+                goto fail;
+        }
+
+        if (!initialized) {
+                struct sigaction sa_mem, *const sa = &sa_mem;
+
+                memset(sa, 0, sizeof(*sa));
+                sigemptyset(&sa->sa_mask);
+                sa->sa_handler = SIG_IGN;
+                sa->sa_flags = 0;
+
+                if (sigaction(SIGPIPE, sa, NULL) < 0) {
+                        print_error_msg(-1,
+                                        -1,
+                                        "In %s\n"
+                                        "At \"sigaction(SIGPIPE, SIG_IGN)\"",
+                                        __func__);
+                        goto fail;
+                }
+
+                initialized = 1;
+        }
+
+        /*
+          We create up to two pipes here:
+          + One pipe replaces stdout of the child process;
+          + Other pipe is used in place of stdin of the child process.
+          Both ends of the pipes are CLOEXEC: the child gets its ends
+          as dup2'ed copies, and several children may be alive at once
+          (see pump_cmd) so none of them should hold the pipes
+          of its siblings.
+         */
+
+        if ((ctx->flags & IO_TO) != 0) {
+                if (pipe(in_fds) < 0) {
+                        print_error_msg(-1,
+                                        -1,
+                                        "In %s\n"
+                                        "At \"pipe(in_fds)\"",
+                                        __func__);
+                        goto fail;
+                }
+
+                if (in_fds[0] < 0 ||
+                    in_fds[1] < 0) {
+                        print_error_msg(-1,
+                                        EBADF,
+                                        "In %s\n"
+                                        "At \"pipe(in_fds)\"",
+                                        __func__);
+                        goto fail;
+                }
+
+                fcntl(in_fds[0], F_SETFD, FD_CLOEXEC);
+                fcntl(in_fds[1], F_SETFD, FD_CLOEXEC);
+
+                /* We have to set our ends of pipe to non-blocking mode
+                   to avoid dead-lock. */
+                if ((status = fcntl(in_fds[1], F_GETFL)) < 0) {
+                        print_error_msg(-1,
+                                        -1,
+                                        "In %s\n"
+                                        "At \"fcntl(in_fds[1], F_GETFL)\"",
+                                        __func__);
+                        goto fail;
+                }
+
+                if (fcntl(in_fds[1], F_SETFL, status | O_NONBLOCK) < 0) {
+                        print_error_msg(-1,
+                                        -1,
+                                        "In %s\n"
+                                        "At \"fcntl(in_fds[1], F_SETFL)\"",
+                                        __func__);
+                        goto fail;
+                }
+        }
 
-        if (in_fd >= 0) {
-                /* dup2 duplicates file descriptor
-                   with CLOEXEC bit cleared for the copy. */
-                if (dup2(in_fd, STDIN_FILENO) < 0) {
-                        print_error_msg(log_fd,
+        if ((ctx->flags & IO_FROM) != 0) {
+                if (pipe(out_fds) < 0) {
+                        print_error_msg(-1,
                                         -1,
                                         "In %s\n"
-                                        "At \"dup2(in_fd, STDIN_FILENO)\"",
+                                        "At \"pipe(out_fds)\"",
                                         __func__);
                         goto fail;
                 }
 
-                
-                fcntl(in_fd, F_SETFD, FD_CLOEXEC);
-        }
+                if (out_fds[0] < 0 ||
+                    out_fds[1] < 0) {
+                        print_error_msg(-1,
+                                        EBADF,
+                                        "In %s\n"
+                                        "At \"pipe(out_fds)\"",
+                                        __func__);
+                        goto fail;
+                }
 
-        if (out_fd >= 0) {
-                if (dup2(out_fd, STDOUT_FILENO) < 0) {
-                        print_error_msg(log_fd,
+                fcntl(out_fds[0], F_SETFD, FD_CLOEXEC);
+                fcntl(out_fds[1], F_SETFD, FD_CLOEXEC);
+
+                if ((status = fcntl(out_fds[0], F_GETFL)) < 0) {
+                        print_error_msg(-1,
                                         -1,
                                         "In %s\n"
-                                        "At \"dup2(out_fd, STDOUT_FILENO)\"",
+                                        "At \"fcntl(out_fds[0], F_GETFL)\"",
                                         __func__);
                         goto fail;
                 }
 
-                fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+                if (fcntl(out_fds[0], F_SETFL, status | O_NONBLOCK) < 0) {
+                        print_error_msg(-1,
+                                        -1,
+                                        "In %s\n"
+                                        "At \"fcntl(out_fds[0], F_SETFL)\"",
+                                        __func__);
+                        goto fail;
+                }
         }
 
-        execve(argv[0], argv, environ);
+        /* Descriptors of @ctx stay open: they are the caller's */
+        if (use_fork)
+                child_id = fork_child(ctx->argv,
+                                      (ctx->flags & IO_TO_FD) ? ctx->ifd : in_fds[0],
+                                      (ctx->flags & IO_FROM_FD) ? ctx->ofd : out_fds[1]);
+        else
+                child_id = spawn_child(ctx->argv,
+                                       (ctx->flags & IO_TO_FD) ? ctx->ifd : in_fds[0],
+                                       (ctx->flags & IO_FROM_FD) ? ctx->ofd : out_fds[1]);
+
+        if (child_id < 0)
+                goto fail;
 
-        print_error_msg(log_fd,
-                        -1,
-                        "In %s\n"
-                        "At \"execve\"",
-                        __func__);
+        child->pid = child_id;
+
+        if (in_fds[0] >= 0) {
+                close(in_fds[0]);
+                in_fds[0] = -1;
+        }
+
+        if (out_fds[1] >= 0) {
+                close(out_fds[1]);
+                out_fds[1] = -1;
+        }
+
+        child->in_fd = in_fds[1];
+        child->out_fd = out_fds[0];
+
+        return 0;
 
 fail:
-        _exit(-1);
+        for (n = 0L;
+             n < (long) (sizeof(all_fds) / sizeof(all_fds[0]));
+             n++) {
+                if (all_fds[n] >= 0) {
+                        close(all_fds[n]);
+                        all_fds[n] = -1;
+                }
+        }
+
+        kill_cmd(child, SIGKILL);
+
+        return -1;
 }
 
-static int communicate_child(int *wfd,
-                             int *rfd,
-                             char **wbuf,
-                             char **rbuf,
-                             unsigned long *wsize,
-                             unsigned long *rsize)
+int wait_cmd(child_t *child)
+{
+        pid_t waitee_id;
+        int ret_code, status;
+
+        close_child_fds(child);
+
+        if (child->pid <= 0)
+                return -1;
+
+        if ((waitee_id = waitpid(child->pid, &status, 0)) < 0) {
+                print_error_msg(-1,
+                                -1,
+                                "In %s\n"
+                                "At \"waitpid\"",
+                                __func__);
+                goto fail;
+        }
+
+        if (waitee_id != child->pid || !(WIFEXITED(status) || WIFSIGNALED(status))) {
+                print_error_msg(-1,
+                                EFAULT,
+                                "In %s\n"
+                                "At \"waitpid\"",
+                                __func__);
+                goto fail;
+        }
+
+        child->pid = -1;
+
+        if (WIFSIGNALED(status)) {
+                print_error_msg(-1,
+                                0,
+                                "Child %d is killed by a signal",
+                                waitee_id);
+                return -1;
+        }
+
+        if ((ret_code = WEXITSTATUS(status)) != 0) {
+                print_error_msg(-1,
+                                0,
+                                "Child %d has returned %d\n",
+                                waitee_id,
+                                ret_code);
+                return -1;
+        }
+
+        return 0;
+
+fail:
+        kill_cmd(child, SIGKILL);
+        return -1;
+}
+
+void kill_cmd(child_t *child, int sig)
+{
+        /* Signal goes first: the child must not
+           take closed stdin for a regular EOF */
+        if (child->pid > 0)
+                kill(child->pid, sig);
+
+        close_child_fds(child);
+
+        if (child->pid > 0) {
+                int ignored;
+
+                waitpid(child->pid, &ignored, 0);
+                child->pid = -1;
+        }
+}
+
+int pump_cmd(child_t *src,
+             child_t *dst,
+             dbuf_t *obuf,
+             unsigned long *fed_p)
 {
         struct pollfd pbuf[2U];
         unsigned int pcount = 0U;
-        int need_close, revents;
-        long n;
+        int revents, need_feed;
+        unsigned long osize;
 
         memset(pbuf, 0, sizeof(pbuf));
 
-        if (*wfd >= 0) {
-                pbuf[0U].fd = *wfd;
-                pbuf[0U].events = POLLOUT;
+        /* Nothing is waiting for the consumer?
+           Then there is no point to be woken up by its pipe. */
+        osize = (unsigned long) (obuf->pos - obuf->base);
+        need_feed = (dst != NULL && dst->in_fd >= 0 && *fed_p < osize);
+
+        if (src->out_fd >= 0) {
+                pbuf[pcount].fd = src->out_fd;
+                pbuf[pcount].events = POLLIN;
                 pcount++;
         }
 
-        if (*rfd >= 0) {
-                pbuf[pcount].fd = *rfd;
-                pbuf[pcount].events = POLLIN;
+        if (need_feed) {
+                pbuf[pcount].fd = dst->in_fd;
+                pbuf[pcount].events = POLLOUT;
                 pcount++;
         }
 
+        if (pcount == 0U)
+                return 0;
+
         if (poll(pbuf, pcount, -1) < 0) {
                 print_error_msg(-1,
                                 -1,
@@ -548,438 +2428,686 @@ static int communicate_child(int *wfd,
                 return -1;
         }
 
-        if (*wfd >= 0 && (revents = pbuf[0U].revents) != 0) {
-                need_close = 0;
+        if (src->out_fd >= 0 && (revents = pbuf[0U].revents) != 0) {
+                if ((revents & POLLIN) != 0) {
+                        if (drain_child(&src->out_fd, obuf) < 0)
+                                return -1;
+                } else {
+                        close(src->out_fd); src->out_fd = -1;
+                }
+        }
 
+        if (need_feed && (revents = pbuf[pcount - 1U].revents) != 0) {
                 if ((revents & POLLERR) != 0) {
-                        need_close = 1;
+                        close(dst->in_fd); dst->in_fd = -1;
                 } else if ((revents & POLLOUT) != 0) {
-                        while (*wsize > 0UL && (n = safe_write(*wfd,
-                                                               *wbuf,
-                                                               *wsize)) > 0L) {
-                                *wbuf += n;
-                                *wsize -= (unsigned long) n;
-                        }
+                        /* The buffer may have moved since the last call */
+                        char *wbuf = obuf->base + *fed_p;
+                        unsigned long wsize;
+
+                        osize = (unsigned long) (obuf->pos - obuf->base);
+                        wsize = osize - *fed_p;
 
-                        if (*wsize == 0UL || errno == EPIPE) {
-                                need_close = 1;
-                        } else if (errno != EAGAIN) {
-                                print_error_msg(-1,
-                                                -1,
-                                                "In %s\n"
-                                                "At \"write(*wfd)\"",
-                                                __func__);
+                        /* No splicing: @obuf may be reallocated
+                           while the pipe still refers to its pages */
+                        if (feed_child(&dst->in_fd, &wbuf, &wsize, 0,
+                                       NULL) < 0)
                                 return -1;
-                        }
-                } else {
-                        print_error_msg(-1,
-                                        -1,
-                                        "In %s\n"
-                                        "Spurious value from \"poll\": %d",
-                                        __func__,
-                                        revents);
-                        return -1;
-                }
 
-                if (need_close) {
-                        close(*wfd); *wfd = -1;
+                        *fed_p = osize - wsize;
                 }
         }
 
-        if (*rfd >= 0 && (revents = pbuf[pcount - 1U].revents) != 0) {
-                need_close = 0;
-
-                if ((revents & POLLIN) != 0) {
-                        char scratch_mem[4096], *tmp;
-                        unsigned long old_rsize;
-
-                        do {
-                                n = safe_read(*rfd,
-                                              scratch_mem,
-                                              sizeof(scratch_mem));
+        return 0;
+}
 
-                                if (n < 0L && errno == EAGAIN)
-                                        break;
+/* Clears O_NONBLOCK set by start_cmd: io_uring would otherwise
+   complete requests on a full (empty) pipe with -EAGAIN
+   instead of waiting for it */
+static int set_blocking(int fd)
+{
+        int status;
 
-                                if (n == 0L) {
-                                        need_close = 1; break;
-                                }
+        if ((status = fcntl(fd, F_GETFL)) < 0 ||
+            fcntl(fd, F_SETFL, status & ~O_NONBLOCK) < 0) {
+                print_error_msg(-1,
+                                -1,
+                                "In %s\n"
+                                "At \"fcntl(fd, F_SETFL)\"",
+                                __func__);
+                return -1;
+        }
 
-                                if (n < 0L) {
-                                        print_error_msg(-1,
-                                                        -1,
-                                                        "In %s\n"
-                                                        "At \"read(*rfd)\"",
-                                                        __func__);
-                                        return -1;
-                                }
+        return 0;
+}
 
-                                old_rsize = *rsize;
-                                *rsize += (unsigned long) n;
-                                if (*rsize <= old_rsize) {
-                                        print_error_msg(-1,
-                                                        ERANGE,
-                                                        "In %s\n"
-                                                        "At \"read(*rfd)\"",
-                                                        __func__);
-                                        return -1;
-                                }
+#if defined(IORING_OFF_SQ_RING) && \
+    defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+typedef struct {
+        int fd;
+        unsigned int *sq_tail;
+        unsigned int *sq_mask;
+        unsigned int *sq_array;
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        char *sq_ptr;
+        char *cq_ptr;
+        unsigned long sq_size;
+        unsigned long cq_size;
+        unsigned long sqes_size;
+        unsigned int local_tail;  /* Published on ring_enter */
+        unsigned int nr_pending;  /* Queued, not submitted yet */
+        unsigned int nr_inflight; /* Submitted or queued, not completed */
+} ring_t;
+
+static void ring_free(ring_t *ring)
+{
+        if (ring->sqes != NULL)
+                munmap(ring->sqes, ring->sqes_size);
 
-                                if ((tmp = realloc(*rbuf, *rsize)) == NULL) {
-                                        print_error_msg(-1,
-                                                        -1,
-                                                        "In %s\n"
-                                                        "At \"realloc\"",
-                                                        __func__);
-                                        return -1;
-                                }
-                                *rbuf = tmp;
-                                memcpy(*rbuf + old_rsize, scratch_mem,
-                                       (unsigned long) n);
-
-                                /* If n == sizeof(scratch_mem) then
-                                   there may be more data.
-                                   Anyway, at least one read is required
-                                   to find it out. */
-                        } while ((unsigned long) n == sizeof(scratch_mem));
-                } else {
-                        /* Probably, POLLHUP without any data */
-                        need_close = 1;
-                }
+        if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+                munmap(ring->cq_ptr, ring->cq_size);
 
-                if (need_close) {
-                        close(*rfd); *rfd = -1;
-                }
-        }
+        if (ring->sq_ptr != NULL)
+                munmap(ring->sq_ptr, ring->sq_size);
 
-        return 0;
+        if (ring->fd >= 0)
+                close(ring->fd);
 }
 
-int run_cmd(const child_ctx_t *ctx)
+/* Returns -1 if io_uring is unavailable (or too old) */
+static int ring_init(ring_t *ring, unsigned int entries)
 {
-        int all_fds[6] = { -1, -1, -1, -1, -1, -1 };
-        int *const log_fds = all_fds;
-        int *const in_fds  = all_fds + 2;
-        int *const out_fds = all_fds + 4;
-        pid_t child_id = -1, waitee_id;
-        int ret_code, status;
+        struct io_uring_params params_mem, *const params = &params_mem;
+        void *ptr;
 
-        char *obuf = NULL; /* Data received from the child. */
-        unsigned long osize = 0UL; /* The amount of data produced by our child. */
-        char *ibuf = ctx->ibuf;
-        unsigned long isize = ctx->isize;
-        char scratch_mem[4096];
-        long n;
+        memset(ring, 0, sizeof(*ring));
+        memset(params, 0, sizeof(*params));
 
-        static int initialized = 0;
+        if ((ring->fd = (int) syscall(__NR_io_uring_setup,
+                                      entries,
+                                      params)) < 0)
+                return -1;
 
-        if ((ctx->flags & ~IO_BOTH) != 0) {
-                print_error_msg(-1,
-                                0,
-                                "In %s\n"
-                                "Invalid flags %d",
-                                __func__,
-                                ctx->flags);
+        /* Fast poll makes requests on pipes wait for readiness
+           instead of blocking worker threads (5.7+, which also
+           implies IORING_OP_READ and IORING_OP_WRITE) */
+        if ((params->features & IORING_FEAT_FAST_POLL) == 0 ||
+            (params->features & IORING_FEAT_NODROP) == 0)
                 goto fail;
+
+        ring->sq_size = params->sq_off.array +
+                        params->sq_entries * sizeof(unsigned int);
+        ring->cq_size = params->cq_off.cqes +
+                        params->cq_entries * sizeof(struct io_uring_cqe);
+
+        if ((params->features & IORING_FEAT_SINGLE_MMAP) != 0) {
+                if (ring->cq_size > ring->sq_size)
+                        ring->sq_size = ring->cq_size;
+                ring->cq_size = ring->sq_size;
         }
 
-        if ((ctx->flags & IO_TO) != 0 &&
-            (ctx->ibuf == NULL) != (ctx->isize == 0UL)) {
-                print_error_msg(-1,
-                                0,
-                                "In %s\n"
-                                "Parameters (IO_TO) contradict each other",
-                                __func__);
+        if ((ptr = mmap(NULL,
+                        ring->sq_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring->fd,
+                        IORING_OFF_SQ_RING)) == MAP_FAILED)
                 goto fail;
+
+        ring->sq_ptr = ptr;
+
+        if ((params->features & IORING_FEAT_SINGLE_MMAP) != 0) {
+                ring->cq_ptr = ring->sq_ptr;
+        } else {
+                if ((ptr = mmap(NULL,
+                                ring->cq_size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE,
+                                ring->fd,
+                                IORING_OFF_CQ_RING)) == MAP_FAILED)
+                        goto fail;
+
+                ring->cq_ptr = ptr;
         }
 
-        if ((ctx->flags & IO_FROM) != 0 &&
-            (ctx->obuf_p == NULL || ctx->osize_p == NULL)) {
-                print_error_msg(-1,
-                                0,
-                                "In %s\n"
-                                "Parameters (IO_FROM) are invalid",
-                                __func__);
+        ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+
+        if ((ptr = mmap(NULL,
+                        ring->sqes_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring->fd,
+                        IORING_OFF_SQES)) == MAP_FAILED)
                 goto fail;
-        }
 
-        if (!initialized) {
-                struct sigaction sa_mem, *const sa = &sa_mem;
+        ring->sqes = ptr;
 
-                memset(sa, 0, sizeof(*sa));
-                sigemptyset(&sa->sa_mask);
-                sa->sa_handler = SIG_IGN;
-                sa->sa_flags = 0;
+        ring->sq_tail  = (unsigned int *) (ring->sq_ptr + params->sq_off.tail);
+        ring->sq_mask  = (unsigned int *) (ring->sq_ptr + params->sq_off.ring_mask);
+        ring->sq_array = (unsigned int *) (ring->sq_ptr + params->sq_off.array);
+        ring->cq_head  = (unsigned int *) (ring->cq_ptr + params->cq_off.head);
+        ring->cq_tail  = (unsigned int *) (ring->cq_ptr + params->cq_off.tail);
+        ring->cq_mask  = (unsigned int *) (ring->cq_ptr + params->cq_off.ring_mask);
+        ring->cqes     = (struct io_uring_cqe *) (ring->cq_ptr +
+                                                  params->cq_off.cqes);
+        ring->local_tail = *ring->sq_tail;
 
-                if (sigaction(SIGPIPE, sa, NULL) < 0) {
-                        print_error_msg(-1,
-                                        -1,
-                                        "In %s\n"
-                                        "At \"sigaction(SIGPIPE, SIG_IGN)\"",
-                                        __func__);
-                        goto fail;
-                }
+        return 0;
 
-                initialized = 1;
-        }
+fail:
+        ring_free(ring);
+        return -1;
+}
 
-        /*
-          We create up to three pipes here:
-          + One pipe replaces stdout of the child process;
-          + Other pipe is used in place of stdin of the child process;
-          + Log pipe signals whether system error has occured
-          during process creation.
-          It is used for synchronization since we cannot rely on
-          exit codes: in general case, external program is capable of
-          exiting with arbitrary codes.
-          So it would be impossible to distinguish if something went wrong
-          because of our miscalculations.
-          Log pipe is going away upon successful call to execve()
-          which is ensured with CLOEXEC file descriptor bit.
-         */
+/* The caller must not queue more than the ring has entries
+   between two ring_enter calls */
+static struct io_uring_sqe *ring_queue(ring_t *ring,
+                                       int op,
+                                       int fd,
+                                       unsigned long long user_data)
+{
+        unsigned int idx = ring->local_tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[idx];
 
-        if (pipe(log_fds) < 0) {
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = (unsigned char) op;
+        sqe->fd = fd;
+        sqe->user_data = user_data;
+
+        ring->sq_array[idx] = idx;
+        ring->local_tail++;
+        ring->nr_pending++;
+        ring->nr_inflight++;
+
+        return sqe;
+}
+
+/* Submits queued requests and waits for at least @wait_nr completions
+   in a single syscall */
+static int ring_enter(ring_t *ring, unsigned int wait_nr)
+{
+        long rv;
+
+        __atomic_store_n(ring->sq_tail, ring->local_tail, __ATOMIC_RELEASE);
+
+        do {
+                rv = syscall(__NR_io_uring_enter,
+                             ring->fd,
+                             ring->nr_pending,
+                             wait_nr,
+                             IORING_ENTER_GETEVENTS,
+                             NULL,
+                             0UL);
+        } while (rv < 0L && errno == EINTR);
+
+        if (rv < 0L) {
                 print_error_msg(-1,
                                 -1,
                                 "In %s\n"
-                                "At \"pipe(log_fds)\"",
+                                "At \"io_uring_enter\"",
                                 __func__);
-                goto fail;
+                return -1;
         }
 
-        if (log_fds[0] < 0 ||
-            log_fds[1] < 0) {
+        ring->nr_pending -= (unsigned int) rv;
+
+        return 0;
+}
+
+/* Takes the next completion, if any */
+static int ring_reap(ring_t *ring,
+                     unsigned long long *user_data_p,
+                     int *res_p)
+{
+        unsigned int head = *ring->cq_head;
+        const struct io_uring_cqe *cqe;
+
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+                return 0;
+
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        *user_data_p = cqe->user_data;
+        *res_p = cqe->res;
+
+        __atomic_store_n(ring->cq_head, head + 1U, __ATOMIC_RELEASE);
+        ring->nr_inflight--;
+
+        return 1;
+}
+
+/* Request kinds are kept in the low bits of user_data */
+#define RING_WRITE  0ULL
+#define RING_READ   1ULL
+#define RING_EXIT   2ULL
+#define RING_CANCEL 3ULL
+#define RING_DATA(i, kind) (((unsigned long long) (i) << 2ULL) | (kind))
+
+/* At most 1 MiB per write: a short write is followed by another one */
+static void ring_write(ring_t *ring,
+                       const child_io_t *io,
+                       unsigned long i)
+{
+        struct io_uring_sqe *sqe;
+        unsigned long size = io->isize;
+
+        if (size > (1UL << 20UL))
+                size = 1UL << 20UL;
+
+        sqe = ring_queue(ring,
+                         IORING_OP_WRITE,
+                         io->child->in_fd,
+                         RING_DATA(i, RING_WRITE));
+        sqe->addr = (unsigned long long) (unsigned long) io->ibuf;
+        sqe->len = (unsigned int) size;
+        sqe->off = (unsigned long long) -1LL;
+}
+
+static int ring_read(ring_t *ring,
+                     const child_io_t *io,
+                     unsigned long i)
+{
+        /* The least room we offer to read(), as in drain_child */
+        static const unsigned long min_room = 1UL << 16UL;
+        struct io_uring_sqe *sqe;
+        unsigned long room;
+
+        if (dbuf_alloc(io->obuf, min_room) == NULL) {
                 print_error_msg(-1,
-                                EBADF,
+                                ERANGE,
                                 "In %s\n"
-                                "At \"pipe(log_fds)\"",
+                                "At \"dbuf_alloc\"",
                                 __func__);
-                goto fail;
+                return -1;
         }
 
-        if ((ctx->flags & IO_TO) != 0) {
-                if (pipe(in_fds) < 0) {
-                        print_error_msg(-1,
-                                        -1,
-                                        "In %s\n"
-                                        "At \"pipe(in_fds)\"",
-                                        __func__);
-                        goto fail;
-                }
+        room = io->obuf->capacity - (unsigned long) (io->obuf->pos -
+                                                     io->obuf->base);
+        if (room > (unsigned long) INT_MAX)
+                room = (unsigned long) INT_MAX;
 
-                if (in_fds[0] < 0 ||
-                    in_fds[1] < 0) {
-                        print_error_msg(-1,
-                                        EBADF,
-                                        "In %s\n"
-                                        "At \"pipe(in_fds)\"",
-                                        __func__);
-                        goto fail;
-                }
+        sqe = ring_queue(ring,
+                         IORING_OP_READ,
+                         io->child->out_fd,
+                         RING_DATA(i, RING_READ));
+        sqe->addr = (unsigned long long) (unsigned long) io->obuf->pos;
+        sqe->len = (unsigned int) room;
+        sqe->off = (unsigned long long) -1LL;
 
-                /* We have to set our ends of pipe to non-blocking mode
-                   to avoid dead-lock. */
-                if ((status = fcntl(in_fds[1], F_GETFL)) < 0) {
+        return 0;
+}
+
+/* Handles one completion. Every child has at most one request
+   of each kind in flight, so its buffers stay put meanwhile. */
+static int ring_complete(ring_t *ring,
+                         child_io_t *ios,
+                         int *pidfds,
+                         unsigned long long user_data,
+                         int res)
+{
+        const unsigned long i = (unsigned long) (user_data >> 2ULL);
+        child_io_t *const io = &ios[i];
+
+        switch (user_data & 3ULL) {
+        case RING_WRITE:
+                if (res == -EINTR || res == -EAGAIN) {
+                        ring_write(ring, io, i);
+                } else if (res == -EPIPE) {
+                        /* The child doesn't want more data */
+                        close(io->child->in_fd); io->child->in_fd = -1;
+                } else if (res <= 0 || (unsigned long) res > io->isize) {
                         print_error_msg(-1,
-                                        -1,
+                                        res < 0 ? -res : ENOSPC,
                                         "In %s\n"
-                                        "At \"fcntl(in_fds[1], F_GETFL)\"",
+                                        "At \"IORING_OP_WRITE\"",
                                         __func__);
-                        goto fail;
+                        return -1;
+                } else {
+                        io->ibuf += res;
+                        io->isize -= (unsigned long) res;
+
+                        if (io->isize > 0UL) {
+                                ring_write(ring, io, i);
+                        } else {
+                                close(io->child->in_fd);
+                                io->child->in_fd = -1;
+                        }
                 }
-
-                if (fcntl(in_fds[1], F_SETFL, status | O_NONBLOCK) < 0) {
+                break;
+        case RING_READ:
+                if (res == -EINTR || res == -EAGAIN) {
+                        return ring_read(ring, io, i);
+                } else if (res < 0) {
                         print_error_msg(-1,
-                                        -1,
+                                        -res,
                                         "In %s\n"
-                                        "At \"fcntl(in_fds[1], F_SETFL)\"",
+                                        "At \"IORING_OP_READ\"",
                                         __func__);
-                        goto fail;
+                        return -1;
+                } else if (res == 0) {
+                        close(io->child->out_fd); io->child->out_fd = -1;
+                } else {
+                        io->obuf->pos += res;
+                        return ring_read(ring, io, i);
                 }
+                break;
+        case RING_EXIT:
+                /* The child is reaped by wait_cmd once its pipes
+                   are closed too (a grandchild may still hold them) */
+                close(pidfds[i]); pidfds[i] = -1;
+                break;
+        default:
+                break;
         }
 
-        if ((ctx->flags & IO_FROM) != 0) {
-                if (pipe(out_fds) < 0) {
-                        print_error_msg(-1,
-                                        -1,
-                                        "In %s\n"
-                                        "At \"pipe(out_fds)\"",
-                                        __func__);
-                        goto fail;
-                }
+        return 0;
+}
 
-                if (out_fds[0] < 0 ||
-                    out_fds[1] < 0) {
-                        print_error_msg(-1,
-                                        EBADF,
-                                        "In %s\n"
-                                        "At \"pipe(out_fds)\"",
-                                        __func__);
-                        goto fail;
-                }
+/* Returns 1 if io_uring can't be used: nothing is done then */
+static int ring_drive(child_io_t *ios, unsigned long nr_ios)
+{
+        ring_t ring_mem, *const ring = &ring_mem;
+        unsigned long long user_data;
+        unsigned long i;
+        int *pidfds, res, rc = 0;
 
-                if ((status = fcntl(out_fds[0], F_GETFL)) < 0) {
-                        print_error_msg(-1,
-                                        -1,
-                                        "In %s\n"
-                                        "At \"fcntl(out_fds[0], F_GETFL)\"",
-                                        __func__);
-                        goto fail;
+        /* Up to 3 requests per child in flight, and as many cancels */
+        if (nr_ios == 0UL || nr_ios > (1UL << 10UL) ||
+            ring_init(ring, (unsigned int) (nr_ios * 3UL)) < 0)
+                return 1;
+
+        pidfds = xmalloc(nr_ios * sizeof(*pidfds));
+
+        for (i = 0UL; i < nr_ios; i++) {
+                child_t *const child = ios[i].child;
+
+                pidfds[i] = -1;
+
+                if (child->in_fd >= 0) {
+                        if (set_blocking(child->in_fd) < 0)
+                                goto fail;
+
+                        if (ios[i].isize == 0UL) {
+                                close(child->in_fd); child->in_fd = -1;
+                        } else {
+                                size_pipe(child->in_fd, ios[i].isize);
+                                ring_write(ring, &ios[i], i);
+                        }
                 }
 
-                if (fcntl(out_fds[0], F_SETFL, status | O_NONBLOCK) < 0) {
-                        print_error_msg(-1,
-                                        -1,
-                                        "In %s\n"
-                                        "At \"fcntl(out_fds[0], F_SETFL)\"",
-                                        __func__);
+                if (child->out_fd >= 0 &&
+                    (set_blocking(child->out_fd) < 0 ||
+                     ring_read(ring, &ios[i], i) < 0))
                         goto fail;
-                }
-        }
 
-        if ((child_id = fork()) < 0) {
-                print_error_msg(-1,
-                                -1,
-                                "In %s\nAt \"fork\"",
-                                __func__);
-                goto fail;
+#if defined(__NR_pidfd_open)
+                if ((pidfds[i] = (int) syscall(__NR_pidfd_open,
+                                               child->pid,
+                                               0)) >= 0)
+                        ring_queue(ring,
+                                   IORING_OP_POLL_ADD,
+                                   pidfds[i],
+                                   RING_DATA(i, RING_EXIT))->poll32_events = POLLIN;
+#endif
         }
 
-        if (child_id == 0) {
-                close(log_fds[0]);
-                log_fds[0] = -1;
+        while (ring->nr_inflight > 0U) {
+                if (ring_enter(ring, 1U) < 0)
+                        goto fail;
 
-                if (in_fds[1] >= 0) {
-                        close(in_fds[1]);
-                        in_fds[1] = -1;
+                while (ring_reap(ring, &user_data, &res)) {
+                        if (ring_complete(ring, ios, pidfds,
+                                          user_data, res) < 0)
+                                goto fail;
                 }
+        }
 
-                if (out_fds[0] >= 0) {
-                        close(out_fds[0]);
-                        out_fds[0] = -1;
-                }
+        goto out;
 
-                run_child(ctx->argv,
-                          log_fds[1],
-                          in_fds[0],
-                          out_fds[1]);
+fail:
+        rc = -1;
 
-                /* Unreachable */
-                for (;;) ;
+        /* No request may outlive the buffers it refers to */
+        for (i = 0UL; i < nr_ios; i++) {
+                if (ios[i].child->pid > 0)
+                        kill(ios[i].child->pid, SIGKILL);
         }
 
-        close(log_fds[1]);
-        log_fds[1] = -1;
+        if (ring->nr_inflight > 0U) {
+                ring_queue(ring,
+                           IORING_OP_ASYNC_CANCEL,
+                           -1,
+                           RING_DATA(0UL, RING_CANCEL))->cancel_flags =
+                        IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
 
-        if (in_fds[0] >= 0) {
-                close(in_fds[0]);
-                in_fds[0] = -1;
+                while (ring->nr_inflight > 0U && ring_enter(ring, 1U) == 0) {
+                        while (ring_reap(ring, &user_data, &res)) ;
+                }
         }
 
-        if (out_fds[1] >= 0) {
-                close(out_fds[1]);
-                out_fds[1] = -1;
+out:
+        for (i = 0UL; i < nr_ios; i++) {
+                if (pidfds[i] >= 0)
+                        close(pidfds[i]);
         }
 
-        /* We avoid printing error messages to console in the child process
-           so no message interleaving takes place. */
-        if ((n = safe_read(log_fds[0],
-                           scratch_mem,
-                           sizeof(scratch_mem))) != 0L) {
-                if (n < 0L) {
+        xfree(pidfds);
+        ring_free(ring);
+
+        return rc;
+}
+
+#else
+
+static int ring_drive(child_io_t *ios, unsigned long nr_ios)
+{
+        (void) ios;
+        (void) nr_ios;
+
+        return 1;
+}
+
+#endif
+
+static int poll_drive(child_io_t *ios, unsigned long nr_ios)
+{
+        struct pollfd *pbuf = xmalloc(2UL * nr_ios * sizeof(*pbuf));
+        unsigned long i, pcount;
+        int revents, rc = 0;
+
+        for (;;) {
+                for (i = 0UL, pcount = 0UL; i < nr_ios; i++) {
+                        const child_t *const child = ios[i].child;
+
+                        if (child->in_fd >= 0) {
+                                pbuf[pcount].fd = child->in_fd;
+                                pbuf[pcount].events = POLLOUT;
+                                pbuf[pcount].revents = 0;
+                                pcount++;
+                        }
+
+                        if (child->out_fd >= 0) {
+                                pbuf[pcount].fd = child->out_fd;
+                                pbuf[pcount].events = POLLIN;
+                                pbuf[pcount].revents = 0;
+                                pcount++;
+                        }
+                }
+
+                if (pcount == 0UL)
+                        break;
+
+                if (poll(pbuf, pcount, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+
                         print_error_msg(-1,
                                         -1,
                                         "In %s\n"
-                                        "At \"safe_read(log_fds[0])\"",
+                                        "At \"poll\"",
                                         __func__);
-                } else {
-                        /* Print error message produced by our child */
-                        print_error_msg(-1,
-                                        0,
-                                        "%.*s",
-                                        (int) n,
-                                        scratch_mem);
+                        rc = -1;
+                        break;
                 }
 
-                goto fail;
+                /* Descriptors are visited in the same order as above */
+                for (i = 0UL, pcount = 0UL; rc == 0 && i < nr_ios; i++) {
+                        child_t *const child = ios[i].child;
+
+                        if (child->in_fd >= 0 &&
+                            (revents = pbuf[pcount++].revents) != 0) {
+                                if ((revents & POLLOUT) != 0) {
+                                        if (feed_child(&child->in_fd,
+                                                       &ios[i].ibuf,
+                                                       &ios[i].isize,
+                                                       1,
+                                                       NULL) < 0)
+                                                rc = -1;
+                                } else {
+                                        close(child->in_fd); child->in_fd = -1;
+                                }
+                        }
+
+                        if (rc == 0 && child->out_fd >= 0 &&
+                            (revents = pbuf[pcount++].revents) != 0) {
+                                if ((revents & POLLIN) != 0) {
+                                        if (drain_child(&child->out_fd,
+                                                        ios[i].obuf) < 0)
+                                                rc = -1;
+                                } else {
+                                        /* Probably, POLLHUP without any data */
+                                        close(child->out_fd); child->out_fd = -1;
+                                }
+                        }
+                }
+
+                if (rc < 0)
+                        break;
         }
 
-        close(log_fds[0]);
-        log_fds[0] = -1;
+        xfree(pbuf);
 
-        while (in_fds[1] >= 0 || out_fds[0] >= 0) {
-                if (communicate_child(&in_fds[1], &out_fds[0],
-                                      &ibuf, &obuf,
-                                      &isize, &osize) < 0)
-                        goto fail;
+        return rc;
+}
+
+int drive_cmds(child_io_t *ios, unsigned long nr_ios)
+{
+        unsigned long i;
+        int rc = 1;
+
+        if (getenv("X_IO_URING") != NULL)
+                rc = ring_drive(ios, nr_ios);
+
+        if (rc > 0)
+                rc = poll_drive(ios, nr_ios);
+
+        for (i = 0UL; i < nr_ios; i++) {
+                if (rc < 0) {
+                        kill_cmd(ios[i].child, SIGKILL);
+                        ios[i].status = -1;
+                } else {
+                        ios[i].status = wait_cmd(ios[i].child);
+                }
         }
 
-        if ((waitee_id = waitpid(child_id, &status, 0)) < 0) {
+        return rc;
+}
+
+int run_cmd(const child_ctx_t *ctx)
+{
+        child_t child_mem;
+        dbuf_t obuf_mem, *const obuf = &obuf_mem; /* Data received from the child. */
+        char *ibuf = ctx->ibuf;
+        unsigned long isize = ctx->isize;
+        /* @ibuf is not touched until the child is reaped */
+        int use_splice = getenv("X_VMSPLICE") != NULL;
+
+        child_mem.pid = -1;
+        child_mem.in_fd = child_mem.out_fd = -1;
+        dbuf_init(obuf);
+
+        if ((ctx->flags & IO_TO) != 0 &&
+            (ctx->ibuf == NULL) != (ctx->isize == 0UL)) {
                 print_error_msg(-1,
-                                -1,
+                                0,
                                 "In %s\n"
-                                "At \"waitpid\"",
+                                "Parameters (IO_TO) contradict each other",
                                 __func__);
                 goto fail;
         }
 
-        if (waitee_id != child_id || !(WIFEXITED(status) || WIFSIGNALED(status))) {
+        if ((ctx->flags & IO_FROM) != 0 &&
+            (ctx->obuf_p == NULL || ctx->osize_p == NULL ||
+             (ctx->spill_size != 0UL && ctx->ofd_p == NULL))) {
                 print_error_msg(-1,
-                                EFAULT,
+                                0,
                                 "In %s\n"
-                                "At \"waitpid\"",
+                                "Parameters (IO_FROM) are invalid",
                                 __func__);
                 goto fail;
         }
 
-        child_id = -1;
-
-        if (WIFSIGNALED(status)) {
-                print_error_msg(-1,
-                                0,
-                                "Child %d is killed by a signal",
-                                waitee_id);
-                goto fail;
-        }
+        if ((ctx->flags & IO_FROM) != 0)
+                dbuf_set_spill(obuf, ctx->spill_size);
 
-        if ((ret_code = WEXITSTATUS(status)) != 0) {
-                print_error_msg(-1,
-                                0,
-                                "Child %d has returned %d\n",
-                                waitee_id,
-                                ret_code);
+        if (start_cmd(ctx, &child_mem) < 0)
                 goto fail;
-        }
 
-        if ((ctx->flags & IO_FROM) != 0) {
-                *ctx->obuf_p = obuf;
-                *ctx->osize_p = osize;
-        }
+        if (getenv("X_IO_URING") != NULL) {
+                child_io_t io_mem;
 
-        return 0;
+                io_mem.child = &child_mem;
+                io_mem.ibuf = ibuf;
+                io_mem.isize = isize;
+                io_mem.obuf = obuf;
 
-fail:
-        if (child_id > 0) {
-                int ignored;
+                if (drive_cmds(&io_mem, 1UL) < 0 || io_mem.status < 0)
+                        goto fail;
+        } else {
+                if (child_mem.in_fd >= 0)
+                        size_pipe(child_mem.in_fd, isize);
+
+                while (child_mem.in_fd >= 0 || child_mem.out_fd >= 0) {
+                        if (communicate_child(&child_mem.in_fd,
+                                              &child_mem.out_fd,
+                                              &ibuf, &isize, &use_splice,
+                                              obuf) < 0)
+                                goto fail;
+                }
 
-                kill(child_id, SIGKILL);
-                waitpid(child_id, &ignored, 0);
-                child_id = -1;
+                if (wait_cmd(&child_mem) < 0)
+                        goto fail;
         }
 
-        for (n = 0L;
-             n < (long) (sizeof(all_fds) / sizeof(all_fds[0]));
-             n++) {
-                if (all_fds[n] >= 0) {
-                        close(all_fds[n]);
-                        all_fds[n] = -1;
+        if ((ctx->flags & IO_FROM) != 0 && obuf->fd >= 0) {
+                int fd = obuf->fd;
+
+                /* Cut to the size of the output */
+                *ctx->osize_p = (unsigned long) (obuf->pos - obuf->base);
+                if (dbuf_unmap_file(obuf) < 0) {
+                        close(fd);
+                        goto fail;
                 }
-        }
 
-        if (obuf != NULL) {
-                free(obuf);
-                obuf = NULL; osize = 0UL;
+                *ctx->obuf_p = NULL;
+                *ctx->ofd_p = fd;
+        } else if ((ctx->flags & IO_FROM) != 0) {
+                *ctx->obuf_p = dbuf_detach_text(obuf, ctx->osize_p);
+                if (ctx->ofd_p != NULL)
+                        *ctx->ofd_p = -1;
         }
 
+        return 0;
+
+fail:
+        kill_cmd(&child_mem, SIGKILL);
+        if (obuf->fd >= 0)
+                close(obuf->fd);
+        dbuf_free(obuf);
+
         return -1;
 }